@@ -0,0 +1,119 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+/*
+ * Frames are decoded into a single buffer: keyframes overwrite it, and
+ * deltas decompress their changed pixels to scratch and copy each dirty
+ * rectangle into place, leaving the rest of the previous frame untouched.
+ */
+
+static uint32_t read_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static const uint8_t *frame_data(const Animation *anim, unsigned frame) {
+    return anim->src + read_u32(anim->src + ANIM_HEADER_SIZE + 4 * frame);
+}
+
+static int decode_frame(Animation *anim, unsigned frame) {
+    const uint8_t *p = frame_data(anim, frame);
+    const uint8_t *rects;
+    uint16_t *src;
+    uint8_t type = *p++, codec = *p++, nrects;
+    size_t n = 0;
+    unsigned i;
+
+    if (type == ANIM_KEYFRAME) {
+        if (image_decode(codec, anim->pixels, p, (size_t)anim->width * anim->height))
+            return 1;
+        anim->frame = frame;
+        return 0;
+    }
+
+    nrects = *p++;
+    rects = p;
+    for (i = 0; i < nrects; i++, p += 6)
+        n += (size_t)(p[3] << 8 | p[4]) * p[5];
+    if (image_decode(codec, anim->scratch, p, n))
+        return 1;
+
+    src = anim->scratch;
+    for (i = 0; i < nrects; i++, rects += 6) {
+        unsigned x = rects[0] << 8 | rects[1], y = rects[2];
+        unsigned w = rects[3] << 8 | rects[4], h = rects[5];
+        uint16_t *dst = anim->pixels + (size_t)anim->width * y + x;
+        while (h--) {
+            memcpy(dst, src, 2 * w);
+            src += w;
+            dst += anim->width;
+        }
+    }
+    anim->frame = frame;
+    return 0;
+}
+
+/*
+ * Open the animation at src, which must stay valid until anim_close, and
+ * decode its first frame.  Returns NULL if out of memory or there is no
+ * first frame to decode.
+ */
+Animation *anim_open(const void *src) {
+    const uint8_t *p = src;
+    size_t max_delta = read_u32(p + 8);
+    Animation *anim;
+
+    if (!(p[4] | p[5]) || !(anim = malloc(sizeof(Animation))))
+        return NULL;
+    anim->src = p;
+    anim->width = p[0] << 8 | p[1];
+    anim->height = p[2];
+    anim->nframes = p[4] << 8 | p[5];
+    anim->pixels = malloc(2 * (size_t)anim->width * anim->height);
+    anim->scratch = malloc(2 * max_delta + 2);
+    if (!anim->pixels || !anim->scratch || decode_frame(anim, 0)) {
+        anim_close(anim);
+        return NULL;
+    }
+    return anim;
+}
+
+/*
+ * Decode frame into anim->pixels, replaying deltas from the nearest
+ * keyframe unless frame follows the current one.  Returns nonzero on
+ * failure.
+ */
+int anim_seek(Animation *anim, unsigned frame) {
+    unsigned key;
+
+    if (frame >= anim->nframes)
+        return 1;
+    if (frame == anim->frame)
+        return 0;
+    if (frame == anim->frame + 1u)
+        return decode_frame(anim, frame);
+
+    key = frame;
+    while (key > 0 && *frame_data(anim, key) != ANIM_KEYFRAME)
+        key--;
+    if (key <= anim->frame && anim->frame < frame)
+        key = anim->frame + 1;  // Already partway there
+    for (; key <= frame; key++) {
+        if (decode_frame(anim, key))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Advance to the next frame, going back to the first after the last.
+ */
+int anim_next(Animation *anim) {
+    return anim_seek(anim, anim->frame + 1u < anim->nframes ? anim->frame + 1u : 0);
+}
+
+void anim_close(Animation *anim) {
+    free(anim->pixels);
+    free(anim->scratch);
+    free(anim);
+}
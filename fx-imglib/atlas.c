@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+/*
+ * An fxt atlas (see image.h) is an index of names and rectangles in front of
+ * a single fxi image.  The index is used where it lies in the file: entries
+ * are sorted by name for a binary search, and names are offsets into the
+ * table after them.  Only the image is decoded, once, when the atlas is
+ * opened.  Each image in it is then a view, an Image that points into the
+ * atlas's pixels or indices at its top left corner and keeps the atlas's
+ * stride, so nothing is copied until the view is drawn.
+ */
+
+/*
+ * Open the atlas at src, which must stay valid until atlas_close, and
+ * decode its image.  Returns NULL if out of memory or the image cannot be
+ * decoded.
+ */
+Atlas *atlas_open(const void *src) {
+    const uint8_t *p = src;
+    size_t names_size;
+    Atlas *atlas;
+
+    if (!(atlas = malloc(sizeof(Atlas))))
+        return NULL;
+    atlas->count = p[0] << 8 | p[1];
+    names_size = p[2] << 8 | p[3];
+    atlas->entries = p + ATLAS_HEADER_SIZE;
+    atlas->names = (const char *)atlas->entries +
+                   (size_t)ATLAS_ENTRY_SIZE * atlas->count;
+    // Decoded once; every image is a view into this
+    if (!(atlas->image = image_load(atlas->names + names_size))) {
+        free(atlas);
+        return NULL;
+    }
+    return atlas;
+}
+
+/*
+ * Fill view with image i of the atlas.  Returns nonzero if there is no such
+ * image.
+ */
+int atlas_get(const Atlas *atlas, unsigned i, Image *view) {
+    const uint8_t *e = atlas->entries + (size_t)ATLAS_ENTRY_SIZE * i;
+    const Image *img = atlas->image;
+    uint16_t x;
+    uint8_t y;
+
+    if (i >= atlas->count)
+        return 1;
+    x = e[2] << 8 | e[3];
+    y = e[4];
+    view->width = e[5] << 8 | e[6];
+    view->height = e[7];
+    view->bpp = img->bpp;
+    view->stride = img->stride;
+    view->palette = img->palette;
+    if (img->bpp == 16) {
+        view->data = img->data + (size_t)img->stride * y + x;
+        view->indices = NULL;
+    } else {
+        view->data = NULL;
+        view->indices = img->indices + (size_t)img->stride * y +
+                        (size_t)x * img->bpp / 8;
+    }
+    return 0;
+}
+
+/*
+ * Fill view with the image called name, found by binary search.  Returns
+ * nonzero if there is none.
+ */
+int atlas_find(const Atlas *atlas, const char *name, Image *view) {
+    unsigned lo = 0, hi = atlas->count;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        const uint8_t *e = atlas->entries + (size_t)ATLAS_ENTRY_SIZE * mid;
+        int c = strcmp(name, atlas->names + (e[0] << 8 | e[1]));
+        if (c == 0)
+            return atlas_get(atlas, mid, view);
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return 1;
+}
+
+void atlas_close(Atlas *atlas) {
+    free((void *)atlas->image);
+    free(atlas);
+}
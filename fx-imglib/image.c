@@ -1,17 +1,110 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "image.h"
 
+/*
+ * Decode n pixels stored with codec from src.  Returns nonzero if the codec
+ * is unknown.
+ */
+int image_decode(uint8_t codec, uint16_t *dst, const uint8_t *src, size_t n) {
+    // LZF is the common case, so test for it first
+    if (codec == IMAGE_CODEC_LZF)
+        lzf_decompress((uint8_t *)dst, src, 2 * n);
+    else if (codec == IMAGE_CODEC_RLE)
+        rle565_decompress(dst, src, n);
+    else if (codec == IMAGE_CODEC_RAW)
+        memcpy(dst, src, 2 * n);
+    else
+        return 1;
+    return 0;
+}
+
+static const Image *load_paletted(uint16_t width, uint8_t height, uint8_t codec,
+                                  const uint8_t *p) {
+    uint8_t bpp = *p++;
+    size_t ncolors = *p++ + 1;
+    size_t stride = ((size_t)width * bpp + 7) / 8;
+    Image *out;
+
+    if (!(out = malloc(sizeof(Image) + 2 * ncolors + stride * height)))
+        return NULL;
+    out->width = width;
+    out->height = height;
+    out->bpp = bpp;
+    out->data = NULL;
+    out->stride = stride;
+    out->palette = (uint16_t *)(out + 1);
+    out->indices = (uint8_t *)(out->palette + ncolors);
+
+    memcpy(out->palette, p, 2 * ncolors);
+    p += 2 * ncolors;
+    // Indices are bytes, so RLE-565 doesn't apply
+    if (codec == IMAGE_CODEC_LZF) {
+        lzf_decompress(out->indices, p, stride * height);
+    } else if (codec == IMAGE_CODEC_RAW) {
+        memcpy(out->indices, p, stride * height);
+    } else {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
 const Image *image_load(const void *src) {
+    const uint8_t *p = src;
     uint16_t width;
-    uint8_t height;
+    uint8_t height, format, codec;
+    size_t n;
     Image *out;
 
-    width = *src++ << 8;
-    width |= *src++;
-    height = *src++;
-    if (!(out = malloc(sizeof(Image) + 2 * width * height)))
+    width = *p++ << 8;
+    width |= *p++;
+    height = *p++;
+    format = *p++;
+    codec = format & IMAGE_CODEC_MASK;
+    if (format & IMAGE_PALETTED)
+        return load_paletted(width, height, codec, p);
+
+    n = (size_t)width * height;
+    if (!(out = malloc(sizeof(Image) + 2 * n)))
         return NULL;
+    out->width = width;
+    out->height = height;
+    out->bpp = 16;
+    out->stride = width;
+    out->data = (uint16_t *)(out + 1);
+    out->indices = NULL;
+    out->palette = NULL;
 
-    lzf_decompress(out, src, width * height * 2);
+    if (image_decode(codec, out->data, p, n)) {
+        free(out);
+        return NULL;
+    }
     return out;
 }
+
+/*
+ * Copy img as 565 pixels to dst, whose rows are stride pixels apart (so
+ * LCD_WIDTH_PX draws straight into VRAM).  Paletted images are expanded
+ * through their palette on the way.  img may be a view into an atlas.
+ */
+void image_copy(const Image *img, uint16_t *dst, size_t stride) {
+    unsigned y;
+
+    if (img->bpp == 16) {
+        const uint16_t *src = img->data;
+        for (y = 0; y < img->height; y++) {
+            memcpy(dst, src, 2 * img->width);
+            src += img->stride;
+            dst += stride;
+        }
+    } else {
+        const uint8_t *src = img->indices;
+        for (y = 0; y < img->height; y++) {
+            palette_expand(dst, src, img->palette, img->bpp, img->width);
+            src += img->stride;
+            dst += stride;
+        }
+    }
+}
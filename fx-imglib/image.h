@@ -1,11 +1,127 @@
+#include <stddef.h>
 #include <stdint.h>
 #ifndef _FXCG_IMAGE_H
 #define _FXCG_IMAGE_H
 
+/*
+ * An fxi file is a four byte header followed by the pixel stream:
+ *  wwwwwwww wwwwwwww   Width, big-endian
+ *  hhhhhhhh            Height
+ *  p000cccc            Codec the pixels are stored with, IMAGE_CODEC_*, and
+ *                      IMAGE_PALETTED if they are palette indices
+ * Pixels are big-endian 5-6-5 in row-major order once decoded.
+ *
+ * Paletted images continue the header with
+ *  bbbbbbbb            Bits per index: 1, 2, 4 or 8
+ *  nnnnnnnn            Palette size minus one
+ *  ...                 Palette, n + 1 big-endian 5-6-5 colors
+ * and store indices packed leftmost pixel in the high bits, each row padded
+ * to a whole byte.  Their stream is always raw or LZF.
+ */
+#define IMAGE_HEADER_SIZE 4
+#define IMAGE_PALETTED 0x80
+#define IMAGE_CODEC_MASK 0x0F
+
+#define IMAGE_CODEC_RAW 0   // Uncompressed
+#define IMAGE_CODEC_RLE 1   // Runs of 565 pixels, see rle565_decompress
+#define IMAGE_CODEC_LZF 2   // LZF over the pixel bytes, see lzf_decompress
+
 typedef struct {
     uint16_t width;
     uint8_t height;
-    uint16_t *data;
+    uint8_t bpp;            // 16 for direct color, else bits per index
+    uint16_t *data;         // Direct color pixels, or NULL if paletted
+    uint8_t *indices;       // Packed palette indices, or NULL
+    uint16_t *palette;
+    uint16_t stride;        // Row to row: pixels of data, bytes of indices
 } Image;
 
+// Bytes in each row of a whole paletted image's indices
+#define IMAGE_INDEX_STRIDE(img) (((img)->width * (img)->bpp + 7) / 8)
+
+/*
+ * Decode an fxi image from src.  The returned image and its pixels are a
+ * single allocation, released with free().  Returns NULL if out of memory
+ * or the codec is unknown.
+ */
+const Image *image_load(const void *src);
+void image_copy(const Image *img, uint16_t *dst, size_t stride);
+int image_decode(uint8_t codec, uint16_t *dst, const uint8_t *src, size_t n);
+
+/*
+ * An fxa animation is a sequence of direct color frames of one size:
+ *  wwwwwwww wwwwwwww   Width, big-endian
+ *  hhhhhhhh            Height
+ *  00000000            Reserved
+ *  nnnnnnnn nnnnnnnn   Number of frames, big-endian
+ *  00000000 00000000   Reserved
+ *  mmmmmmmm * 4        Most pixels in any delta frame, big-endian
+ *  oooooooo * 4n       Offset of each frame from the start, big-endian
+ * Each frame is either a keyframe
+ *  00000000 cccccccc   The whole frame, stored with codec c
+ * or a delta against the frame before it
+ *  00000001 cccccccc rrrrrrrr
+ *  xxxxxxxx * 2 yyyyyyyy wwwwwwww * 2 hhhhhhhh   r dirty rectangles
+ *  ...                 Their pixels in order, stored with codec c
+ * Frame 0 is always a keyframe, and more are placed periodically so
+ * seeking doesn't have to replay the whole animation.
+ */
+#define ANIM_HEADER_SIZE 12
+#define ANIM_KEYFRAME 0
+#define ANIM_DELTA 1
+
+typedef struct {
+    const uint8_t *src;
+    uint16_t width;
+    uint8_t height;
+    uint16_t nframes;
+    uint16_t frame;         // Frame currently in pixels
+    uint16_t *pixels;
+    uint16_t *scratch;      // Changed pixels of a delta before placing them
+} Animation;
+
+Animation *anim_open(const void *src);
+int anim_seek(Animation *anim, unsigned frame);
+int anim_next(Animation *anim);
+void anim_close(Animation *anim);
+
+/*
+ * An fxt atlas is many images packed into one fxi image, with an index to
+ * find them by name:
+ *  nnnnnnnn nnnnnnnn   Number of images, big-endian
+ *  ssssssss ssssssss   Size of the name table, big-endian
+ * then for each image, sorted by name,
+ *  oooooooo oooooooo   Offset of its name in the name table
+ *  xxxxxxxx xxxxxxxx   Left edge in the atlas
+ *  yyyyyyyy            Top edge
+ *  wwwwwwww wwwwwwww   Width
+ *  hhhhhhhh            Height
+ * then the name table of NUL-terminated names, then the atlas as an fxi
+ * image.  In a paletted atlas every image starts on a byte of indices.
+ */
+#define ATLAS_HEADER_SIZE 4
+#define ATLAS_ENTRY_SIZE 8
+
+typedef struct {
+    const Image *image;     // The whole atlas
+    uint16_t count;
+    const uint8_t *entries;
+    const char *names;
+} Atlas;
+
+/*
+ * The atlas keeps pointers into src, which must outlive it.  Images are
+ * handed out as views into the atlas that share its pixels and need no
+ * freeing.
+ */
+Atlas *atlas_open(const void *src);
+int atlas_get(const Atlas *atlas, unsigned i, Image *view);
+int atlas_find(const Atlas *atlas, const char *name, Image *view);
+void atlas_close(Atlas *atlas);
+
+void lzf_decompress(uint8_t *restrict dst, const uint8_t *restrict src, size_t sz);
+void rle565_decompress(uint16_t *restrict dst, const uint8_t *restrict src, size_t n);
+void palette_expand(uint16_t *restrict dst, const uint8_t *restrict src,
+                    const uint16_t *palette, unsigned bpp, size_t n);
+
 #endif // _FXCG_IMAGE_H
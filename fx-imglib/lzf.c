@@ -1,5 +1,7 @@
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
+#include "image.h"
 /*
  * LZF is very easy to decompress.  Masking the top three bits of the
  * first byte in a block allows you to determine what sort of data there
@@ -7,7 +9,8 @@
  *  000LLLLL                    Literal string of L+1 bytes
  *  LLLaaaaa bbbbbbbb           Backref of L+3 bytes
  *  111aaaaa LLLLLLLL bbbbbbbb  Backref of L+9 bytes
- * Starting address of backrefs is always at $ - (a << 8) - b - 1
+ * Starting address of backrefs is always at $ - (a << 8) - b - 1, where $
+ * is the current position in the decompressed output.
  */
 
 /* Additional options for tweaking:
@@ -19,34 +22,38 @@
  * Decompress a LZF-compressed block of sz bytes when decompressed, reading
  * data from src and writing it to dst.
  */
-void lzf_decompress(uint8_t restrict *dst, const uint8_t restrict *src, size_t sz) {
-    int l;
-    const uint8_t restrict *back;
+void lzf_decompress(uint8_t *restrict dst, const uint8_t *restrict src, size_t sz) {
+    size_t l;
 
     while (sz > 0) {
-        // Get size and source for literal data
         uint8_t head = *src++;
 
         if (head >> 5 == 0) {       // Literal
             l = 1 + (head & 0x1F);
-            back = src;
+            memcpy(dst, src, l);
+            src += l;
         } else {
-            uint8_t a, b;
-            back = src - 1;
+            const uint8_t *back;
+            size_t d;
 
             if (head >> 5 == 7)     // Long backref
                 l = *src++ + 9;
             else                    // Short backref
                 l = (head >> 5) + 3;
 
-            a = head & 0x1f;
-            b = *src++;
-            back -= (a << 8) | b;
+            d = (((size_t)head & 0x1f) << 8 | *src++) + 1;
+            back = dst - d;
+            if (d >= l) {
+                memcpy(dst, back, l);
+            } else {
+                // Overlapping copy repeats the last d bytes
+                size_t i;
+                for (i = 0; i < l; i++)
+                    dst[i] = back[i];
+            }
         }
 
         sz -= l;
-        memcpy(dst, back, l);
         dst += l;
     }
 }
-
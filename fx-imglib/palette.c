@@ -0,0 +1,63 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "image.h"
+/*
+ * Indices are packed leftmost pixel first from the high bits of each byte.
+ * Whole bytes are unpacked with the shifts unrolled for each depth, which
+ * leaves just the palette lookups in the loop.
+ */
+
+/*
+ * Expand n packed palette indices of bpp bits each from src to 565 pixels
+ * at dst.
+ */
+void palette_expand(uint16_t *restrict dst, const uint8_t *restrict src,
+                    const uint16_t *palette, unsigned bpp, size_t n) {
+    unsigned per_byte = 8 / bpp;
+    uint8_t mask = (1 << bpp) - 1;
+
+    switch (bpp) {
+    case 8:
+        for (; n >= 1; n--)
+            *dst++ = palette[*src++];
+        break;
+    case 4:
+        for (; n >= 2; n -= 2, dst += 2) {
+            uint8_t b = *src++;
+            dst[0] = palette[b >> 4];
+            dst[1] = palette[b & 0xF];
+        }
+        break;
+    case 2:
+        for (; n >= 4; n -= 4, dst += 4) {
+            uint8_t b = *src++;
+            dst[0] = palette[b >> 6];
+            dst[1] = palette[(b >> 4) & 3];
+            dst[2] = palette[(b >> 2) & 3];
+            dst[3] = palette[b & 3];
+        }
+        break;
+    case 1:
+        for (; n >= 8; n -= 8, dst += 8) {
+            uint8_t b = *src++;
+            dst[0] = palette[b >> 7];
+            dst[1] = palette[(b >> 6) & 1];
+            dst[2] = palette[(b >> 5) & 1];
+            dst[3] = palette[(b >> 4) & 1];
+            dst[4] = palette[(b >> 3) & 1];
+            dst[5] = palette[(b >> 2) & 1];
+            dst[6] = palette[(b >> 1) & 1];
+            dst[7] = palette[b & 1];
+        }
+        break;
+    }
+    if (n > 0 && n < per_byte) {
+        // Partial byte at the end of a row
+        uint8_t b = *src;
+        unsigned shift = 8;
+        while (n--) {
+            shift -= bpp;
+            *dst++ = palette[(b >> shift) & mask];
+        }
+    }
+}
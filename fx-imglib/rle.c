@@ -0,0 +1,38 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "image.h"
+/*
+ * RLE-565 works in whole pixels, which suits flat UI art.  Each block
+ * begins with a control byte:
+ *  0LLLLLLL                    Literal string of L+1 pixels
+ *  1LLLLLLL pppppppp pppppppp  Run of L+2 copies of pixel p
+ * Pixels are big-endian like the decoded image, so they are copied as bytes
+ * rather than assembled.
+ */
+
+/*
+ * Decompress n pixels of RLE-565 data from src into dst.
+ */
+void rle565_decompress(uint16_t *restrict dst, const uint8_t *restrict src, size_t n) {
+    while (n > 0) {
+        uint8_t head = *src++;
+        size_t l;
+
+        if (head & 0x80) {          // Run
+            uint16_t px;
+            l = (head & 0x7F) + 2;
+            memcpy(&px, src, 2);
+            src += 2;
+            n -= l;
+            while (l--)
+                *dst++ = px;
+        } else {                    // Literal
+            l = head + 1;
+            memcpy(dst, src, 2 * l);
+            src += 2 * l;
+            dst += l;
+            n -= l;
+        }
+    }
+}
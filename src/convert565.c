@@ -1,38 +1,334 @@
+#include <ctype.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "config.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#else
+#include "getopt.h"
+#endif /* HAVE_UNISTD_H */
+
+#include "fxi.h"
 #include "images.h"
+#include "util.h"
 
 static void usage();
 
-int main(int argc, char **argv) {
-    int32_t width = 0, height = 0;
-    u16 *data;
-    FILE *fp = NULL;
+enum format { FORMAT_RAW, FORMAT_C, FORMAT_FXI };
 
-    if (argc < 3) {
-        usage();
+struct conversion {
+    const char *in;
+    char *out; // For FORMAT_C, the .c file; the header is alongside
+    int failed;
+};
+
+static enum format format = FORMAT_RAW;
+static struct conversion *conversions;
+
+static int writeRaw(const char *path, const u16 *data, int32_t w,
+                    int32_t h) {
+    FILE *fp = fopen(path, "wb");
+    size_t n = (size_t)w * h;
+    if (fp == NULL)
+        return 1;
+    if (fwrite(data, sizeof(u16), n, fp) != n) {
+        fclose(fp);
         return 1;
     }
+    return fclose(fp) != 0;
+}
 
-    data = loadBitmap(argv[1], &width, &height);
-    if (data == NULL) {
-        fprintf(stderr, "Failed to read input file: %s\n", argv[1]);
+static int writeFxi(const char *path, const u16 *data, int32_t w,
+                    int32_t h) {
+    struct fxi_weights weights = {1.0, 1.0};
+    size_t size;
+    u8 *fxi;
+    FILE *fp;
+
+    if (w > FXI_MAX_WIDTH || h > FXI_MAX_HEIGHT) {
+        printf("%s: too large for fxi, which is at most %dx%d\n", path,
+               FXI_MAX_WIDTH, FXI_MAX_HEIGHT);
+        return 1;
+    }
+    fxi = fxi_encode(data, w, h, FXI_CODEC_AUTO, 1, &weights, &size);
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        free(fxi);
         return 1;
-    } else {
-        printf("Loaded image, %i x %i pixels.\n", width, height);
     }
+    if (fwrite(fxi, 1, size, fp) != size) {
+        fclose(fp);
+        free(fxi);
+        return 1;
+    }
+    free(fxi);
+    return fclose(fp) != 0;
+}
+
+/*
+ * Derives a C identifier from the file name part of path, without its
+ * extension.
+ */
+static char *identifierFor(const char *path) {
+    const char *name = strrchr(path, '/'), *end;
+    char *id, *p;
+
+    name = name == NULL ? path : name + 1;
+    // Only the last extension goes, as in outputPath
+    end = strrchr(name, '.');
+    if (end == NULL || end == name)
+        end = name + strlen(name);
+    id = mallocs(strlen(name) + 2);
+    p = id;
+    if (!isalpha((unsigned char)*name) && *name != '_')
+        *p++ = '_';
+    for (; name != end; name++)
+        *p++ = isalnum((unsigned char)*name) ? *name : '_';
+    *p = '\0';
+    return id;
+}
+
+/*
+ * Writes a C source file at path defining the pixels as a const uint16_t
+ * array named after the file, and a header declaring it with its
+ * dimensions at the same path ending in .h instead.  Values are the pixels
+ * as numbers, so they are laid out correctly on the big-endian calculator.
+ */
+static int writeC(const char *path, const u16 *data, int32_t w, int32_t h) {
+    static const char hex[] = "0123456789ABCDEF";
+    const u8 *bytes = (const u8 *)data;
+    char *id = identifierFor(path), *upper, *header, *p;
+    const char *headerName;
+    size_t n = (size_t)w * h, i, len = strlen(path);
+    char *buf, *b;
+    FILE *fp;
+    int failed;
 
-    fp = fopen(argv[2], "w");
-    if (fp == NULL || fwrite(data, width * height, sizeof(u16), fp) == 0) {
-        fprintf(stderr, "Failed to write output file: %s\n", argv[2]);
+    upper = strdup(id);
+    for (p = upper; *p != '\0'; p++)
+        *p = toupper((unsigned char)*p);
+    header = mallocs(len + 3);
+    strcpy(header, path);
+    p = strrchr(header, '.');
+    if (p == NULL || strchr(p, '/') != NULL)
+        p = header + len;
+    strcpy(p, ".h");
+    headerName = strrchr(header, '/');
+    headerName = headerName == NULL ? header : headerName + 1;
+
+    fp = fopen(header, "w");
+    failed = fp == NULL;
+    if (fp != NULL) {
+        fprintf(fp,
+                "#ifndef %s_H\n#define %s_H\n\n#include <stdint.h>\n\n"
+                "#define %s_WIDTH %i\n#define %s_HEIGHT %i\n"
+                "extern const uint16_t %s[%s_WIDTH * %s_HEIGHT];\n\n"
+                "#endif /* %s_H */\n",
+                upper, upper, upper, w, upper, h, id, upper, upper, upper);
+        failed = fclose(fp) != 0;
+    }
+    if (failed) {
+        printf("Failed to write %s\n", header);
+        free(id);
+        free(upper);
+        free(header);
         return 1;
     }
-    fclose(fp);
+
+    // Formatting by hand, eight pixels to a line, is much faster than printf
+    buf = mallocs(12 * n + 1);
+    b = buf;
+    for (i = 0; i < n; i++) {
+        if (i % 8 == 0) {
+            memcpy(b, "    ", 4);
+            b += 4;
+        } else {
+            *b++ = ' ';
+        }
+        *b++ = '0';
+        *b++ = 'x';
+        *b++ = hex[bytes[2 * i] >> 4];
+        *b++ = hex[bytes[2 * i] & 0xF];
+        *b++ = hex[bytes[2 * i + 1] >> 4];
+        *b++ = hex[bytes[2 * i + 1] & 0xF];
+        if (i != n - 1)
+            *b++ = ',';
+        if (i % 8 == 7 || i == n - 1)
+            *b++ = '\n';
+    }
+    fp = fopen(path, "w");
+    failed = fp == NULL;
+    if (fp != NULL) {
+        fprintf(fp,
+                "#include \"%s\"\n\n"
+                "const uint16_t %s[%s_WIDTH * %s_HEIGHT] = {\n",
+                headerName, id, upper, upper);
+        failed = fwrite(buf, 1, b - buf, fp) != (size_t)(b - buf);
+        fprintf(fp, "};\n");
+        failed |= fclose(fp) != 0;
+    }
+    free(buf);
+    free(id);
+    free(upper);
+    free(header);
+    return failed;
+}
+
+static void convertWorker(void *ctx, size_t i) {
+    struct conversion *c = &conversions[i];
+    int32_t width = 0, height = 0;
+    u16 *data;
+    int failed;
+    (void)ctx;
+
+    data = loadBitmap(c->in, &width, &height);
+    if (data == NULL) {
+        printf("Failed to read input file: %s\n", c->in);
+        c->failed = 1;
+        return;
+    }
+    switch (format) {
+    case FORMAT_C:
+        failed = writeC(c->out, data, width, height);
+        break;
+    case FORMAT_FXI:
+        failed = writeFxi(c->out, data, width, height);
+        break;
+    default:
+        failed = writeRaw(c->out, data, width, height);
+        break;
+    }
+    if (failed)
+        printf("Failed to write output file: %s\n", c->out);
+    else
+        printf("%s: %i x %i pixels to %s\n", c->in, width, height, c->out);
     free(data);
-    return 0;
+    c->failed = failed;
 }
 
-void usage() { fprintf(stderr, "Usage: convert565 in.bmp out.bin\n"); }
+/*
+ * Output path in dir for input file in, with its extension replaced by ext
+ * and -n added to the name if n is more than 1.
+ */
+static char *outputPath(const char *dir, const char *in, const char *ext,
+                        int n) {
+    const char *name = strrchr(in, '/'), *dot;
+    size_t len;
+    char *out;
+
+    name = name == NULL ? in : name + 1;
+    dot = strrchr(name, '.');
+    len = dot == NULL ? strlen(name) : (size_t)(dot - name);
+    out = mallocs(strlen(dir) + 1 + len + 12 + strlen(ext) + 1);
+    if (n == 1)
+        sprintf(out, "%s/%.*s%s", dir, (int)len, name, ext);
+    else
+        sprintf(out, "%s/%.*s-%d%s", dir, (int)len, name, n, ext);
+    return out;
+}
+
+/*
+ * Names the output for each conversion after its input, adding -2, -3 and
+ * so on where inputs in different directories or with different extensions
+ * have the same name, so that no two workers write the same file.
+ */
+static void nameOutputs(const char *dir, const char *ext, size_t count) {
+    size_t i, j;
+    char *out;
+    int n;
+
+    for (i = 0; i < count; i++) {
+        for (n = 1;; n++) {
+            out = outputPath(dir, conversions[i].in, ext, n);
+            for (j = 0; j < i && strcmp(conversions[j].out, out); j++)
+                ;
+            if (j == i)
+                break;
+            free(out);
+        }
+        conversions[i].out = out;
+    }
+}
+
+int main(int argc, char **argv) {
+    static const char *extensions[] = {".bin", ".c", ".fxi"};
+    int c, jobs = defaultJobs(), status = 0;
+    char *outDir = NULL;
+    size_t i, count;
+
+    while ((c = getopt(argc, argv, "f:j:o:h")) != -1) {
+        switch (c) {
+        case 'f':
+            if (!strcmp(optarg, "raw"))
+                format = FORMAT_RAW;
+            else if (!strcmp(optarg, "c"))
+                format = FORMAT_C;
+            else if (!strcmp(optarg, "fxi"))
+                format = FORMAT_FXI;
+            else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'o':
+            outDir = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (outDir == NULL) {
+        // Single file, named output
+        if (argc - optind != 2) {
+            usage();
+            return 1;
+        }
+        count = 1;
+        conversions = callocs(1, sizeof(*conversions));
+        conversions[0].in = argv[optind];
+        conversions[0].out = strdup(argv[optind + 1]);
+    } else {
+        if (argc - optind < 1) {
+            usage();
+            return 1;
+        }
+        if (mkdir(outDir, 0777) != 0 && errno != EEXIST) {
+            printf("Unable to create %s: %s\n", outDir, strerror(errno));
+            return 1;
+        }
+        count = argc - optind;
+        conversions = callocs(count, sizeof(*conversions));
+        for (i = 0; i < count; i++)
+            conversions[i].in = argv[optind + i];
+        nameOutputs(outDir, extensions[format], count);
+    }
+
+    parallelFor(jobs, count, convertWorker, NULL);
+    for (i = 0; i < count; i++) {
+        status |= conversions[i].failed;
+        free(conversions[i].out);
+    }
+    free(conversions);
+    return status;
+}
+
+void usage() {
+    fprintf(stderr,
+            "Usage: convert565 [-f raw|c|fxi] in.bmp out.bin\n"
+            "       convert565 [-f raw|c|fxi] [-j jobs] -o outdir in.bmp...\n"
+            "\nConverts images to big-endian 5-6-5 pixels, written as raw\n"
+            "binary, as a C array with a header giving its dimensions, or as\n"
+            "an fx-imglib fxi image.  With -o, any number of images are\n"
+            "converted in parallel into outdir, named after the inputs;\n"
+            "inputs with the same name get -2, -3 and so on.\n");
+}
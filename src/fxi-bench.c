@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fxi.h"
+#include "image.h"
+#include "util.h"
+
+/* Decode each image repeatedly for at least this long */
+#define BENCH_SECONDS 0.2
+
+/*
+ * Times fx-imglib's decoders, built for the host, on fxi images and fxa
+ * animations.  Absolute times say little about the calculator, but
+ * comparing codecs and images does.
+ */
+
+/*
+ * Times loading, then copying out to 565 pixels (which expands paletted
+ * images).
+ */
+static int benchImage(const char *path, const u8 *fxi, size_t size) {
+    unsigned long runs = 0, copies = 0;
+    clock_t start, elapsed, copy_elapsed;
+    const Image *img;
+    uint16_t *pixels;
+    u8 format;
+
+    if (fxi_check(fxi, size)) {
+        printf("%s is not a valid fxi image\n", path);
+        return 1;
+    }
+    format = fxi[3];
+
+    start = clock();
+    do {
+        free((void *)image_load(fxi));
+        runs++;
+        elapsed = clock() - start;
+    } while (elapsed < BENCH_SECONDS * CLOCKS_PER_SEC);
+
+    img = image_load(fxi);
+    if (img == NULL) {
+        printf("Failed to decode %s\n", path);
+        return 1;
+    }
+    pixels = mallocs(2 * (size_t)img->width * img->height + 1);
+    start = clock();
+    do {
+        image_copy(img, pixels, img->width);
+        copies++;
+        copy_elapsed = clock() - start;
+    } while (copy_elapsed < BENCH_SECONDS * CLOCKS_PER_SEC);
+
+    printf("%s: %ux%u, %s", path, img->width, img->height,
+           fxi_codecName(format & IMAGE_CODEC_MASK));
+    if (img->bpp != 16)
+        printf(" %u bpp", img->bpp);
+    printf(", %zu bytes, %.2f us/decode, %.2f us/copy\n", size,
+           1e6 * elapsed / CLOCKS_PER_SEC / runs,
+           1e6 * copy_elapsed / CLOCKS_PER_SEC / copies);
+    free(pixels);
+    free((void *)img);
+    return 0;
+}
+
+/*
+ * Times playing an animation through in order, and seeking to its last
+ * frame from the first.
+ */
+static int benchAnimation(const char *path, const u8 *fxa, size_t size) {
+    unsigned long frames = 0, seeks = 0;
+    clock_t start, elapsed, seek_elapsed;
+    Animation *anim;
+
+    if (fxi_checkAnimation(fxa, size) || (anim = anim_open(fxa)) == NULL) {
+        printf("%s is not a valid fxa animation\n", path);
+        return 1;
+    }
+
+    start = clock();
+    do {
+        if (anim_next(anim)) {
+            printf("Failed to decode frame %u of %s\n",
+                   (anim->frame + 1u) % anim->nframes, path);
+            anim_close(anim);
+            return 1;
+        }
+        frames++;
+        elapsed = clock() - start;
+    } while (elapsed < BENCH_SECONDS * CLOCKS_PER_SEC);
+
+    start = clock();
+    do {
+        anim_seek(anim, 0);
+        anim_seek(anim, anim->nframes - 1);
+        seeks++;
+        seek_elapsed = clock() - start;
+    } while (seek_elapsed < BENCH_SECONDS * CLOCKS_PER_SEC);
+
+    printf("%s: %ux%u, %u frames, %zu bytes, %.2f us/frame, "
+           "%.2f us/seek to last\n",
+           path, anim->width, anim->height, anim->nframes, size,
+           1e6 * elapsed / CLOCKS_PER_SEC / frames,
+           1e6 * seek_elapsed / CLOCKS_PER_SEC / seeks);
+    anim_close(anim);
+    return 0;
+}
+
+/*
+ * Times opening an atlas, and copying out every image in it through views.
+ */
+static int benchAtlas(const char *path, const u8 *fxt, size_t size) {
+    unsigned long opens = 0, copies = 0;
+    clock_t start, elapsed, copy_elapsed;
+    Atlas *atlas;
+    Image view;
+    uint16_t *pixels;
+    unsigned i;
+
+    if (fxi_checkAtlas(fxt, size) || (atlas = atlas_open(fxt)) == NULL) {
+        printf("%s is not a valid fxt atlas\n", path);
+        return 1;
+    }
+
+    start = clock();
+    do {
+        atlas_close(atlas_open(fxt));
+        opens++;
+        elapsed = clock() - start;
+    } while (elapsed < BENCH_SECONDS * CLOCKS_PER_SEC);
+
+    pixels = mallocs(2 * (size_t)atlas->image->width * atlas->image->height +
+                     1);
+    start = clock();
+    do {
+        for (i = 0; i < atlas->count; i++) {
+            atlas_get(atlas, i, &view);
+            image_copy(&view, pixels, view.width);
+        }
+        copies++;
+        copy_elapsed = clock() - start;
+    } while (copy_elapsed < BENCH_SECONDS * CLOCKS_PER_SEC);
+
+    printf("%s: %u images in %ux%u, %zu bytes, %.2f us/open, "
+           "%.2f us/copy of all\n",
+           path, atlas->count, atlas->image->width, atlas->image->height, size,
+           1e6 * elapsed / CLOCKS_PER_SEC / opens,
+           1e6 * copy_elapsed / CLOCKS_PER_SEC / copies);
+    free(pixels);
+    atlas_close(atlas);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int i, status = 0;
+
+    if (argc < 2) {
+        printf("Usage: fxi-bench <file.fxi|file.fxa|file.fxt>...\n");
+        printf("\nReports the codec and decode time of each fxi image, the\n"
+               "frame and seek times of each fxa animation and the open and\n"
+               "copy times of each fxt atlas.\n");
+        return 1;
+    }
+
+    for (i = 1; i < argc; i++) {
+        size_t size, len = strlen(argv[i]);
+        const u8 *data = mapFile(argv[i], &size);
+
+        if (data == NULL) {
+            printf("Unable to open %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (len > 4 && !strcmp(argv[i] + len - 4, ".fxa"))
+            status |= benchAnimation(argv[i], data, size);
+        else if (len > 4 && !strcmp(argv[i] + len - 4, ".fxt"))
+            status |= benchAtlas(argv[i], data, size);
+        else
+            status |= benchImage(argv[i], data, size);
+        unmapFile(data, size);
+    }
+    return status;
+}
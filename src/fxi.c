@@ -0,0 +1,983 @@
+#include "fxi.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "image.h"
+#include "util.h"
+
+/*
+ * Rough SH4 cycle costs of the device decoders, used to weigh decode time
+ * against size.  Only their ratios matter.
+ */
+#define CYCLES_BLOCK 10.0  // Reading a control byte and branching on it
+#define CYCLES_COPY 0.25   // Per byte moved by memcpy
+#define CYCLES_FILL 1.0    // Per pixel stored by an RLE run
+#define CYCLES_OVERLAP 2.0 // Per byte of an overlapping LZF backref
+
+/* LZF limits, from the block formats in fx-imglib/lzf.c */
+#define LZF_MAX_LITERAL 32
+#define LZF_MIN_MATCH 4
+#define LZF_MAX_SHORT 9
+#define LZF_MAX_MATCH (255 + 9)
+#define LZF_MAX_DISTANCE (1 << 13)
+#define LZF_HASH_BITS 14
+#define LZF_CHAIN_DEPTH 32
+
+/* RLE-565 limits, from fx-imglib/rle.c */
+#define RLE_MAX_LITERAL 128
+#define RLE_MAX_RUN 129
+
+struct encoded {
+    u8 *data;
+    size_t size;
+    double cycles;
+};
+
+static void encodeRaw(const u8 *in, size_t len, struct encoded *out) {
+    memcpy(out->data, in, len);
+    out->size = len;
+    out->cycles = CYCLES_BLOCK + len * CYCLES_COPY;
+}
+
+static void encodeRLE(const u16 *px, size_t n, struct encoded *out) {
+    u8 *o = out->data;
+    size_t i = 0, literal = 0;
+    double cycles = 0;
+
+    while (i < n) {
+        size_t run = 1;
+        while (i + run < n && run < RLE_MAX_RUN && px[i + run] == px[i])
+            run++;
+
+        // A run of two only pays for itself if it doesn't split a literal
+        if (run >= 3 || (run == 2 && literal == 0)) {
+            *o++ = 0x80 | (run - 2);
+            memcpy(o, &px[i], 2);
+            o += 2;
+            cycles += CYCLES_BLOCK + run * CYCLES_FILL;
+            i += run;
+            literal = 0;
+            continue;
+        }
+
+        if (literal == 0 || literal == RLE_MAX_LITERAL) {
+            *o++ = 0;
+            literal = 0;
+            cycles += CYCLES_BLOCK;
+        } else {
+            o[-2 * (ptrdiff_t)literal - 1]++;
+        }
+        memcpy(o, &px[i], 2);
+        o += 2;
+        cycles += 2 * CYCLES_COPY;
+        literal++;
+        i++;
+    }
+    out->size = o - out->data;
+    out->cycles = cycles;
+}
+
+static u32 lzfHash(const u8 *p) {
+    u32 v = (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | p[3];
+    return (v * 2654435761u) >> (32 - LZF_HASH_BITS);
+}
+
+/*
+ * Greedy LZF compression, searching a hash chain of earlier positions with
+ * the same four leading bytes for the longest match.
+ */
+static void encodeLZF(const u8 *in, size_t len, struct encoded *out) {
+    int32_t *head = mallocs(sizeof(*head) << LZF_HASH_BITS);
+    int32_t *prev = mallocs(len * sizeof(*prev) + 1);
+    u8 *o = out->data;
+    size_t i = 0, literal = 0;
+    double cycles = 0;
+
+    memset(head, 0xFF, sizeof(*head) << LZF_HASH_BITS);
+    while (i < len) {
+        size_t best = 0, dist = 0;
+
+        if (i + LZF_MIN_MATCH <= len) {
+            u32 h = lzfHash(in + i);
+            int32_t cand = head[h];
+            int depth = LZF_CHAIN_DEPTH;
+            size_t limit = len - i < LZF_MAX_MATCH ? len - i : LZF_MAX_MATCH;
+
+            for (; cand >= 0 && i - cand <= LZF_MAX_DISTANCE && depth--;
+                 cand = prev[cand]) {
+                size_t l = 0;
+                while (l < limit && in[cand + l] == in[i + l])
+                    l++;
+                if (l > best) {
+                    best = l;
+                    dist = i - cand;
+                    if (l == limit)
+                        break;
+                }
+            }
+            prev[i] = head[h];
+            head[h] = i;
+        }
+
+        if (best >= LZF_MIN_MATCH) {
+            size_t d = dist - 1, j;
+            if (best <= LZF_MAX_SHORT) {
+                *o++ = (best - 3) << 5 | d >> 8;
+            } else {
+                *o++ = 0xE0 | d >> 8;
+                *o++ = best - 9;
+            }
+            *o++ = d & 0xFF;
+            cycles += CYCLES_BLOCK +
+                      best * (dist >= best ? CYCLES_COPY : CYCLES_OVERLAP);
+            literal = 0;
+
+            // Remember the positions inside the match too
+            for (j = i + 1; j < i + best && j + LZF_MIN_MATCH <= len; j++) {
+                u32 h = lzfHash(in + j);
+                prev[j] = head[h];
+                head[h] = j;
+            }
+            i += best;
+            continue;
+        }
+
+        if (literal == 0 || literal == LZF_MAX_LITERAL) {
+            *o++ = 0;
+            literal = 0;
+            cycles += CYCLES_BLOCK;
+        } else {
+            o[-(ptrdiff_t)literal - 1]++;
+        }
+        *o++ = in[i++];
+        cycles += CYCLES_COPY;
+        literal++;
+    }
+    free(head);
+    free(prev);
+    out->size = o - out->data;
+    out->cycles = cycles;
+}
+
+/*
+ * Encodes len bytes of in with codec.  RLE-565 works on pixels, so in must
+ * be aligned for it.
+ */
+static void encodeWith(int codec, const u8 *in, size_t len,
+                       struct encoded *out) {
+    switch (codec) {
+    case IMAGE_CODEC_RAW:
+        encodeRaw(in, len, out);
+        break;
+    case IMAGE_CODEC_RLE:
+        encodeRLE((const u16 *)in, len / 2, out);
+        break;
+    case IMAGE_CODEC_LZF:
+        encodeLZF(in, len, out);
+        break;
+    }
+}
+
+static double score(const struct encoded *e, const struct fxi_weights *w) {
+    return pow((double)e->size, w->size) * pow(e->cycles, w->cost);
+}
+
+/*
+ * Encodes in with codec, or if it is FXI_CODEC_AUTO with whichever of the
+ * codecs in the mask candidates scores best.  Returns the codec used.
+ */
+static int encodeBest(const u8 *in, size_t len, int codec, unsigned candidates,
+                      const struct fxi_weights *weights, struct encoded *best) {
+    // Worst case is all literals, with LZF's short literal blocks
+    size_t bound = len + len / LZF_MAX_LITERAL + 1;
+    struct encoded e;
+    int c;
+
+    best->data = mallocs(bound);
+    if (codec != FXI_CODEC_AUTO) {
+        encodeWith(codec, in, len, best);
+        return codec;
+    }
+
+    e.data = mallocs(bound);
+    codec = FXI_CODEC_AUTO;
+    for (c = IMAGE_CODEC_RAW; c <= IMAGE_CODEC_LZF; c++) {
+        if (!(candidates & (1 << c)))
+            continue;
+        encodeWith(c, in, len, codec == FXI_CODEC_AUTO ? best : &e);
+        if (codec == FXI_CODEC_AUTO) {
+            codec = c;
+        } else if (score(&e, weights) < score(best, weights)) {
+            struct encoded t = *best;
+            *best = e;
+            e = t;
+            codec = c;
+        }
+    }
+    free(e.data);
+    return codec;
+}
+
+/*
+ * Builds a palette of the distinct colors in pixels, in order of first
+ * appearance, and their indices.  Returns the number of colors, or 0 if
+ * there are more than 256.
+ */
+static int buildPalette(const u16 *pixels, size_t n, u16 *palette,
+                        u8 *indices) {
+    // Index plus one of each color seen, by color
+    u16 *seen = callocs(0x10000, sizeof(*seen));
+    int ncolors = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        u16 px = pixels[i];
+        if (seen[px] == 0) {
+            if (ncolors == 256) {
+                ncolors = 0;
+                break;
+            }
+            palette[ncolors] = px;
+            seen[px] = ++ncolors;
+        }
+        indices[i] = seen[px] - 1;
+    }
+    free(seen);
+    return ncolors;
+}
+
+/*
+ * Packs 8-bit indices into rows of bpp-bit indices, each row padded to a
+ * whole byte, as fx-imglib's palette_expand reads them.
+ */
+static u8 *packIndices(const u8 *indices, int32_t width, int32_t height,
+                       int bpp, size_t *len) {
+    size_t stride = ((size_t)width * bpp + 7) / 8;
+    u8 *packed = callocs(stride * height + 1, 1);
+    int32_t x, y;
+
+    for (y = 0; y < height; y++) {
+        u8 *row = packed + stride * y;
+        for (x = 0; x < width; x++) {
+            size_t bit = (size_t)x * bpp;
+            row[bit / 8] |= indices[(size_t)width * y + x]
+                            << (8 - bpp - bit % 8);
+        }
+    }
+    *len = stride * height;
+    return packed;
+}
+
+/*
+ * Encodes big-endian 5-6-5 pixels as a complete fxi image with the given
+ * codec, or with whichever codec scores best by weights if codec is
+ * FXI_CODEC_AUTO.  Images of 256 or fewer colors are stored as palette
+ * indices if allowPalette is set and the codec is not RLE, which only
+ * works on direct color.  Returns the image and sets size to its length in
+ * bytes.
+ */
+u8 *fxi_encode(const u16 *pixels, int32_t width, int32_t height, int codec,
+               int allowPalette, const struct fxi_weights *weights,
+               size_t *size) {
+    size_t n = (size_t)width * height;
+    struct encoded best;
+    u16 palette[256];
+    int ncolors = 0, bpp = 16;
+    u8 *out, *o;
+
+    if (allowPalette && codec != IMAGE_CODEC_RLE) {
+        u8 *indices = mallocs(n + 1);
+        ncolors = buildPalette(pixels, n, palette, indices);
+        if (ncolors > 0) {
+            size_t len;
+            u8 *packed;
+            bpp = ncolors <= 2 ? 1 : ncolors <= 4 ? 2 : ncolors <= 16 ? 4 : 8;
+            packed = packIndices(indices, width, height, bpp, &len);
+            codec = encodeBest(packed, len, codec,
+                               1 << IMAGE_CODEC_RAW | 1 << IMAGE_CODEC_LZF,
+                               weights, &best);
+            free(packed);
+        }
+        free(indices);
+    }
+    if (ncolors == 0) {
+        codec = encodeBest((const u8 *)pixels, 2 * n, codec,
+                           1 << IMAGE_CODEC_RAW | 1 << IMAGE_CODEC_RLE |
+                               1 << IMAGE_CODEC_LZF,
+                           weights, &best);
+    }
+
+    out = mallocs(IMAGE_HEADER_SIZE + 2 + 2 * ncolors + best.size);
+    o = out;
+    *o++ = width >> 8;
+    *o++ = width & 0xFF;
+    *o++ = height;
+    *o++ = codec | (ncolors ? IMAGE_PALETTED : 0);
+    if (ncolors) {
+        *o++ = bpp;
+        *o++ = ncolors - 1;
+        memcpy(o, palette, 2 * ncolors);
+        o += 2 * ncolors;
+    }
+    memcpy(o, best.data, best.size);
+    o += best.size;
+    free(best.data);
+    *size = o - out;
+    return out;
+}
+
+/*
+ * Animations
+ *
+ * Changes between frames are found in 8x8 tiles.  Runs of changed tiles
+ * along each row of tiles become rectangles, which grow downwards while the
+ * row below has a run with the same extent, and are finally shrunk to the
+ * pixels that actually changed.
+ */
+#define ANIM_TILE 8
+#define ANIM_MAX_RECTS 255
+
+struct rect {
+    int32_t x, y, w, h;
+};
+
+static int tileDirty(const u16 *prev, const u16 *frame, int32_t width,
+                     int32_t height, int32_t tx, int32_t ty) {
+    int32_t x, y;
+    for (y = ty * ANIM_TILE; y < (ty + 1) * ANIM_TILE && y < height; y++) {
+        for (x = tx * ANIM_TILE; x < (tx + 1) * ANIM_TILE && x < width; x++) {
+            if (prev[(size_t)width * y + x] != frame[(size_t)width * y + x])
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static void shrinkRect(const u16 *prev, const u16 *frame, int32_t width,
+                       struct rect *r) {
+    int32_t x0 = r->x + r->w, x1 = r->x - 1, y0 = r->y + r->h, y1 = r->y - 1;
+    int32_t x, y;
+    for (y = r->y; y < r->y + r->h; y++) {
+        for (x = r->x; x < r->x + r->w; x++) {
+            if (prev[(size_t)width * y + x] != frame[(size_t)width * y + x]) {
+                x0 = x < x0 ? x : x0;
+                x1 = x > x1 ? x : x1;
+                y0 = y < y0 ? y : y0;
+                y1 = y > y1 ? y : y1;
+            }
+        }
+    }
+    r->x = x0;
+    r->y = y0;
+    r->w = x1 - x0 + 1;
+    r->h = y1 - y0 + 1;
+}
+
+/*
+ * Finds rectangles covering the pixels of frame that differ from prev.
+ * Returns their count, or -1 if there would be more than ANIM_MAX_RECTS.
+ */
+static int dirtyRects(const u16 *prev, const u16 *frame, int32_t width,
+                      int32_t height, struct rect *rects) {
+    int32_t tw = (width + ANIM_TILE - 1) / ANIM_TILE;
+    int32_t th = (height + ANIM_TILE - 1) / ANIM_TILE;
+    int32_t tx, ty;
+    // Rectangles still growing downwards are [open, nrects)
+    int nrects = 0, open = 0, i;
+
+    for (ty = 0; ty < th; ty++) {
+        int next = nrects;
+        for (tx = 0; tx < tw; tx++) {
+            int32_t start = tx;
+            struct rect r;
+
+            if (!tileDirty(prev, frame, width, height, tx, ty))
+                continue;
+            while (tx + 1 < tw &&
+                   tileDirty(prev, frame, width, height, tx + 1, ty))
+                tx++;
+            r.x = start * ANIM_TILE;
+            r.y = ty * ANIM_TILE;
+            r.w = (tx + 1) * ANIM_TILE - r.x;
+            r.h = ANIM_TILE;
+
+            for (i = open; i < next; i++) {
+                if (rects[i].x == r.x && rects[i].w == r.w &&
+                    rects[i].y + rects[i].h == r.y)
+                    break;
+            }
+            if (i < next) {
+                rects[i].h += ANIM_TILE;
+                continue;
+            }
+            if (nrects == ANIM_MAX_RECTS)
+                return -1;
+            rects[nrects++] = r;
+        }
+        // Rectangles that didn't grow this row are finished
+        for (i = open; i < next; i++) {
+            if (rects[i].y + rects[i].h <= ty * ANIM_TILE) {
+                struct rect t = rects[i];
+                rects[i] = rects[open];
+                rects[open++] = t;
+            }
+        }
+    }
+
+    for (i = 0; i < nrects; i++) {
+        if (rects[i].x + rects[i].w > width)
+            rects[i].w = width - rects[i].x;
+        if (rects[i].y + rects[i].h > height)
+            rects[i].h = height - rects[i].y;
+        shrinkRect(prev, frame, width, &rects[i]);
+    }
+    return nrects;
+}
+
+static void putU16(u8 *p, u32 v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void putU32(u8 *p, u32 v) {
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+/*
+ * Encodes nframes frames of big-endian 5-6-5 pixels as an fxa animation.
+ * A keyframe is stored at least every keyInterval frames, and wherever a
+ * delta would be larger.  Codecs are chosen as by fxi_encode.  Returns the
+ * animation and sets size to its length in bytes, and keyframes to the
+ * number of keyframes in it.
+ */
+u8 *fxi_encodeAnimation(const u16 *const *frames, int nframes, int32_t width,
+                        int32_t height, int codec, int keyInterval,
+                        const struct fxi_weights *weights, size_t *size,
+                        int *keyframes) {
+    size_t n = (size_t)width * height;
+    size_t cap = ANIM_HEADER_SIZE + 4 * (size_t)nframes + 2 * n + 1;
+    size_t len = ANIM_HEADER_SIZE + 4 * (size_t)nframes, maxDelta = 0;
+    u8 *out = callocs(cap, 1);
+    u16 *changed = mallocs(2 * n + 2);
+    struct rect rects[ANIM_MAX_RECTS];
+    int f, i, sinceKey = 0;
+
+    *keyframes = 0;
+    for (f = 0; f < nframes; f++) {
+        struct encoded key, delta;
+        int keyCodec, deltaCodec = 0, nrects = -1;
+        size_t deltaPixels = 0, need;
+
+        keyCodec = encodeBest((const u8 *)frames[f], 2 * n, codec,
+                              1 << IMAGE_CODEC_RAW | 1 << IMAGE_CODEC_RLE |
+                                  1 << IMAGE_CODEC_LZF,
+                              weights, &key);
+        delta.data = NULL;
+        if (f > 0 && sinceKey + 1 < keyInterval)
+            nrects = dirtyRects(frames[f - 1], frames[f], width, height, rects);
+        if (nrects >= 0) {
+            u16 *o = changed;
+            for (i = 0; i < nrects; i++) {
+                int32_t y;
+                for (y = rects[i].y; y < rects[i].y + rects[i].h; y++) {
+                    memcpy(o, frames[f] + (size_t)width * y + rects[i].x,
+                           2 * rects[i].w);
+                    o += rects[i].w;
+                }
+            }
+            deltaPixels = o - changed;
+            deltaCodec = encodeBest((const u8 *)changed, 2 * deltaPixels,
+                                    codec,
+                                    1 << IMAGE_CODEC_RAW |
+                                        1 << IMAGE_CODEC_RLE |
+                                        1 << IMAGE_CODEC_LZF,
+                                    weights, &delta);
+            if (3 + 6 * nrects + delta.size >= 2 + key.size)
+                nrects = -1;
+        }
+
+        need = len + 3 + 6 * ANIM_MAX_RECTS + key.size;
+        if (need > cap) {
+            cap = need * 2;
+            out = realloc(out, cap);
+            if (out == NULL) {
+                printf("Failed to allocate memory; aborting.\n");
+                exit(2);
+            }
+        }
+        putU32(out + ANIM_HEADER_SIZE + 4 * f, len);
+        if (nrects < 0) {
+            out[len++] = ANIM_KEYFRAME;
+            out[len++] = keyCodec;
+            memcpy(out + len, key.data, key.size);
+            len += key.size;
+            sinceKey = 0;
+            (*keyframes)++;
+        } else {
+            out[len++] = ANIM_DELTA;
+            out[len++] = deltaCodec;
+            out[len++] = nrects;
+            for (i = 0; i < nrects; i++, len += 6) {
+                putU16(out + len, rects[i].x);
+                out[len + 2] = rects[i].y;
+                putU16(out + len + 3, rects[i].w);
+                out[len + 5] = rects[i].h;
+            }
+            memcpy(out + len, delta.data, delta.size);
+            len += delta.size;
+            maxDelta = deltaPixels > maxDelta ? deltaPixels : maxDelta;
+            sinceKey++;
+        }
+        free(key.data);
+        free(delta.data);
+    }
+    free(changed);
+
+    putU16(out, width);
+    out[2] = height;
+    putU16(out + 4, nframes);
+    putU32(out + 8, maxDelta);
+    *size = len;
+    return out;
+}
+
+/*
+ * Atlases
+ *
+ * Sprites are packed with a skyline: for each row of the atlas the skyline
+ * records how far right it is filled, and each sprite goes wherever its
+ * right edge ends up furthest left.  fxi images are at most 255 rows high
+ * but very wide, so the atlas grows rightwards and every height from the
+ * tallest sprite up is tried to find the smallest area.
+ */
+struct skyline {
+    int32_t y, h; // Rows y to y + h - 1...
+    int32_t x;    // ...are filled up to column x
+};
+
+/*
+ * Places a w by h sprite in an atlas of height rows, aligning its left edge
+ * to align columns, and updates the skyline.  Returns its position in x and
+ * y, or nonzero if it does not fit.
+ */
+static int skylinePlace(struct skyline *sky, int *nsky, int32_t height,
+                        int32_t w, int32_t h, int32_t align, int32_t *x,
+                        int32_t *y) {
+    int32_t bestX = -1, bestY = 0, left, covered;
+    int i, j, n = *nsky;
+
+    for (i = 0; i < n && sky[i].y + h <= height; i++) {
+        left = 0;
+        for (j = i, covered = 0; covered < h; covered += sky[j++].h)
+            left = sky[j].x > left ? sky[j].x : left;
+        left = (left + align - 1) / align * align;
+        if (bestX < 0 || left < bestX) {
+            bestX = left;
+            bestY = sky[i].y;
+        }
+    }
+    if (bestX < 0)
+        return 1;
+    *x = bestX;
+    *y = bestY;
+
+    // Replace the segments under the sprite with one at its right edge
+    for (i = 0; sky[i].y + sky[i].h <= bestY; i++)
+        ;
+    for (j = i; j < n && sky[j].y + sky[j].h <= bestY + h; j++)
+        ;
+    // Segment j may continue below the sprite; keep that part of it
+    if (j < n && sky[j].y < bestY + h) {
+        sky[j].h -= bestY + h - sky[j].y;
+        sky[j].y = bestY + h;
+    }
+    memmove(sky + i + 1, sky + j, (n - j) * sizeof(*sky));
+    n += i + 1 - j;
+    sky[i].y = bestY;
+    sky[i].h = h;
+    sky[i].x = bestX + w;
+    // Merge with neighbours filled to the same column
+    if (i + 1 < n && sky[i + 1].x == sky[i].x) {
+        sky[i].h += sky[i + 1].h;
+        memmove(sky + i + 1, sky + i + 2, (n - i - 2) * sizeof(*sky));
+        n--;
+    }
+    if (i > 0 && sky[i - 1].x == sky[i].x) {
+        sky[i - 1].h += sky[i].h;
+        memmove(sky + i, sky + i + 1, (n - i - 1) * sizeof(*sky));
+        n--;
+    }
+    *nsky = n;
+    return 0;
+}
+
+/*
+ * Packs sprites, taken in the order given by order, into an atlas of height
+ * rows.  Returns the atlas width, or 0 if they do not fit.
+ */
+static int32_t packAtlas(struct fxi_sprite *sprites, const int *order,
+                         int nsprites, int32_t height, int32_t align,
+                         struct skyline *sky) {
+    int32_t width = 0;
+    int i, nsky = 1;
+
+    sky[0].y = 0;
+    sky[0].h = height;
+    sky[0].x = 0;
+    for (i = 0; i < nsprites; i++) {
+        struct fxi_sprite *s = &sprites[order[i]];
+        if (skylinePlace(sky, &nsky, height, s->width, s->height, align, &s->x,
+                         &s->y))
+            return 0;
+        if (s->x + s->width > width)
+            width = s->x + s->width;
+    }
+    return width <= FXI_MAX_WIDTH ? width : 0;
+}
+
+static struct fxi_sprite *sortSprites;
+
+// Tallest first, then widest
+static int compareSpriteSize(const void *a, const void *b) {
+    const struct fxi_sprite *sa = &sortSprites[*(const int *)a];
+    const struct fxi_sprite *sb = &sortSprites[*(const int *)b];
+    if (sa->height != sb->height)
+        return sb->height - sa->height;
+    return sb->width - sa->width;
+}
+
+static int compareSpriteName(const void *a, const void *b) {
+    return strcmp(sortSprites[*(const int *)a].name,
+                  sortSprites[*(const int *)b].name);
+}
+
+/*
+ * Counts the distinct colors in sprites, stopping past 256.
+ */
+static int countColors(const struct fxi_sprite *sprites, int nsprites) {
+    u8 *seen = callocs(0x10000 / 8, 1);
+    int i, ncolors = 0;
+    size_t j;
+
+    for (i = 0; i < nsprites && ncolors <= 256; i++) {
+        const struct fxi_sprite *s = &sprites[i];
+        for (j = 0; j < (size_t)s->width * s->height; j++) {
+            u16 px = s->pixels[j];
+            if (!(seen[px / 8] & 1 << px % 8)) {
+                seen[px / 8] |= 1 << px % 8;
+                ncolors++;
+            }
+        }
+    }
+    free(seen);
+    return ncolors;
+}
+
+/*
+ * Packs sprites into a single fxi image and encodes it as an fxt atlas,
+ * choosing the codec as fxi_encode does.  Sprites must have distinct names
+ * and are given their positions in the atlas.  Returns NULL if they cannot
+ * fit in the largest fxi image, otherwise the atlas with size set to its
+ * length in bytes.
+ */
+u8 *fxi_encodeAtlas(struct fxi_sprite *sprites, int nsprites, int codec,
+                    int allowPalette, const struct fxi_weights *weights,
+                    size_t *size) {
+    struct skyline *sky = mallocs((2 * nsprites + 1) * sizeof(*sky));
+    int *order = mallocs((nsprites + 1) * sizeof(*order));
+    int32_t height, width, bestHeight = 0, bestWidth = 0, align = 1;
+    int32_t tallest = 1, y;
+    size_t namesSize = 0, imageSize, len;
+    int i, ncolors;
+    u16 *pixels;
+    u8 *image, *out, *e;
+
+    if (nsprites < 1 || nsprites > 0xFFFF)
+        goto fail;
+    for (i = 0; i < nsprites; i++) {
+        order[i] = i;
+        namesSize += strlen(sprites[i].name) + 1;
+        if (sprites[i].height > tallest)
+            tallest = sprites[i].height;
+    }
+    if (namesSize > 0xFFFF || tallest > FXI_MAX_HEIGHT)
+        goto fail;
+
+    // Paletted sprites must start on a whole byte of indices
+    ncolors = countColors(sprites, nsprites);
+    if (allowPalette && codec != IMAGE_CODEC_RLE && ncolors <= 256)
+        align = ncolors <= 2 ? 8 : ncolors <= 4 ? 4 : ncolors <= 16 ? 2 : 1;
+
+    sortSprites = sprites;
+    qsort(order, nsprites, sizeof(*order), compareSpriteSize);
+    for (height = tallest; height <= FXI_MAX_HEIGHT; height++) {
+        width = packAtlas(sprites, order, nsprites, height, align, sky);
+        if (width && (bestWidth == 0 ||
+                      (u64)width * height < (u64)bestWidth * bestHeight)) {
+            bestWidth = width;
+            bestHeight = height;
+        }
+    }
+    if (bestWidth == 0)
+        goto fail;
+    packAtlas(sprites, order, nsprites, bestHeight, align, sky);
+
+    // Gaps take a color already in use so they never add to the palette
+    pixels = mallocs(2 * (size_t)bestWidth * bestHeight);
+    for (len = 0; len < (size_t)bestWidth * bestHeight; len++)
+        pixels[len] = sprites[0].pixels[0];
+    for (i = 0; i < nsprites; i++) {
+        const struct fxi_sprite *s = &sprites[i];
+        for (y = 0; y < s->height; y++)
+            memcpy(pixels + (size_t)bestWidth * (s->y + y) + s->x,
+                   s->pixels + (size_t)s->width * y, 2 * s->width);
+    }
+    image = fxi_encode(pixels, bestWidth, bestHeight, codec, allowPalette,
+                       weights, &imageSize);
+    free(pixels);
+
+    qsort(order, nsprites, sizeof(*order), compareSpriteName);
+    len = ATLAS_HEADER_SIZE + (size_t)ATLAS_ENTRY_SIZE * nsprites;
+    out = mallocs(len + namesSize + imageSize);
+    putU16(out, nsprites);
+    putU16(out + 2, namesSize);
+    namesSize = 0;
+    for (i = 0; i < nsprites; i++) {
+        const struct fxi_sprite *s = &sprites[order[i]];
+        e = out + ATLAS_HEADER_SIZE + (size_t)ATLAS_ENTRY_SIZE * i;
+        putU16(e, namesSize);
+        putU16(e + 2, s->x);
+        e[4] = s->y;
+        putU16(e + 5, s->width);
+        e[7] = s->height;
+        strcpy((char *)out + len + namesSize, s->name);
+        namesSize += strlen(s->name) + 1;
+    }
+    len += namesSize;
+    memcpy(out + len, image, imageSize);
+    free(image);
+    free(order);
+    free(sky);
+    *size = len + imageSize;
+    return out;
+
+fail:
+    free(order);
+    free(sky);
+    return NULL;
+}
+
+/*
+ * Walks a stream of codec that should decode to exactly n bytes from the
+ * avail bytes at p.  Returns nonzero if it would read or write out of
+ * bounds.
+ */
+static int checkStream(int codec, const u8 *p, size_t avail, size_t n) {
+    size_t done = 0;
+
+    switch (codec) {
+    case IMAGE_CODEC_RAW:
+        return avail < n;
+    case IMAGE_CODEC_RLE:
+        n /= 2;
+        while (done < n) {
+            size_t l, need;
+            if (avail < 1)
+                return 1;
+            if (*p & 0x80) {
+                l = (*p & 0x7F) + 2;
+                need = 3;
+            } else {
+                l = *p + 1;
+                need = 1 + 2 * l;
+            }
+            if (l > n - done || need > avail)
+                return 1;
+            p += need;
+            avail -= need;
+            done += l;
+        }
+        return 0;
+    case IMAGE_CODEC_LZF:
+        while (done < n) {
+            size_t l, need;
+            if (avail < 1)
+                return 1;
+            if (*p >> 5 == 0) {
+                l = (*p & 0x1F) + 1;
+                need = 1 + l;
+            } else {
+                size_t d;
+                need = *p >> 5 == 7 ? 3 : 2;
+                if (need > avail)
+                    return 1;
+                l = need == 3 ? p[1] + 9u : (*p >> 5) + 3u;
+                d = ((size_t)(*p & 0x1F) << 8 | p[need - 1]) + 1;
+                if (d > done)
+                    return 1;
+            }
+            if (l > n - done || need > avail)
+                return 1;
+            p += need;
+            avail -= need;
+            done += l;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Checks that the fxi image in data, size bytes long, decodes to its
+ * stated size without reading past its end.  fx-imglib's decoders trust
+ * their input, so files from elsewhere should pass this first.  Palette
+ * indices are not checked against the palette size.  Returns nonzero if
+ * the image is invalid.
+ */
+int fxi_check(const u8 *data, size_t size) {
+    const u8 *p = data + IMAGE_HEADER_SIZE;
+    size_t n, avail;
+    int codec;
+
+    if (size < IMAGE_HEADER_SIZE ||
+        (data[3] & ~(IMAGE_CODEC_MASK | IMAGE_PALETTED)))
+        return 1;
+    avail = size - IMAGE_HEADER_SIZE;
+    codec = data[3] & IMAGE_CODEC_MASK;
+    n = (size_t)(data[0] << 8 | data[1]) * data[2];
+
+    if (data[3] & IMAGE_PALETTED) {
+        size_t header;
+        int bpp;
+        if (avail < 2 || codec == IMAGE_CODEC_RLE)
+            return 1;
+        bpp = p[0];
+        header = 2 + 2 * (p[1] + 1);
+        if ((bpp != 1 && bpp != 2 && bpp != 4 && bpp != 8) || avail < header)
+            return 1;
+        n = ((size_t)(data[0] << 8 | data[1]) * bpp + 7) / 8 * data[2];
+        return checkStream(codec, p + header, avail - header, n);
+    }
+    return checkStream(codec, p, avail, 2 * n);
+}
+
+/*
+ * Checks an fxt atlas as fxi_check does its image, and that every entry
+ * names a string in the name table and lies within the image.  Returns
+ * nonzero if the atlas is invalid.
+ */
+int fxi_checkAtlas(const u8 *data, size_t size) {
+    size_t count, namesSize, namesOfs, i;
+    const u8 *image, *e;
+    u32 width, height;
+
+    if (size < ATLAS_HEADER_SIZE)
+        return 1;
+    count = data[0] << 8 | data[1];
+    namesSize = data[2] << 8 | data[3];
+    namesOfs = ATLAS_HEADER_SIZE + ATLAS_ENTRY_SIZE * count;
+    if (size < namesOfs + namesSize ||
+        (namesSize && data[namesOfs + namesSize - 1]) ||
+        fxi_check(data + namesOfs + namesSize, size - namesOfs - namesSize))
+        return 1;
+    image = data + namesOfs + namesSize;
+    width = image[0] << 8 | image[1];
+    height = image[2];
+
+    for (i = 0; i < count; i++) {
+        e = data + ATLAS_HEADER_SIZE + ATLAS_ENTRY_SIZE * i;
+        if ((size_t)(e[0] << 8 | e[1]) >= namesSize ||
+            (u32)(e[2] << 8 | e[3]) + (e[5] << 8 | e[6]) > width ||
+            (u32)e[4] + e[7] > height)
+            return 1;
+        // Views of paletted images start on a whole byte
+        if ((image[3] & IMAGE_PALETTED) && (e[2] << 8 | e[3]) * image[4] % 8)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Checks an fxa animation as fxi_check does an image: that frame 0 is a
+ * keyframe, that every frame lies within the file and decodes without
+ * reading past its end, and that each delta's dirty rectangles lie within
+ * the frame and fit its scratch buffer.  Returns nonzero if the animation
+ * is invalid.
+ */
+int fxi_checkAnimation(const u8 *data, size_t size) {
+    size_t nframes, maxDelta, ofs, avail, n, i, r;
+    u32 width, height;
+    const u8 *p, *rect;
+
+    if (size < ANIM_HEADER_SIZE)
+        return 1;
+    width = data[0] << 8 | data[1];
+    height = data[2];
+    nframes = data[4] << 8 | data[5];
+    maxDelta = (size_t)data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11];
+    if (nframes == 0 || size < ANIM_HEADER_SIZE + 4 * nframes)
+        return 1;
+
+    for (i = 0; i < nframes; i++) {
+        p = data + ANIM_HEADER_SIZE + 4 * i;
+        ofs = (size_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+        if (ofs > size || size - ofs < 2)
+            return 1;
+        p = data + ofs;
+        avail = size - ofs - 2;
+        if (p[0] == ANIM_KEYFRAME) {
+            if (checkStream(p[1], p + 2, avail, 2 * (size_t)width * height))
+                return 1;
+            continue;
+        }
+        if (p[0] != ANIM_DELTA || i == 0 || avail < 1 ||
+            (avail - 1) / 6 < p[2])
+            return 1;
+        rect = p + 3;
+        for (r = 0, n = 0; r < p[2]; r++, rect += 6) {
+            if ((u32)(rect[0] << 8 | rect[1]) + (rect[3] << 8 | rect[4]) >
+                    width ||
+                (u32)rect[2] + rect[5] > height)
+                return 1;
+            n += (size_t)(rect[3] << 8 | rect[4]) * rect[5];
+        }
+        if (n > maxDelta ||
+            checkStream(p[1], rect, avail - 1 - 6 * (size_t)p[2], 2 * n))
+            return 1;
+    }
+    return 0;
+}
+
+static const char *codecNames[] = {"raw", "rle", "lzf"};
+
+const char *fxi_codecName(int codec) {
+    if (codec < 0 || codec >= (int)(sizeof(codecNames) / sizeof(*codecNames)))
+        return "unknown";
+    return codecNames[codec];
+}
+
+/*
+ * Parses a codec name, or "auto" for FXI_CODEC_AUTO.  Returns nonzero if
+ * it is not recognized.
+ */
+int fxi_parseCodec(const char *name, int *codec) {
+    int c;
+    if (!strcmp(name, "auto")) {
+        *codec = FXI_CODEC_AUTO;
+        return 0;
+    }
+    for (c = 0; c < (int)(sizeof(codecNames) / sizeof(*codecNames)); c++) {
+        if (!strcmp(name, codecNames[c])) {
+            *codec = c;
+            return 0;
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,53 @@
+#ifndef _FXI_H
+#define _FXI_H
+
+#include "config.h"
+#include <stddef.h>
+
+/*
+ * Host-side encoder for fx-imglib's fxi images and fxa animations; see
+ * fx-imglib/image.h for the formats and the device-side decoders.
+ */
+#define FXI_MAX_WIDTH (0xFFFF)
+#define FXI_MAX_HEIGHT (0xFF)
+#define FXI_MAX_FRAMES (0xFFFF)
+
+/* Pass as codec to choose by fxi_weights */
+#define FXI_CODEC_AUTO (-1)
+
+/*
+ * Exponents for encoded size and estimated decode cycles in the score
+ * size^size * cycles^cost that picks a codec; the lowest score wins.
+ */
+struct fxi_weights {
+    double size;
+    double cost;
+};
+
+/*
+ * An image to pack into an atlas.  x and y are set to where it was placed.
+ */
+struct fxi_sprite {
+    const char *name;
+    const u16 *pixels;
+    int32_t width, height;
+    int32_t x, y;
+};
+
+u8 *fxi_encode(const u16 *pixels, int32_t width, int32_t height, int codec,
+               int allowPalette, const struct fxi_weights *weights,
+               size_t *size);
+u8 *fxi_encodeAnimation(const u16 *const *frames, int nframes, int32_t width,
+                        int32_t height, int codec, int keyInterval,
+                        const struct fxi_weights *weights, size_t *size,
+                        int *keyframes);
+u8 *fxi_encodeAtlas(struct fxi_sprite *sprites, int nsprites, int codec,
+                    int allowPalette, const struct fxi_weights *weights,
+                    size_t *size);
+int fxi_check(const u8 *data, size_t size);
+int fxi_checkAtlas(const u8 *data, size_t size);
+int fxi_checkAnimation(const u8 *data, size_t size);
+const char *fxi_codecName(int codec);
+int fxi_parseCodec(const char *name, int *codec);
+
+#endif /* _FXI_H */
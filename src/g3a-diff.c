@@ -0,0 +1,409 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#else
+#include "getopt.h"
+#endif /* HAVE_UNISTD_H */
+
+#include "g3a.h"
+#include "util.h"
+
+static void usage(void) {
+    printf("Usage: g3a-diff [-f text|json] <a.g3a> <b.g3a>\n");
+    printf("\nCompares two g3a files field by field: header fields, the\n"
+           "pixels of each icon and the code.  Exits with 0 if the files\n"
+           "are identical, 1 if they differ and 2 on error.\n");
+}
+
+/*
+ * Header fields compared one by one.  Everything else in the header apart
+ * from the icons is compared as plain bytes.
+ */
+enum field_type { FIELD_BYTES, FIELD_U32, FIELD_STRING };
+
+struct field {
+    const char *name;
+    size_t offset, size;
+    enum field_type type;
+};
+
+#define FIELD(member, type)                                                    \
+    {                                                                          \
+        #member, offsetof(struct g3a_header, member),                          \
+            sizeof(((struct g3a_header *)0)->member), type                     \
+    }
+
+static const struct field fields[] = {
+    FIELD(magic, FIELD_BYTES),
+    FIELD(cprot, FIELD_BYTES),
+    FIELD(crc, FIELD_BYTES),
+    FIELD(cksum, FIELD_U32),
+    FIELD(cksum2_ofs, FIELD_U32),
+    FIELD(size, FIELD_U32),
+    FIELD(name_basic, FIELD_STRING),
+    FIELD(name_internal, FIELD_STRING),
+    FIELD(name_en, FIELD_STRING),
+    FIELD(name_es, FIELD_STRING),
+    FIELD(name_de, FIELD_STRING),
+    FIELD(name_fr, FIELD_STRING),
+    FIELD(name_pt, FIELD_STRING),
+    FIELD(name_zh, FIELD_STRING),
+    FIELD(name_un1, FIELD_STRING),
+    FIELD(name_un2, FIELD_STRING),
+    FIELD(version, FIELD_STRING),
+    FIELD(timestamp, FIELD_STRING),
+    FIELD(lname_en, FIELD_STRING),
+    FIELD(lname_es, FIELD_STRING),
+    FIELD(lname_de, FIELD_STRING),
+    FIELD(lname_fr, FIELD_STRING),
+    FIELD(lname_pt, FIELD_STRING),
+    FIELD(lname_zh, FIELD_STRING),
+    FIELD(lname_un1, FIELD_STRING),
+    FIELD(lname_un2, FIELD_STRING),
+    FIELD(filename, FIELD_STRING),
+};
+#define NFIELDS (sizeof(fields) / sizeof(fields[0]))
+
+struct icon {
+    const char *name;
+    size_t offset;
+    int width, height;
+    // Bits per pixel: 16 for color icons, 4 for the monochrome one
+    int bpp;
+};
+
+static const struct icon iconFields[] = {
+    {"icon_unsel", offsetof(struct g3a_header, icon_unsel), G3A_ICON_WIDTH,
+     G3A_ICON_HEIGHT, 16},
+    {"icon_sel", offsetof(struct g3a_header, icon_sel), G3A_ICON_WIDTH,
+     G3A_ICON_HEIGHT, 16},
+    {"icon_mono", offsetof(struct g3a_header, icon_mono), G3A_ICON_MONO_WIDTH,
+     G3A_ICON_MONO_HEIGHT, 4},
+};
+#define NICONS (sizeof(iconFields) / sizeof(iconFields[0]))
+
+/* Differing byte runs closer than this are reported as one range */
+#define RANGE_GAP (16)
+/* Equal blocks of this size are skipped with a single memcmp */
+#define DIFF_BLOCK (4096)
+
+struct range {
+    size_t offset, length;
+};
+
+static struct range *ranges;
+static size_t nranges, rangeCap;
+
+static void addRange(size_t offset, size_t length) {
+    struct range *last = nranges ? &ranges[nranges - 1] : NULL;
+
+    if (last != NULL && offset - (last->offset + last->length) < RANGE_GAP) {
+        last->length = offset + length - last->offset;
+        return;
+    }
+    if (nranges == rangeCap) {
+        rangeCap = rangeCap ? rangeCap * 2 : 64;
+        ranges = realloc(ranges, rangeCap * sizeof(*ranges));
+        if (ranges == NULL) {
+            printf("Failed to allocate memory; aborting.\n");
+            exit(2);
+        }
+    }
+    ranges[nranges].offset = offset;
+    ranges[nranges++].length = length;
+}
+
+/*
+ * Adds the ranges of bytes that differ between a and b, len bytes long, to
+ * ranges with offsets starting from base.  Bytes for which skip is nonzero
+ * are not compared.
+ */
+static void diffBytes(const u8 *a, const u8 *b, size_t len, size_t base,
+                      const u8 *skip) {
+    size_t ofs, end, i, start;
+    u64 wa, wb;
+
+    for (ofs = 0; ofs < len; ofs = end) {
+        end = ofs + DIFF_BLOCK < len ? ofs + DIFF_BLOCK : len;
+        if (memcmp(a + ofs, b + ofs, end - ofs) == 0)
+            continue;
+
+        for (i = ofs; i < end;) {
+            // Skip equal words, then find the extent of the difference
+            if (i + 8 <= end) {
+                memcpy(&wa, a + i, 8);
+                memcpy(&wb, b + i, 8);
+                if (wa == wb) {
+                    i += 8;
+                    continue;
+                }
+            }
+            if (a[i] == b[i] || (skip != NULL && skip[base + i])) {
+                i++;
+                continue;
+            }
+            start = i;
+            while (i < end && a[i] != b[i] && (skip == NULL || !skip[base + i]))
+                i++;
+            addRange(base + start, i - start);
+        }
+    }
+}
+
+/*
+ * Bounding rectangle of the pixels that differ in an icon.
+ */
+struct icon_diff {
+    int pixels;
+    int x0, y0, x1, y1;
+};
+
+static int iconPixel(const u8 *p, const struct icon *icon, int x, int y) {
+    if (icon->bpp == 16)
+        return p[(y * icon->width + x) * 2] << 8 |
+               p[(y * icon->width + x) * 2 + 1];
+    p += (y * icon->width + x) / 2;
+    return x & 1 ? *p & 0xF : *p >> 4;
+}
+
+static void diffIcon(const u8 *a, const u8 *b, const struct icon *icon,
+                     struct icon_diff *d) {
+    size_t rowBytes = icon->width * icon->bpp / 8;
+    int x, y;
+
+    memset(d, 0, sizeof(*d));
+    d->x0 = icon->width;
+    d->y0 = icon->height;
+    for (y = 0; y < icon->height; y++) {
+        if (!memcmp(a + y * rowBytes, b + y * rowBytes, rowBytes))
+            continue;
+        for (x = 0; x < icon->width; x++) {
+            if (iconPixel(a, icon, x, y) == iconPixel(b, icon, x, y))
+                continue;
+            d->pixels++;
+            if (x < d->x0)
+                d->x0 = x;
+            if (x >= d->x1)
+                d->x1 = x + 1;
+            if (y < d->y0)
+                d->y0 = y;
+            d->y1 = y + 1;
+        }
+    }
+}
+
+static int json;
+
+// Prints a header string field, quoted and escaped for the output format
+static void printString(const u8 *s, size_t size) {
+    size_t i;
+
+    putchar('"');
+    for (i = 0; i < size && s[i]; i++) {
+        if (s[i] == '"' || s[i] == '\\')
+            printf("\\%c", s[i]);
+        else if (s[i] >= 0x20 && s[i] < 0x7F)
+            putchar(s[i]);
+        else if (json)
+            printf("\\u%04x", s[i]);
+        else
+            printf("\\x%02x", s[i]);
+    }
+    putchar('"');
+}
+
+static void printField(const struct field *f, const u8 *p) {
+    size_t i;
+
+    switch (f->type) {
+    case FIELD_U32:
+        printf(json ? "%lu" : "0x%08lX",
+               (unsigned long)(p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]));
+        break;
+    case FIELD_STRING:
+        printString(p, f->size);
+        break;
+    case FIELD_BYTES:
+        printf(json ? "\"" : "");
+        for (i = 0; i < f->size; i++)
+            printf("%02x", p[i]);
+        printf(json ? "\"" : "");
+        break;
+    }
+}
+
+// Separates the members of a JSON list
+static void jsonNext(int *first) {
+    printf(*first ? "\n    " : ",\n    ");
+    *first = 0;
+}
+
+static void printRanges(const char *what) {
+    size_t i;
+    int first = 1;
+
+    if (json) {
+        for (i = 0; i < nranges; i++) {
+            jsonNext(&first);
+            printf("{\"offset\": %lu, \"length\": %lu}",
+                   (unsigned long)ranges[i].offset,
+                   (unsigned long)ranges[i].length);
+        }
+        printf(first ? "]" : "\n  ]");
+        return;
+    }
+    for (i = 0; i < nranges; i++)
+        printf("%s: 0x%06lX-0x%06lX (%lu bytes)\n", what,
+               (unsigned long)ranges[i].offset,
+               (unsigned long)(ranges[i].offset + ranges[i].length - 1),
+               (unsigned long)ranges[i].length);
+}
+
+/*
+ * Prints every difference between the g3a files a and b.  Returns nonzero
+ * if there are any.
+ */
+static int diff(const u8 *a, size_t sizeA, const u8 *b, size_t sizeB) {
+    static u8 covered[sizeof(struct g3a_header)];
+    size_t i, bodyA = sizeA - 4, bodyB = sizeB - 4;
+    struct icon_diff d;
+    int differ = 0, first = 1;
+
+    if (json)
+        printf("{\n  \"fields\": [");
+    for (i = 0; i < NFIELDS; i++) {
+        const struct field *f = &fields[i];
+        memset(covered + f->offset, 1, f->size);
+        if (!memcmp(a + f->offset, b + f->offset, f->size))
+            continue;
+        differ = 1;
+        if (json) {
+            jsonNext(&first);
+            printf("{\"field\": \"%s\", \"a\": ", f->name);
+        } else {
+            printf("%s: ", f->name);
+        }
+        printField(f, a + f->offset);
+        printf(json ? ", \"b\": " : " -> ");
+        printField(f, b + f->offset);
+        printf(json ? "}" : "\n");
+    }
+
+    if (json)
+        printf(first ? "],\n  \"icons\": [" : "\n  ],\n  \"icons\": [");
+    first = 1;
+    for (i = 0; i < NICONS; i++) {
+        const struct icon *icon = &iconFields[i];
+        memset(covered + icon->offset, 1,
+               icon->width * icon->height * icon->bpp / 8);
+        diffIcon(a + icon->offset, b + icon->offset, icon, &d);
+        if (d.pixels == 0)
+            continue;
+        differ = 1;
+        if (json) {
+            jsonNext(&first);
+            printf("{\"icon\": \"%s\", \"pixels\": %d, \"x\": %d, \"y\": %d, "
+                   "\"width\": %d, \"height\": %d}",
+                   icon->name, d.pixels, d.x0, d.y0, d.x1 - d.x0, d.y1 - d.y0);
+        } else {
+            printf("%s: %d pixels differ within %dx%d at (%d, %d)\n",
+                   icon->name, d.pixels, d.x1 - d.x0, d.y1 - d.y0, d.x0, d.y0);
+        }
+    }
+
+    // Whatever is left of the header, mostly padding
+    if (json)
+        printf(first ? "],\n  \"header\": [" : "\n  ],\n  \"header\": [");
+    nranges = 0;
+    diffBytes(a, b, sizeof(covered), 0, covered);
+    differ |= nranges != 0;
+    printRanges("header");
+
+    // Code, by file offset, and the trailing checksum copy
+    nranges = 0;
+    diffBytes(a + sizeof(covered), b + sizeof(covered),
+              (bodyA < bodyB ? bodyA : bodyB) - sizeof(covered),
+              sizeof(covered), NULL);
+    differ |= nranges != 0 || bodyA != bodyB;
+    if (json) {
+        printf(",\n  \"code_size\": {\"a\": %lu, \"b\": %lu},\n  \"code\": [",
+               (unsigned long)(bodyA - sizeof(covered)),
+               (unsigned long)(bodyB - sizeof(covered)));
+    } else if (bodyA != bodyB) {
+        printf("code size: %lu -> %lu\n",
+               (unsigned long)(bodyA - sizeof(covered)),
+               (unsigned long)(bodyB - sizeof(covered)));
+    }
+    printRanges("code");
+    if (memcmp(a + bodyA, b + bodyB, 4)) {
+        differ = 1;
+        if (!json)
+            printf("trailing checksum: %02X%02X%02X%02X -> %02X%02X%02X%02X\n",
+                   a[bodyA], a[bodyA + 1], a[bodyA + 2], a[bodyA + 3],
+                   b[bodyB], b[bodyB + 1], b[bodyB + 2], b[bodyB + 3]);
+    }
+    if (json)
+        printf(",\n  \"trailer_differs\": %s,\n  \"identical\": %s\n}\n",
+               memcmp(a + bodyA, b + bodyB, 4) ? "true" : "false",
+               differ ? "false" : "true");
+    return differ;
+}
+
+static const u8 *mapG3A(const char *path, size_t *size) {
+    const u8 *p = mapFile(path, size);
+
+    if (p == NULL) {
+        printf("Unable to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (*size < sizeof(struct g3a_header) + 4 ||
+        memcmp(p, G3A_MAGIC, sizeof(G3A_MAGIC)) != 0) {
+        printf("%s is not a valid g3a\n", path);
+        unmapFile(p, *size);
+        return NULL;
+    }
+    return p;
+}
+
+int main(int argc, char **argv) {
+    const u8 *a, *b;
+    size_t sizeA, sizeB;
+    int c, differ;
+
+    while ((c = getopt(argc, argv, "f:h")) != -1) {
+        switch (c) {
+        case 'f':
+            if (!strcmp(optarg, "json")) {
+                json = 1;
+            } else if (strcmp(optarg, "text")) {
+                printf("Unknown output format: %s\n", optarg);
+                return 2;
+            }
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        return 2;
+    }
+
+    a = mapG3A(argv[optind], &sizeA);
+    if (a == NULL)
+        return 2;
+    b = mapG3A(argv[optind + 1], &sizeB);
+    if (b == NULL)
+        return 2;
+    differ = diff(a, sizeA, b, sizeB);
+    unmapFile(a, sizeA);
+    unmapFile(b, sizeB);
+    return differ;
+}
@@ -0,0 +1,314 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#else
+#include "getopt.h"
+#endif /* HAVE_UNISTD_H */
+
+#include "g3a.h"
+#include "images.h"
+#include "util.h"
+
+static void usage(void) {
+    printf("Usage: g3a-extract [-j jobs] [-f png|bmp] [-o dir] "
+           "<file or directory>...\n");
+    printf("\nUnpacks each g3a file into a directory of the same name (less\n"
+           ".g3a) in dir, by default the current one: the code as code.bin,\n"
+           "the icons as uns, sel and mono images and the header fields as\n"
+           "meta.json.  Running\n"
+           "\n    mkg3a -J <name>/meta.json <name>/code.bin <name>.g3a\n"
+           "\nrebuilds the file exactly, unless its header has something\n"
+           "mkg3a would not put there; meta.json says which.\n");
+}
+
+static const char *imageType;
+static const char *outDir = ".";
+
+/*
+ * A file to extract and the directory it goes to.
+ */
+struct extraction {
+    char *path;
+    char *dir;
+    int ok;
+    int exact;
+};
+static struct extraction *extractions;
+static size_t nextractions;
+
+static void addExtraction(const char *path, void *ctx) {
+    (void)ctx;
+    extractions =
+        realloc(extractions, (nextractions + 1) * sizeof(*extractions));
+    if (extractions == NULL) {
+        printf("Failed to allocate memory; aborting.\n");
+        exit(2);
+    }
+    extractions[nextractions].path = strdup(path);
+    extractions[nextractions].dir = NULL;
+    extractions[nextractions].ok = 0;
+    extractions[nextractions++].exact = 0;
+}
+
+/*
+ * Names the directory for each file after it, adding -2, -3 and so on where
+ * files in different directories have the same name.
+ */
+static void nameDirectories(void) {
+    size_t i, j, len;
+    const char *name, *slash;
+    char *dir;
+    int n;
+
+    for (i = 0; i < nextractions; i++) {
+        slash = strrchr(extractions[i].path, '/');
+        name = slash != NULL ? slash + 1 : extractions[i].path;
+        len = strlen(name);
+        if (len > 4 && !strcmp(name + len - 4, ".g3a"))
+            len -= 4;
+        dir = mallocs(strlen(outDir) + len + 16);
+        for (n = 1;; n++) {
+            if (n == 1)
+                sprintf(dir, "%s/%.*s", outDir, (int)len, name);
+            else
+                sprintf(dir, "%s/%.*s-%d", outDir, (int)len, name, n);
+            for (j = 0; j < i && strcmp(extractions[j].dir, dir); j++)
+                ;
+            if (j == i)
+                break;
+        }
+        extractions[i].dir = dir;
+    }
+}
+
+static char *joinPath(const char *dir, const char *name) {
+    char *path = mallocs(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+/*
+ * Whether mkg3a -J would rebuild the file at data (size bytes, whose header
+ * gives g3aSize) exactly from meta and the files in dir.  The icons are
+ * loaded back from their images just as mkg3a would, so this also checks
+ * that the images hold exactly the pixels from the header.
+ */
+static int rebuildsExactly(const u8 *data, size_t size, u32 g3aSize,
+                           u32 codeSum, const struct g3a_meta *meta,
+                           const char *dir) {
+    const struct g3a_header *h = (const struct g3a_header *)data;
+    struct g3a_header *tmpl;
+    struct icons icons;
+    int32_t width, height;
+    char *paths[META_ICONS];
+    u16 *mono = NULL;
+    int i, exact = 0;
+
+    for (i = 0; i < META_ICONS; i++)
+        paths[i] = joinPath(dir, meta->icons[i]);
+    if (loadIconInto(paths[META_ICON_UNS], icons.unselected, G3A_ICON_WIDTH,
+                     G3A_ICON_HEIGHT, RESIZE_FIT) ||
+        loadIconInto(paths[META_ICON_SEL], icons.selected, G3A_ICON_WIDTH,
+                     G3A_ICON_HEIGHT, RESIZE_FIT) ||
+        (mono = loadBitmap(paths[META_ICON_MONO], &width, &height)) == NULL)
+        goto out;
+    convertMono(mono, width, height, icons.mono, G3A_ICON_MONO_WIDTH,
+                G3A_ICON_MONO_HEIGHT);
+
+    tmpl = g3a_mkTemplate((struct lc_names *)&meta->names, &icons,
+                          meta->version);
+    strncpy(tmpl->timestamp, meta->timestamp, sizeof(tmpl->timestamp) - 1);
+    strncpy(tmpl->filename, meta->filename, sizeof(tmpl->filename) - 1);
+    g3a_fillSize(tmpl, g3aSize - sizeof(*tmpl) - 4);
+    g3a_fillCProt(tmpl);
+    dumpb_u32(g3a_headerSum(tmpl) + codeSum, &tmpl->cksum);
+    exact = g3aSize == size && !memcmp(tmpl, h, sizeof(*tmpl)) &&
+            !memcmp(&tmpl->cksum, data + size - 4, 4);
+    free(tmpl);
+
+out:
+    free(mono);
+    for (i = 0; i < META_ICONS; i++)
+        free(paths[i]);
+    return exact;
+}
+
+/*
+ * Expands the packed monochrome icon to 5-6-5 pixels, black for 0 and white
+ * for anything else.
+ */
+static void expandMono(const u8 *packed, u16 *pixels) {
+    int i;
+
+    for (i = 0; i < G3A_ICON_MONO_WIDTH * G3A_ICON_MONO_HEIGHT; i++) {
+        u8 v = i & 1 ? packed[i / 2] & 0x0F : packed[i / 2] >> 4;
+        pixels[i] = v ? 0xFFFF : 0;
+    }
+}
+
+/*
+ * Extracts the file in ex into its directory.  Returns nonzero on failure.
+ */
+static int extract(struct extraction *ex) {
+    static const char *const iconNames[META_ICONS] = {"uns", "sel", "mono"};
+    u16 mono[G3A_ICON_MONO_WIDTH * G3A_ICON_MONO_HEIGHT];
+    const u16 *pixels[META_ICONS];
+    const struct g3a_header *h;
+    struct g3a_meta meta;
+    u32 g3aSize, codeSum, cksum;
+    size_t size;
+    char *path;
+    int i, failed = 1;
+    const u8 *data = mapFile(ex->path, &size);
+    if (data == NULL) {
+        printf("Unable to read %s: %s\n", ex->path, strerror(errno));
+        return 1;
+    }
+
+    h = (const struct g3a_header *)data;
+    if (size < sizeof(*h) + 4 ||
+        memcmp(h->magic, G3A_MAGIC, sizeof(G3A_MAGIC)) != 0) {
+        printf("%s is not a g3a file\n", ex->path);
+        goto out;
+    }
+    // The code runs up to the copy of the checksum at the end
+    g3aSize = u32_beton(h->size);
+    if (g3aSize < sizeof(*h) + 4 || g3aSize > size) {
+        printf("%s: size in header does not match the file\n", ex->path);
+        goto out;
+    }
+    codeSum = checksum(data + sizeof(*h), g3aSize - sizeof(*h) - 4);
+    cksum = g3a_headerSum(h) + codeSum;
+    if (cksum != u32_beton(h->cksum) ||
+        memcmp(&h->cksum, data + g3aSize - 4, 4) != 0)
+        printf("%s: checksum does not match; extracting anyway\n", ex->path);
+
+    if (mkdir(ex->dir, 0777) != 0 && errno != EEXIST) {
+        printf("Unable to create %s: %s\n", ex->dir, strerror(errno));
+        goto out;
+    }
+    path = joinPath(ex->dir, "code.bin");
+    if (copyFilePart(ex->path, sizeof(*h), g3aSize - sizeof(*h) - 4, path)) {
+        printf("Unable to write %s: %s\n", path, strerror(errno));
+        free(path);
+        goto out;
+    }
+    free(path);
+
+    g3a_getMeta(h, &meta);
+    meta.code = strdup("code.bin");
+    expandMono(h->icon_mono, mono);
+    pixels[META_ICON_UNS] = h->icon_unsel;
+    pixels[META_ICON_SEL] = h->icon_sel;
+    pixels[META_ICON_MONO] = mono;
+    for (i = 0; i < META_ICONS; i++) {
+        meta.icons[i] = mallocs(strlen(iconNames[i]) + strlen(imageType) + 2);
+        sprintf(meta.icons[i], "%s.%s", iconNames[i], imageType);
+        path = joinPath(ex->dir, meta.icons[i]);
+        failed = i == META_ICON_MONO
+                     ? writeImage(path, pixels[i], G3A_ICON_MONO_WIDTH,
+                                  G3A_ICON_MONO_HEIGHT)
+                     : writeImage(path, pixels[i], G3A_ICON_WIDTH,
+                                  G3A_ICON_HEIGHT);
+        free(path);
+        if (failed) {
+            g3a_freeMeta(&meta);
+            goto out;
+        }
+    }
+
+    meta.size = g3aSize;
+    meta.cksum = u32_beton(h->cksum);
+    meta.exact = ex->exact =
+        rebuildsExactly(data, size, g3aSize, codeSum, &meta, ex->dir);
+    path = joinPath(ex->dir, "meta.json");
+    failed = g3a_writeMeta(path, &meta);
+    free(path);
+    g3a_freeMeta(&meta);
+
+out:
+    unmapFile(data, size);
+    return failed;
+}
+
+static void extractWorker(void *ctx, size_t i) {
+    (void)ctx;
+    extractions[i].ok = !extract(&extractions[i]);
+}
+
+int main(int argc, char **argv) {
+    int c, i, jobs = defaultJobs(), failed = 0;
+    size_t j, inexact = 0;
+
+#if USE_PNG
+    imageType = "png";
+#else
+    imageType = "bmp";
+#endif
+    while ((c = getopt(argc, argv, "j:f:o:h")) != -1) {
+        switch (c) {
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'f':
+            if (!strcmp(optarg, "bmp")) {
+                imageType = "bmp";
+#if USE_PNG
+            } else if (!strcmp(optarg, "png")) {
+                imageType = "png";
+#endif
+            } else {
+                printf("Unsupported image format: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            outDir = optarg;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (argc - optind < 1) {
+        usage();
+        return 1;
+    }
+    if (mkdir(outDir, 0777) != 0 && errno != EEXIST) {
+        printf("Unable to create %s: %s\n", outDir, strerror(errno));
+        return 1;
+    }
+
+    for (i = optind; i < argc; i++) {
+        if (!isDirectory(argv[i]))
+            addExtraction(argv[i], NULL);
+        else if (findFiles(argv[i], ".g3a", addExtraction, NULL)) {
+            printf("Unable to search %s: %s\n", argv[i], strerror(errno));
+            return 1;
+        }
+    }
+    nameDirectories();
+
+    parallelFor(jobs, nextractions, extractWorker, NULL);
+
+    for (j = 0; j < nextractions; j++) {
+        struct extraction *ex = &extractions[j];
+        if (!ex->ok) {
+            failed = 1;
+            continue;
+        }
+        printf("%s -> %s%s\n", ex->path, ex->dir,
+               ex->exact ? "" : " (will not rebuild exactly)");
+        inexact += !ex->exact;
+    }
+    if (inexact)
+        printf("%lu files have header fields mkg3a does not set\n",
+               (unsigned long)inexact);
+    return failed;
+}
@@ -0,0 +1,417 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#else
+#include "getopt.h"
+#endif /* HAVE_UNISTD_H */
+
+#include "g3a-index.h"
+#include "g3a.h"
+#include "util.h"
+
+static void usage(void) {
+    printf("Usage: g3a-index [-j jobs] [-f] <index> <directory>...\n"
+           "       g3a-index -l <index>\n");
+    printf("\nBuilds a catalog of every g3a file under each directory in\n"
+           "index.  If index already exists, only files whose size or\n"
+           "modification time changed are read again, unless -f is given.\n"
+           "-l lists the contents of an index.\n");
+}
+
+/*
+ * What is known about one g3a file while building the index.
+ */
+struct scan {
+    char *path;
+    u64 mtime, file_size;
+    // Record for this file in the previous index, if it is unchanged
+    const struct g3a_index_record *old;
+    int ok;
+
+    char name_basic[0x1C];
+    char name_internal[0xB];
+    char lc_names[8][0x18];
+    char version[0xC];
+    char timestamp[15];
+    struct g3a_index_record rec;
+};
+
+static struct scan *scans;
+static size_t nscans;
+
+static void addScan(const char *path, void *ctx) {
+    (void)ctx;
+    scans = realloc(scans, (nscans + 1) * sizeof(*scans));
+    if (scans == NULL) {
+        printf("Failed to allocate memory; aborting.\n");
+        exit(2);
+    }
+    memset(&scans[nscans], 0, sizeof(*scans));
+    scans[nscans++].path = strdup(path);
+}
+
+static int compareScans(const void *a, const void *b) {
+    return strcmp(((const struct scan *)a)->path,
+                  ((const struct scan *)b)->path);
+}
+
+/*
+ * The previous index, if any, mapped for lookups.
+ */
+static const u8 *oldIndex;
+static size_t oldIndexSize;
+static const struct g3a_index_record *oldRecords;
+static u32 oldCount;
+static const char *oldStrings;
+
+/*
+ * Whether every string offset in r lies within a pool of size bytes.
+ */
+static int recordInBounds(const struct g3a_index_record *r, u64 size) {
+    int i;
+
+    if (r->path >= size || r->name_basic >= size ||
+        r->name_internal >= size || r->version >= size ||
+        r->timestamp >= size)
+        return 0;
+    for (i = 0; i < 8; i++) {
+        if (r->lc_names[i] >= size)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Returns 0 on success, 1 if the file could not be read (with errno set) or
+ * 2 if it is not a usable index.  Since the pool ends in a NUL, checking
+ * that each string offset is inside it keeps every lookup in the mapping.
+ */
+static int mapOldIndex(const char *path) {
+    const struct g3a_index_header *h;
+    u32 i;
+
+    oldIndex = mapFile(path, &oldIndexSize);
+    if (oldIndex == NULL)
+        return 1;
+    h = (const struct g3a_index_header *)oldIndex;
+    if (oldIndexSize < sizeof(*h) || h->magic != G3A_INDEX_MAGIC ||
+        h->version != G3A_INDEX_VERSION ||
+        h->record_size != sizeof(struct g3a_index_record) ||
+        h->records_ofs % sizeof(u64) != 0 || h->records_ofs > oldIndexSize ||
+        (u64)h->nrecords * h->record_size > oldIndexSize - h->records_ofs ||
+        h->strings_ofs > oldIndexSize ||
+        h->strings_size > oldIndexSize - h->strings_ofs ||
+        (h->nrecords && (h->strings_size == 0 ||
+                         oldIndex[h->strings_ofs + h->strings_size - 1])))
+        goto bad;
+    oldRecords = (const struct g3a_index_record *)(oldIndex + h->records_ofs);
+    for (i = 0; i < h->nrecords; i++) {
+        if (!recordInBounds(&oldRecords[i], h->strings_size))
+            goto bad;
+    }
+    oldCount = h->nrecords;
+    oldStrings = (const char *)oldIndex + h->strings_ofs;
+    return 0;
+
+bad:
+    unmapFile(oldIndex, oldIndexSize);
+    oldIndex = NULL;
+    oldRecords = NULL;
+    return 2;
+}
+
+static const struct g3a_index_record *findOldRecord(const char *path) {
+    u32 lo = 0, hi = oldCount;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        int c = strcmp(path, oldStrings + oldRecords[mid].path);
+        if (c == 0)
+            return &oldRecords[mid];
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+/*
+ * Reads the header fields and hashes of one g3a file.
+ */
+static void scanWorker(void *ctx, size_t i) {
+    struct scan *s = &scans[i];
+    const struct g3a_header *h;
+    size_t size;
+    const u8 *g3a;
+    (void)ctx;
+
+    if (s->old != NULL) {
+        s->ok = 1;
+        return;
+    }
+
+    g3a = mapFile(s->path, &size);
+    if (g3a == NULL) {
+        printf("Unable to open %s: %s\n", s->path, strerror(errno));
+        return;
+    }
+    h = (const struct g3a_header *)g3a;
+    if (size < sizeof(*h) + 4 ||
+        memcmp(h->magic, G3A_MAGIC, sizeof(G3A_MAGIC)) != 0) {
+        printf("Skipping %s: not a valid g3a\n", s->path);
+        unmapFile(g3a, size);
+        return;
+    }
+
+    memcpy(s->name_basic, h->name_basic, sizeof(s->name_basic));
+    memcpy(s->name_internal, h->name_internal, sizeof(s->name_internal));
+    memcpy(s->lc_names, h->lc_names, sizeof(s->lc_names));
+    memcpy(s->version, h->version, sizeof(s->version));
+    memcpy(s->timestamp, h->timestamp, sizeof(s->timestamp));
+    s->rec.size = u32_beton(h->size);
+    s->rec.cksum = u32_beton(h->cksum);
+    s->rec.icon_unsel_hash = hash64(h->icon_unsel, sizeof(h->icon_unsel));
+    s->rec.icon_sel_hash = hash64(h->icon_sel, sizeof(h->icon_sel));
+    s->rec.body_hash = hash64(g3a + sizeof(*h), size - sizeof(*h) - 4);
+    unmapFile(g3a, size);
+    s->ok = 1;
+}
+
+/*
+ * String pool under construction.  Identical strings (names are usually
+ * repeated across languages) are stored once, found through an open
+ * addressing table of offsets.
+ */
+static char *pool;
+static size_t poolSize, poolCap;
+static u32 *poolTable;
+static size_t poolTableCap, poolCount;
+
+static void poolGrowTable(void);
+
+static u32 poolAdd(const char *s, size_t len) {
+    u64 hash = hash64(s, len);
+    size_t slot;
+
+    if (poolCount >= poolTableCap / 2)
+        poolGrowTable();
+    for (slot = hash % poolTableCap; poolTable[slot] != (u32)-1;
+         slot = (slot + 1) % poolTableCap) {
+        const char *t = pool + poolTable[slot];
+        if (strlen(t) == len && !memcmp(t, s, len))
+            return poolTable[slot];
+    }
+
+    while (poolSize + len + 1 > poolCap) {
+        poolCap = poolCap ? poolCap * 2 : 4096;
+        pool = realloc(pool, poolCap);
+        if (pool == NULL) {
+            printf("Failed to allocate memory; aborting.\n");
+            exit(2);
+        }
+    }
+    poolTable[slot] = poolSize;
+    memcpy(pool + poolSize, s, len);
+    pool[poolSize + len] = 0;
+    poolSize += len + 1;
+    poolCount++;
+    return poolTable[slot];
+}
+
+static void poolGrowTable(void) {
+    u32 *old = poolTable;
+    size_t oldCap = poolTableCap, i;
+
+    poolTableCap = poolTableCap ? poolTableCap * 2 : 1024;
+    poolTable = mallocs(poolTableCap * sizeof(*poolTable));
+    memset(poolTable, 0xFF, poolTableCap * sizeof(*poolTable));
+    for (i = 0; i < oldCap; i++) {
+        size_t slot;
+        const char *t;
+        if (old[i] == (u32)-1)
+            continue;
+        t = pool + old[i];
+        slot = hash64(t, strlen(t)) % poolTableCap;
+        while (poolTable[slot] != (u32)-1)
+            slot = (slot + 1) % poolTableCap;
+        poolTable[slot] = old[i];
+    }
+    free(old);
+}
+
+// Adds a fixed-size header field, which need not be NUL-terminated
+#define POOL_FIELD(f) poolAdd((f), strnlen((f), sizeof(f)))
+#define POOL_OLD(o) poolAdd(oldStrings + (o), strlen(oldStrings + (o)))
+
+static int writeIndex(const char *path) {
+    struct g3a_index_header h;
+    struct g3a_index_record *records;
+    size_t i, j, n = 0;
+    char *tmpPath;
+    FILE *fp;
+    int failed;
+
+    records = callocs(nscans ? nscans : 1, sizeof(*records));
+    for (i = 0; i < nscans; i++) {
+        struct scan *s = &scans[i];
+        struct g3a_index_record *r = &records[n];
+        if (!s->ok)
+            continue;
+        n++;
+
+        if (s->old != NULL) {
+            *r = *s->old;
+            r->path = poolAdd(s->path, strlen(s->path));
+            r->name_basic = POOL_OLD(s->old->name_basic);
+            r->name_internal = POOL_OLD(s->old->name_internal);
+            for (j = 0; j < 8; j++)
+                r->lc_names[j] = POOL_OLD(s->old->lc_names[j]);
+            r->version = POOL_OLD(s->old->version);
+            r->timestamp = POOL_OLD(s->old->timestamp);
+            continue;
+        }
+        *r = s->rec;
+        r->path = poolAdd(s->path, strlen(s->path));
+        r->name_basic = POOL_FIELD(s->name_basic);
+        r->name_internal = POOL_FIELD(s->name_internal);
+        for (j = 0; j < 8; j++)
+            r->lc_names[j] = POOL_FIELD(s->lc_names[j]);
+        r->version = POOL_FIELD(s->version);
+        r->timestamp = POOL_FIELD(s->timestamp);
+        r->mtime = s->mtime;
+        r->file_size = s->file_size;
+    }
+
+    memset(&h, 0, sizeof(h));
+    h.magic = G3A_INDEX_MAGIC;
+    h.version = G3A_INDEX_VERSION;
+    h.nrecords = n;
+    h.record_size = sizeof(*records);
+    h.records_ofs = sizeof(h);
+    h.strings_ofs = h.records_ofs + n * sizeof(*records);
+    h.strings_size = poolSize;
+
+    // Readers may have the old index mapped, so replace rather than rewrite
+    fp = openReplacement(path, &tmpPath);
+    if (fp == NULL) {
+        printf("Unable to create index: %s\n", strerror(errno));
+        return 1;
+    }
+    failed = fwrite(&h, sizeof(h), 1, fp) != 1 ||
+             fwrite(records, sizeof(*records), n, fp) != n ||
+             fwrite(pool, 1, poolSize, fp) != poolSize;
+    free(records);
+    if (commitReplacement(fp, tmpPath, path, failed)) {
+        printf("Failed to write index: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int listIndex(const char *path) {
+    u32 i, j;
+
+    switch (mapOldIndex(path)) {
+    case 1:
+        printf("Unable to read %s: %s\n", path, strerror(errno));
+        return 1;
+    case 2:
+        printf("%s is not a valid index\n", path);
+        return 1;
+    }
+    for (i = 0; i < oldCount; i++) {
+        const struct g3a_index_record *r = &oldRecords[i];
+        printf("%s\n", oldStrings + r->path);
+        printf("  name %s (%s), version %s, built %s\n",
+               oldStrings + r->name_basic, oldStrings + r->name_internal,
+               oldStrings + r->version, oldStrings + r->timestamp);
+        printf("  localized");
+        for (j = 0; j < 8; j++)
+            printf(" \"%s\"", oldStrings + r->lc_names[j]);
+        printf("\n  size %u, checksum %08X\n", r->size, r->cksum);
+        printf("  hashes: unselected %016llX selected %016llX body %016llX\n",
+               (unsigned long long)r->icon_unsel_hash,
+               (unsigned long long)r->icon_sel_hash,
+               (unsigned long long)r->body_hash);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int c, jobs = defaultJobs(), full = 0, list = 0;
+    size_t i, indexed = 0, reread = 0;
+
+    while ((c = getopt(argc, argv, "j:flh")) != -1) {
+        switch (c) {
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'f':
+            full = 1;
+            break;
+        case 'l':
+            list = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+
+    if (list) {
+        if (argc - optind != 1) {
+            usage();
+            return 1;
+        }
+        return listIndex(argv[optind]);
+    }
+    if (argc - optind < 2) {
+        usage();
+        return 1;
+    }
+
+    for (c = optind + 1; c < argc; c++) {
+        if (findFiles(argv[c], ".g3a", addScan, NULL)) {
+            printf("Unable to search %s: %s\n", argv[c], strerror(errno));
+            return 1;
+        }
+    }
+    qsort(scans, nscans, sizeof(*scans), compareScans);
+
+    if (!full && mapOldIndex(argv[optind]) == 2)
+        printf("Rebuilding invalid index %s\n", argv[optind]);
+    for (i = 0; i < nscans; i++) {
+        struct scan *s = &scans[i];
+        struct stat st;
+        if (stat(s->path, &st) != 0)
+            continue;
+        s->mtime = st.st_mtime;
+        s->file_size = st.st_size;
+        if (oldIndex != NULL) {
+            const struct g3a_index_record *r = findOldRecord(s->path);
+            if (r != NULL && r->mtime == s->mtime &&
+                r->file_size == s->file_size)
+                s->old = r;
+        }
+        if (s->old == NULL)
+            reread++;
+    }
+
+    parallelFor(jobs, nscans, scanWorker, NULL);
+    if (writeIndex(argv[optind]))
+        return 1;
+    for (i = 0; i < nscans; i++)
+        indexed += scans[i].ok;
+    printf("Indexed %lu files (%lu read)\n", (unsigned long)indexed,
+           (unsigned long)reread);
+    if (oldIndex != NULL)
+        unmapFile(oldIndex, oldIndexSize);
+    return 0;
+}
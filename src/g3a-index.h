@@ -0,0 +1,50 @@
+#ifndef _G3A_INDEX_H
+#define _G3A_INDEX_H
+
+#include "config.h"
+
+/*
+ * Catalog index of g3a files, as written by g3a-index.
+ *
+ * The file is meant to be mapped and used in place: a header, then nrecords
+ * fixed-size records sorted by path, then a pool of NUL-terminated strings
+ * that records refer to by offset from strings_ofs.  Everything is stored in
+ * host byte order; readers must check magic and rebuild the index if it
+ * does not match.
+ */
+#define G3A_INDEX_MAGIC (0x33494458) /* "3IDX" on big-endian hosts */
+#define G3A_INDEX_VERSION (1)
+
+struct g3a_index_header {
+    u32 magic;
+    u32 version;
+    u32 nrecords;
+    /* sizeof(struct g3a_index_record) */
+    u32 record_size;
+    u64 records_ofs;
+    u64 strings_ofs;
+    u64 strings_size;
+};
+
+struct g3a_index_record {
+    /* String pool offsets */
+    u32 path;
+    u32 name_basic;
+    u32 name_internal;
+    u32 lc_names[8];
+    u32 version;
+    u32 timestamp;
+    /* Size and checksum from the g3a header */
+    u32 size;
+    u32 cksum;
+    u32 _pad;
+    /* Identify an unchanged file when refreshing the index */
+    u64 mtime;
+    u64 file_size;
+    /* hash64 of each icon and the code */
+    u64 icon_unsel_hash;
+    u64 icon_sel_hash;
+    u64 body_hash;
+};
+
+#endif /* _G3A_INDEX_H */
@@ -0,0 +1,641 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#else
+#include "getopt.h"
+#endif /* HAVE_UNISTD_H */
+
+#include "g3a.h"
+#include "util.h"
+
+static void usage(void) {
+    printf("Usage: g3a-store [-j jobs] <store> <file or directory>...\n"
+           "       g3a-store -l <store>\n"
+           "       g3a-store -x <store> <id or path> <output.g3a>\n"
+           "       g3a-store [-j jobs] -c <store>\n");
+    printf("\nKeeps g3a files in a deduplicating store directory.  Headers\n"
+           "and icons are stored once however many files share them, and\n"
+           "code is split into content-defined chunks so that versions of\n"
+           "a program share what did not change.  -l lists the stored\n"
+           "files, -x rebuilds one of them and -c checks that every stored\n"
+           "file can be rebuilt exactly.\n");
+}
+
+/*
+ * A store is a directory holding:
+ *     objects/ab/cdef0123456789  content-addressed blobs, named by hash64
+ *     files/abcdef0123456789     a recipe for each stored g3a, named by
+ *                                the hash64 of the whole file
+ *     catalog                    lines of "<recipe id> <path as added>"
+ *
+ * A recipe is a store_recipe followed by nchunks store_chunks, in host byte
+ * order like g3a-index.  The header is stored with both color icons zeroed
+ * and the icons as objects of their own, since they rarely change between
+ * versions while the header's size, checksum and timestamp always do.
+ */
+#define STORE_RECIPE_MAGIC (0x47335352) /* "G3SR" on big-endian hosts */
+#define STORE_RECIPE_VERSION (1)
+/* Largest g3a mkg3a would make: 16MB of code, the header and checksum */
+#define STORE_MAX_SIZE (0x01000000 + 0x7000 + 4)
+
+struct store_recipe {
+    u32 magic;
+    u32 version;
+    u64 file_hash;
+    u64 file_size;
+    u64 header;
+    u64 icon_unsel;
+    u64 icon_sel;
+    /* Trailing checksum copy, as stored */
+    u8 trailer[4];
+    u32 nchunks;
+};
+
+struct store_chunk {
+    u64 hash;
+    u32 size;
+    u32 _pad;
+};
+
+/*
+ * Content-defined chunking of the code: a gear hash is rolled over the data
+ * and a chunk ends where its top CHUNK_BITS bits are all zero, so an edit
+ * only changes the chunks around it.  Chunks average about
+ * CHUNK_MIN + 2^CHUNK_BITS bytes.
+ */
+#define CHUNK_MIN (2048)
+#define CHUNK_MAX (65536)
+#define CHUNK_BITS (13)
+
+static u64 gear[256];
+
+// Fills gear from a fixed seed; chunk boundaries must never change
+static void initGear(void) {
+    u64 x = 0x6733612D73746F72ULL;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        u64 z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the chunk at the start of the len bytes at p
+static size_t chunkLength(const u8 *p, size_t len) {
+    u64 h = 0;
+    size_t i;
+
+    if (len <= CHUNK_MIN)
+        return len;
+    if (len > CHUNK_MAX)
+        len = CHUNK_MAX;
+    for (i = CHUNK_MIN; i < len; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (h >> (64 - CHUNK_BITS) == 0)
+            return i + 1;
+    }
+    return len;
+}
+
+static const char *storeDir;
+
+static char *storePath(const char *kind, u64 id) {
+    char *path = mallocs(strlen(storeDir) + strlen(kind) + 24);
+    if (!strcmp(kind, "objects"))
+        sprintf(path, "%s/objects/%02x/%014llx", storeDir, (unsigned)(id >> 56),
+                (unsigned long long)(id & 0xFFFFFFFFFFFFFFULL));
+    else
+        sprintf(path, "%s/%s/%016llx", storeDir, kind, (unsigned long long)id);
+    return path;
+}
+
+// Creates directory path unless it exists.  Returns nonzero on failure.
+static int makeDirectory(const char *path) {
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        printf("Unable to create %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Stores size bytes at data as an object unless it is already there,
+ * returning its id in id.  An existing object must hold the same bytes, so a
+ * hash collision is reported rather than silently storing the wrong data.
+ * Adds the bytes written to *written.  Returns nonzero on failure.
+ */
+static int putObject(const void *data, size_t size, u64 *id, u64 *written) {
+    struct out_part part;
+    const void *old;
+    size_t oldSize;
+    char *path;
+    int failed = 0;
+
+    *id = hash64(data, size);
+    path = storePath("objects", *id);
+    old = mapFile(path, &oldSize);
+    if (old != NULL) {
+        if (oldSize != size || memcmp(old, data, size) != 0) {
+            printf("Hash collision on object %016llx\n",
+                   (unsigned long long)*id);
+            failed = 1;
+        }
+        unmapFile(old, oldSize);
+        free(path);
+        return failed;
+    }
+
+    // Objects sharing a directory may be added from several threads at once
+    path[strlen(storeDir) + sizeof("/objects/xx") - 1] = 0;
+    failed = makeDirectory(path);
+    path[strlen(storeDir) + sizeof("/objects/xx") - 1] = '/';
+    part.data = data;
+    part.size = size;
+    if (!failed && writeReplacement(path, &part, 1)) {
+        printf("Unable to write %s: %s\n", path, strerror(errno));
+        failed = 1;
+    }
+    if (!failed)
+        *written += size;
+    free(path);
+    return failed;
+}
+
+/*
+ * Reads object id, which must be size bytes long, into dst.  Returns nonzero
+ * on failure.
+ */
+static int getObject(u64 id, void *dst, size_t size) {
+    char *path = storePath("objects", id);
+    size_t objSize;
+    const void *obj = mapFile(path, &objSize);
+    int failed = 0;
+
+    if (obj == NULL) {
+        printf("Unable to read %s: %s\n", path, strerror(errno));
+        failed = 1;
+    } else if (objSize != size || hash64(obj, size) != id) {
+        printf("Object %s is damaged\n", path);
+        failed = 1;
+    } else {
+        memcpy(dst, obj, size);
+    }
+    unmapFile(obj, objSize);
+    free(path);
+    return failed;
+}
+
+/*
+ * A file being added to the store.
+ */
+struct ingest {
+    char *path;
+    u64 id;
+    u64 size, written;
+    int ok, present;
+};
+
+static struct ingest *ingests;
+static size_t ningests;
+
+static void addIngest(const char *path, void *ctx) {
+    (void)ctx;
+    ingests = realloc(ingests, (ningests + 1) * sizeof(*ingests));
+    if (ingests == NULL) {
+        printf("Failed to allocate memory; aborting.\n");
+        exit(2);
+    }
+    memset(&ingests[ningests], 0, sizeof(*ingests));
+    ingests[ningests++].path = strdup(path);
+}
+
+static int storeFile(struct ingest *in, const u8 *g3a, size_t size) {
+    struct g3a_header *h = mallocs(sizeof(*h));
+    struct store_recipe *r;
+    struct store_chunk *chunks;
+    struct out_part part;
+    const u8 *body = g3a + sizeof(*h);
+    size_t bodySize = size - sizeof(*h) - 4, ofs, len;
+    size_t maxChunks = bodySize / CHUNK_MIN + 1;
+    char *path;
+    int failed = 0;
+
+    r = callocs(1, sizeof(*r) + maxChunks * sizeof(*chunks));
+    chunks = (struct store_chunk *)(r + 1);
+    r->magic = STORE_RECIPE_MAGIC;
+    r->version = STORE_RECIPE_VERSION;
+    r->file_hash = in->id;
+    r->file_size = size;
+    memcpy(r->trailer, g3a + size - 4, 4);
+
+    memcpy(h, g3a, sizeof(*h));
+    failed |= putObject(h->icon_unsel, sizeof(h->icon_unsel), &r->icon_unsel,
+                        &in->written);
+    failed |= putObject(h->icon_sel, sizeof(h->icon_sel), &r->icon_sel,
+                        &in->written);
+    memset(h->icon_unsel, 0, sizeof(h->icon_unsel));
+    memset(h->icon_sel, 0, sizeof(h->icon_sel));
+    failed |= putObject(h, sizeof(*h), &r->header, &in->written);
+    free(h);
+
+    for (ofs = 0; ofs < bodySize && !failed; ofs += len) {
+        len = chunkLength(body + ofs, bodySize - ofs);
+        chunks[r->nchunks].size = len;
+        failed |= putObject(body + ofs, len, &chunks[r->nchunks++].hash,
+                            &in->written);
+    }
+
+    // The recipe goes last, so a stored file is never missing any objects
+    if (!failed) {
+        path = storePath("files", in->id);
+        part.data = r;
+        part.size = sizeof(*r) + r->nchunks * sizeof(*chunks);
+        if (writeReplacement(path, &part, 1)) {
+            printf("Unable to write %s: %s\n", path, strerror(errno));
+            failed = 1;
+        }
+        in->written += part.size;
+        free(path);
+    }
+    free(r);
+    return failed;
+}
+
+static void ingestWorker(void *ctx, size_t i) {
+    struct ingest *in = &ingests[i];
+    const struct g3a_header *h;
+    const u8 *g3a;
+    size_t size;
+    char *path;
+    struct stat st;
+    (void)ctx;
+
+    g3a = mapFile(in->path, &size);
+    if (g3a == NULL) {
+        printf("Unable to open %s: %s\n", in->path, strerror(errno));
+        return;
+    }
+    h = (const struct g3a_header *)g3a;
+    if (size < sizeof(*h) + 4 || size > STORE_MAX_SIZE ||
+        memcmp(h->magic, G3A_MAGIC, sizeof(G3A_MAGIC)) != 0) {
+        printf("Skipping %s: not a valid g3a\n", in->path);
+        unmapFile(g3a, size);
+        return;
+    }
+
+    in->id = hash64(g3a, size);
+    in->size = size;
+    path = storePath("files", in->id);
+    in->present = stat(path, &st) == 0;
+    free(path);
+    if (in->present || !storeFile(in, g3a, size))
+        in->ok = 1;
+    unmapFile(g3a, size);
+}
+
+/*
+ * Stored files, as read from the catalog.
+ */
+struct entry {
+    u64 id;
+    char *path;
+};
+
+static struct entry *entries;
+static size_t nentries;
+
+static int readCatalog(void) {
+    char *path = mallocs(strlen(storeDir) + sizeof("/catalog"));
+    const char *cat, *p, *end, *eol;
+    size_t size;
+
+    sprintf(path, "%s/catalog", storeDir);
+    cat = mapFile(path, &size);
+    free(path);
+    if (cat == NULL)
+        return errno == ENOENT ? 0 : 1;
+
+    for (p = cat, end = cat + size; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            break;
+        if (eol - p < 18 || p[16] != ' ')
+            continue;
+        entries = realloc(entries, (nentries + 1) * sizeof(*entries));
+        if (entries == NULL) {
+            printf("Failed to allocate memory; aborting.\n");
+            exit(2);
+        }
+        entries[nentries].id = strtoull(p, NULL, 16);
+        entries[nentries].path = mallocs(eol - p - 16);
+        memcpy(entries[nentries].path, p + 17, eol - p - 17);
+        entries[nentries++].path[eol - p - 17] = 0;
+    }
+    unmapFile(cat, size);
+    return 0;
+}
+
+static int writeCatalog(void) {
+    char *path = mallocs(strlen(storeDir) + sizeof("/catalog"));
+    struct out_part part;
+    char *buf, *p;
+    size_t i, size = 1;
+    int failed;
+
+    for (i = 0; i < nentries; i++)
+        size += 18 + strlen(entries[i].path);
+    p = buf = mallocs(size);
+    for (i = 0; i < nentries; i++)
+        p += sprintf(p, "%016llx %s\n", (unsigned long long)entries[i].id,
+                     entries[i].path);
+    sprintf(path, "%s/catalog", storeDir);
+    part.data = buf;
+    part.size = p - buf;
+    failed = writeReplacement(path, &part, 1);
+    if (failed)
+        printf("Unable to write %s: %s\n", path, strerror(errno));
+    free(buf);
+    free(path);
+    return failed;
+}
+
+static int hasEntry(u64 id, const char *path) {
+    size_t i;
+    for (i = 0; i < nentries; i++)
+        if (entries[i].id == id && !strcmp(entries[i].path, path))
+            return 1;
+    return 0;
+}
+
+/*
+ * Rebuilds stored file id into a new buffer, storing its length in size.
+ * The result is checked against both the g3a checksum and the hash the file
+ * was stored under.  Returns NULL on failure.
+ */
+static u8 *rebuild(u64 id, size_t *size) {
+    char *path = storePath("files", id);
+    const struct store_recipe *r;
+    const struct store_chunk *chunks;
+    struct g3a_header *h;
+    size_t recipeSize, ofs;
+    u8 *g3a = NULL;
+    u32 i, sum;
+    int failed = 0;
+
+    r = mapFile(path, &recipeSize);
+    if (r == NULL) {
+        printf("Unable to read %s: %s\n", path, strerror(errno));
+        free(path);
+        return NULL;
+    }
+    chunks = (const struct store_chunk *)(r + 1);
+    if (recipeSize < sizeof(*r) || r->magic != STORE_RECIPE_MAGIC ||
+        r->version != STORE_RECIPE_VERSION ||
+        recipeSize != sizeof(*r) + (size_t)r->nchunks * sizeof(*chunks) ||
+        r->file_size < sizeof(*h) + 4 || r->file_size > STORE_MAX_SIZE) {
+        printf("%s is not a valid recipe\n", path);
+        goto out;
+    }
+
+    g3a = mallocs(r->file_size);
+    h = (struct g3a_header *)g3a;
+    failed |= getObject(r->header, h, sizeof(*h));
+    failed |= getObject(r->icon_unsel, h->icon_unsel, sizeof(h->icon_unsel));
+    failed |= getObject(r->icon_sel, h->icon_sel, sizeof(h->icon_sel));
+    for (i = 0, ofs = sizeof(*h); i < r->nchunks && !failed; i++) {
+        if (chunks[i].size > r->file_size - 4 - ofs) {
+            failed = 1;
+            break;
+        }
+        failed |= getObject(chunks[i].hash, g3a + ofs, chunks[i].size);
+        ofs += chunks[i].size;
+    }
+    if (failed || ofs != r->file_size - 4) {
+        printf("Unable to rebuild %016llx from %s\n", (unsigned long long)id,
+               storeDir);
+        goto fail;
+    }
+    memcpy(g3a + ofs, r->trailer, 4);
+
+    sum = checksum(g3a, r->file_size - 4) - checksum(&h->cksum, 4);
+    if (sum != u32_beton(h->cksum))
+        printf("Warning: %016llx has a bad g3a checksum (stored that way)\n",
+               (unsigned long long)id);
+    if (hash64(g3a, r->file_size) != r->file_hash || r->file_hash != id) {
+        printf("Rebuilt %016llx does not match what was stored\n",
+               (unsigned long long)id);
+        goto fail;
+    }
+    *size = r->file_size;
+    goto out;
+
+fail:
+    free(g3a);
+    g3a = NULL;
+out:
+    unmapFile(r, recipeSize);
+    free(path);
+    return g3a;
+}
+
+static int addFiles(int jobs, char **args, int nargs) {
+    u64 total = 0, written = 0;
+    size_t i, stored = 0, added = 0;
+    char *path;
+    int failed = 0;
+
+    path = mallocs(strlen(storeDir) + sizeof("/objects"));
+    sprintf(path, "%s/objects", storeDir);
+    failed |= makeDirectory(storeDir) || makeDirectory(path);
+    sprintf(path, "%s/files", storeDir);
+    failed |= makeDirectory(path);
+    free(path);
+    if (failed)
+        return 1;
+    if (readCatalog()) {
+        printf("Unable to read catalog: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < (size_t)nargs; i++) {
+        if (!isDirectory(args[i]))
+            addIngest(args[i], NULL);
+        else if (findFiles(args[i], ".g3a", addIngest, NULL)) {
+            printf("Unable to search %s: %s\n", args[i], strerror(errno));
+            return 1;
+        }
+    }
+
+    parallelFor(jobs, ningests, ingestWorker, NULL);
+
+    for (i = 0; i < ningests; i++) {
+        struct ingest *in = &ingests[i];
+        if (!in->ok) {
+            failed = 1;
+            continue;
+        }
+        stored++;
+        added += !in->present;
+        total += in->size;
+        written += in->written;
+        if (hasEntry(in->id, in->path))
+            continue;
+        entries = realloc(entries, (nentries + 1) * sizeof(*entries));
+        if (entries == NULL) {
+            printf("Failed to allocate memory; aborting.\n");
+            exit(2);
+        }
+        entries[nentries].id = in->id;
+        entries[nentries++].path = in->path;
+    }
+    if (writeCatalog())
+        return 1;
+    printf("Stored %lu files (%lu new): %llu bytes, %llu bytes written\n",
+           (unsigned long)stored, (unsigned long)added,
+           (unsigned long long)total, (unsigned long long)written);
+    return failed;
+}
+
+static int extractFile(const char *name, const char *outPath) {
+    struct out_part part;
+    size_t i, size;
+    u64 id = 0;
+    int found = 0;
+    u8 *g3a;
+
+    if (readCatalog()) {
+        printf("Unable to read catalog: %s\n", strerror(errno));
+        return 1;
+    }
+    // The most recently added file of that name, or that id
+    for (i = 0; i < nentries; i++) {
+        char hex[17];
+        sprintf(hex, "%016llx", (unsigned long long)entries[i].id);
+        if (!strcmp(entries[i].path, name) || !strcmp(hex, name)) {
+            id = entries[i].id;
+            found = 1;
+        }
+    }
+    if (!found) {
+        printf("%s is not in %s\n", name, storeDir);
+        return 1;
+    }
+
+    g3a = rebuild(id, &size);
+    if (g3a == NULL)
+        return 1;
+    part.data = g3a;
+    part.size = size;
+    if (writeReplacement(outPath, &part, 1)) {
+        printf("Unable to write %s: %s\n", outPath, strerror(errno));
+        free(g3a);
+        return 1;
+    }
+    free(g3a);
+    return 0;
+}
+
+static void checkWorker(void *ctx, size_t i) {
+    int *ok = ctx;
+    size_t size;
+    u8 *g3a = rebuild(entries[i].id, &size);
+
+    ok[i] = g3a != NULL;
+    free(g3a);
+}
+
+static int checkStore(int jobs) {
+    size_t i, bad = 0;
+    int *ok;
+
+    if (readCatalog()) {
+        printf("Unable to read catalog: %s\n", strerror(errno));
+        return 1;
+    }
+    ok = callocs(nentries ? nentries : 1, sizeof(*ok));
+    parallelFor(jobs, nentries, checkWorker, ok);
+    for (i = 0; i < nentries; i++) {
+        if (!ok[i]) {
+            printf("Damaged: %s\n", entries[i].path);
+            bad++;
+        }
+    }
+    printf("Checked %lu files, %lu damaged\n", (unsigned long)nentries,
+           (unsigned long)bad);
+    free(ok);
+    return bad != 0;
+}
+
+int main(int argc, char **argv) {
+    int c, jobs = defaultJobs(), list = 0, extract = 0, check = 0;
+    size_t i;
+
+    while ((c = getopt(argc, argv, "j:lxch")) != -1) {
+        switch (c) {
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'l':
+            list = 1;
+            break;
+        case 'x':
+            extract = 1;
+            break;
+        case 'c':
+            check = 1;
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (list + extract + check > 1 || argc - optind < 1) {
+        usage();
+        return 1;
+    }
+    storeDir = argv[optind];
+    initGear();
+
+    if (list) {
+        if (argc - optind != 1) {
+            usage();
+            return 1;
+        }
+        if (readCatalog()) {
+            printf("Unable to read catalog: %s\n", strerror(errno));
+            return 1;
+        }
+        for (i = 0; i < nentries; i++)
+            printf("%016llx %s\n", (unsigned long long)entries[i].id,
+                   entries[i].path);
+        return 0;
+    }
+    if (extract) {
+        if (argc - optind != 3) {
+            usage();
+            return 1;
+        }
+        return extractFile(argv[optind + 1], argv[optind + 2]);
+    }
+    if (check) {
+        if (argc - optind != 1) {
+            usage();
+            return 1;
+        }
+        return checkStore(jobs);
+    }
+    if (argc - optind < 2) {
+        usage();
+        return 1;
+    }
+    return addFiles(jobs, argv + optind + 1, argc - optind - 1);
+}
@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "g3a.h"
+#include "util.h"
+
+// Appends size bytes at data (NULL for zeros) to parts, unless empty
+static void addPart(struct out_part *parts, int *nparts, const void *data,
+                    size_t size) {
+    if (size == 0)
+        return;
+    parts[*nparts].data = data;
+    parts[(*nparts)++].size = size;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        printf("Usage: g3a-updatecode <g3afile> <binary>\n");
+        printf("\nReplaces the code in g3afile with binary, keeping the names,"
+               "\nicons and version already in its header and any resources"
+               "\npacked after the code with mkg3a -R\n");
+        return 1;
+    }
+
+    struct g3a_header *header = mallocs(sizeof(*header));
+    const struct g3a_resource_table *t;
+    const struct g3a_resource_entry *e = NULL;
+    struct g3a_resource *res = NULL;
+    struct out_part *parts = NULL;
+    const u8 *old = NULL, *code = NULL, *section = NULL;
+    size_t old_size = 0, code_size = 0, body_size, section_ofs;
+    size_t base = 0, table_size = 0, section_size = 0, pos, *sizes = NULL;
+    u32 *offsets = NULL;
+    u8 *table = NULL;
+    int ret = 1, nres = 0, nparts = 0, i;
+
+    old = mapFile(argv[1], &old_size);
+    if (old == NULL) {
+        perror("Unable to open G3a file");
+        goto out;
+    }
+    if (old_size < sizeof(*header) + 4) {
+        printf("Input g3a is too small to be valid\n");
+        goto out;
+    }
+    memcpy(header, old, sizeof(*header));
+    if (memcmp(header->magic, G3A_MAGIC, sizeof(G3A_MAGIC)) != 0) {
+        printf("Input file is not a g3a\n");
+        goto out;
+    }
+    body_size = u32_beton(header->size);
+    if (body_size < sizeof(*header) + 4 || body_size > old_size) {
+        printf("Size in g3a header does not match the file\n");
+        goto out;
+    }
+    body_size -= sizeof(*header) + 4;
+
+    // Resources packed by mkg3a -R follow the old code, and are found from
+    // the first G3A_RESOURCE_ALIGN boundary after whatever code there is,
+    // so they are laid out again after the new code
+    section_ofs = g3a_findResources(old + sizeof(*header), body_size);
+    if (section_ofs < body_size) {
+        section = old + sizeof(*header) + section_ofs;
+        t = (const struct g3a_resource_table *)section;
+        e = (const struct g3a_resource_entry *)(t + 1);
+        nres = u32_beton(t->count);
+        res = callocs(nres, sizeof(*res));
+        sizes = callocs(nres, sizeof(*sizes));
+        offsets = callocs(nres, sizeof(*offsets));
+        for (i = 0; i < nres; i++) {
+            res[i].name = (const char *)section + u32_beton(e[i].name);
+            res[i].align = u32_beton(e[i].align);
+            sizes[i] = u32_beton(e[i].size);
+        }
+    }
+
+    code = mapFile(argv[2], &code_size);
+    if (code == NULL) {
+        perror("Unable to read binary");
+        goto out;
+    }
+    body_size = code_size;
+    if (nres > 0) {
+        base = (code_size + G3A_RESOURCE_ALIGN - 1) &
+               ~(size_t)(G3A_RESOURCE_ALIGN - 1);
+        table = g3a_mkResourceTable(res, nres, sizes, base, offsets,
+                                    &table_size, &section_size);
+        body_size = base + section_size;
+    }
+    if (body_size > 0x01000000) {
+        printf(
+            "Cowardly refusing to operating on input file larger than 16MB.\n");
+        goto out;
+    }
+
+    // Header, code, resources, then the trailing copy of the checksum
+    parts = mallocs((2 * nres + 5) * sizeof(*parts));
+    addPart(parts, &nparts, header, sizeof(*header));
+    addPart(parts, &nparts, code, code_size);
+    if (nres > 0) {
+        addPart(parts, &nparts, NULL, base - code_size);
+        addPart(parts, &nparts, table, table_size);
+        for (i = 0, pos = table_size; i < nres; i++) {
+            addPart(parts, &nparts, NULL, offsets[i] - pos);
+            addPart(parts, &nparts, section + u32_beton(e[i].offset),
+                    sizes[i]);
+            pos = offsets[i] + sizes[i];
+        }
+    }
+    addPart(parts, &nparts, &header->cksum, sizeof(header->cksum));
+
+    // Only the size-dependent fields of the header change, so the checksum
+    // is its contribution with those patched plus the sum of the new body
+    g3a_fillSize(header, body_size);
+    g3a_fillCProt(header);
+    u32 cksum = g3a_headerSum(header) + sumParts(parts + 1, nparts - 2);
+    dumpb_u32(cksum, &header->cksum);
+
+    // Replaced atomically, so a failed write leaves the old file intact
+    if (writeReplacement(argv[1], parts, nparts)) {
+        perror("Failed to write modified g3a");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    unmapFile(code, code_size);
+    unmapFile(old, old_size);
+    free(parts);
+    free(table);
+    free(res);
+    free(sizes);
+    free(offsets);
+    free(header);
+    return ret;
+}
@@ -1,89 +1,260 @@
+#include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "config.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#else
+#include "getopt.h"
+#endif /* HAVE_UNISTD_H */
+
 #include "g3a.h"
 #include "images.h"
 #include "util.h"
 
-int main(int argc, char **argv) {
-    if (argc != 4) {
-        printf("Usage: g3a-updateicon <g3afile> <selected> <unselected>\n");
-        printf("\nChanges the icons in g3afile to the provided images\n");
-        return 1;
+static void usage(void) {
+    printf("Usage: g3a-updateicon [-j jobs] [-r fit|fill|crop] "
+           "<g3afile|directory>...\n"
+           "                      <selected> <unselected>\n"
+           "       g3a-updateicon [-j jobs] [-r fit|fill|crop] -m <mapfile>\n");
+    printf("\nChanges the icons in each g3afile (or every g3a file under each\n"
+           "directory) to the provided images.  A mapfile instead lists one\n"
+           "g3a file with its selected and unselected images per line.\n"
+           "Images of other sizes are scaled to fit (the default), scaled\n"
+           "to fill and cropped, or only cropped as given by -r.\n");
+}
+
+/*
+ * Every distinct image is decoded once, however many files use it.
+ */
+struct icon {
+    const char *path;
+    u16 *data;
+};
+
+struct update {
+    char *g3a;
+    size_t sel, unsel; // Indices into icons
+    int failed;
+};
+
+static struct icon *icons;
+static size_t nicons;
+static struct update *updates;
+static size_t nupdates;
+
+static size_t addIcon(const char *path) {
+    size_t i;
+    for (i = 0; i < nicons; i++) {
+        if (!strcmp(icons[i].path, path))
+            return i;
+    }
+    icons = realloc(icons, (nicons + 1) * sizeof(*icons));
+    if (icons == NULL) {
+        printf("Failed to allocate memory; aborting.\n");
+        exit(2);
     }
+    icons[nicons].path = strdup(path);
+    icons[nicons].data = NULL;
+    return nicons++;
+}
 
-    FILE *g3a_f = fopen(argv[1], "r+b");
-    if (g3a_f == NULL) {
-        perror("Unable to open G3a file");
-        return 1;
+static void addUpdate(const char *g3a, size_t sel, size_t unsel) {
+    updates = realloc(updates, (nupdates + 1) * sizeof(*updates));
+    if (updates == NULL) {
+        printf("Failed to allocate memory; aborting.\n");
+        exit(2);
     }
+    updates[nupdates].g3a = strdup(g3a);
+    updates[nupdates].sel = sel;
+    updates[nupdates].unsel = unsel;
+    updates[nupdates].failed = 0;
+    nupdates++;
+}
 
-    size_t g3a_size;
-    if (fseek(g3a_f, 0, SEEK_END) != 0 || (g3a_size = ftell(g3a_f)) == -1UL) {
-        perror("Unable to determine g3a file size");
+struct icon_pair {
+    size_t sel, unsel;
+};
+
+static void addFoundG3a(const char *path, void *ctx) {
+    struct icon_pair *pair = ctx;
+    addUpdate(path, pair->sel, pair->unsel);
+}
+
+/*
+ * Queues g3a (a file or directory of g3a files) for update with the given
+ * icons.  Returns nonzero on failure.
+ */
+static int addTarget(const char *g3a, size_t sel, size_t unsel) {
+    struct icon_pair pair = {sel, unsel};
+    if (!isDirectory(g3a)) {
+        addUpdate(g3a, sel, unsel);
+    } else if (findFiles(g3a, ".g3a", addFoundG3a, &pair)) {
+        printf("Unable to search %s: %s\n", g3a, strerror(errno));
         return 1;
     }
-    if (g3a_size < (sizeof(struct g3a_header) + 4)) {
-        printf("Input g3a is too small to be valid");
+    return 0;
+}
+
+/*
+ * Reads a map file of whitespace-separated "g3afile selected unselected"
+ * lines.  Blank lines and lines beginning with # are ignored.
+ */
+static int readMapFile(const char *path) {
+    char line[3 * 1024];
+    char g3a[1024], sel[1024], unsel[1024];
+    int lineno = 0;
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("Unable to open map file");
         return 1;
     }
-    rewind(g3a_f);
 
-    void *file_contents = malloc(g3a_size);
-    if (file_contents == NULL) {
-        printf("Unable to allocate g3a buffer\n");
-        return 1;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char first;
+        lineno++;
+        if (sscanf(line, " %c", &first) != 1 || first == '#')
+            continue;
+        if (sscanf(line, "%1023s %1023s %1023s", g3a, sel, unsel) != 3) {
+            printf("%s:%d: expected g3a file, selected and unselected image\n",
+                   path, lineno);
+            fclose(fp);
+            return 1;
+        }
+        if (addTarget(g3a, addIcon(sel), addIcon(unsel))) {
+            fclose(fp);
+            return 1;
+        }
     }
-    if (fread(file_contents, g3a_size, 1, g3a_f) != 1) {
-        perror("Failed to read g3a file contents");
+    fclose(fp);
+    return 0;
+}
+
+static int loadIconData(struct icon *icon, enum resize_mode mode) {
+    icon->data = loadIcon(icon->path, G3A_ICON_WIDTH, G3A_ICON_HEIGHT, mode);
+    if (icon->data == NULL) {
+        printf("Failed to load image %s\n", icon->path);
         return 1;
     }
+    return 0;
+}
 
-    // Load images
-    int32_t w, h;
-    u16 *sel_data, *unsel_data;
-    if ((sel_data = loadBitmap(argv[2], &w, &h)) == NULL) {
-        printf("Failed to load selected image");
+/*
+ * Writes a copy of the g3a at path with new icons to a temporary file, then
+ * moves it into place so the original is never left half-written.
+ */
+static int updateIcons(const char *path, const u16 *sel_data,
+                       const u16 *unsel_data) {
+    size_t g3a_size;
+    const u8 *g3a = mapFile(path, &g3a_size);
+    if (g3a == NULL) {
+        printf("Unable to open %s: %s\n", path, strerror(errno));
         return 1;
     }
-    if (w != G3A_ICON_WIDTH || h != G3A_ICON_HEIGHT) {
-        printf("Selected image dimensions are incorrect: must be %dx%d",
-               G3A_ICON_WIDTH, G3A_ICON_HEIGHT);
+    if (g3a_size < (sizeof(struct g3a_header) + 4)) {
+        printf("%s is too small to be a valid g3a\n", path);
+        unmapFile(g3a, g3a_size);
         return 1;
     }
-    if ((unsel_data = loadBitmap(argv[3], &w, &h)) == NULL) {
-        printf("Failed to load unselected image");
+
+    // Write new icons
+    struct g3a_header header;
+    memcpy(&header, g3a, sizeof(header));
+    memcpy(header.icon_sel, sel_data, sizeof(header.icon_sel));
+    memcpy(header.icon_unsel, unsel_data, sizeof(header.icon_unsel));
+
+    // Compute the new checksum, ignoring both copies of it
+    const u8 *body = g3a + sizeof(header);
+    size_t body_size = g3a_size - sizeof(header) - 4;
+    u32 cksum = g3a_headerSum(&header) + checksum(body, body_size);
+    dumpb_u32(cksum, &header.cksum);
+
+    // Write updated file
+    char *tmp_path;
+    FILE *out = openReplacement(path, &tmp_path);
+    if (out == NULL) {
+        printf("Unable to create temporary file for %s: %s\n", path,
+               strerror(errno));
+        unmapFile(g3a, g3a_size);
         return 1;
     }
-    if (w != G3A_ICON_WIDTH || h != G3A_ICON_HEIGHT) {
-        printf("Unselected image dimensions are incorrect: must be %dx%d",
-               G3A_ICON_WIDTH, G3A_ICON_HEIGHT);
+    int failed = fwrite(&header, sizeof(header), 1, out) != 1 ||
+                 fwrite(body, 1, body_size, out) != body_size ||
+                 fwrite(&header.cksum, sizeof(header.cksum), 1, out) != 1;
+    unmapFile(g3a, g3a_size);
+    if (commitReplacement(out, tmp_path, path, failed)) {
+        printf("Failed to write modified %s: %s\n", path, strerror(errno));
         return 1;
     }
+    return 0;
+}
 
-    // Write new icons
-    memcpy(file_contents + offsetof(struct g3a_header, icon_sel), sel_data,
-           sizeof(*unsel_data) * (G3A_ICON_WIDTH * G3A_ICON_HEIGHT));
-    memcpy(file_contents + offsetof(struct g3a_header, icon_unsel), unsel_data,
-           sizeof(*unsel_data) * (G3A_ICON_WIDTH * G3A_ICON_HEIGHT));
+static void updateWorker(void *ctx, size_t i) {
+    struct update *u = &updates[i];
+    (void)ctx;
+    u->failed = updateIcons(u->g3a, icons[u->sel].data, icons[u->unsel].data);
+}
 
-    // Zero the checksums in the header and at end of file
-    memset(file_contents + offsetof(struct g3a_header, cksum), 0, 4);
-    memset(file_contents + g3a_size - 4, 0, 4);
+int main(int argc, char **argv) {
+    int c, jobs = defaultJobs();
+    char *map_file = NULL;
+    enum resize_mode mode = RESIZE_FIT;
+    size_t i;
 
-    // Compute the new checksum and write back
-    u32 cksum = checksum(file_contents, g3a_size);
-    dumpb_u32(cksum, file_contents + offsetof(struct g3a_header, cksum));
-    dumpb_u32(cksum, file_contents + g3a_size - 4);
+    while ((c = getopt(argc, argv, "j:m:r:h")) != -1) {
+        switch (c) {
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'm':
+            map_file = optarg;
+            break;
+        case 'r':
+            if (parseResizeMode(optarg, &mode)) {
+                printf("Unknown resize mode: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
 
-    // Write updated file
-    rewind(g3a_f);
-    if (fwrite(file_contents, g3a_size, 1, g3a_f) != 1) {
-        perror("Failed to write modified g3a");
-        return 1;
+    int args = argc - optind;
+    if (map_file != NULL) {
+        if (args != 0) {
+            usage();
+            return 1;
+        }
+        if (readMapFile(map_file))
+            return 1;
+    } else {
+        if (args < 3) {
+            usage();
+            return 1;
+        }
+        size_t sel = addIcon(argv[argc - 2]);
+        size_t unsel = addIcon(argv[argc - 1]);
+        for (c = optind; c < argc - 2; c++) {
+            if (addTarget(argv[c], sel, unsel))
+                return 1;
+        }
     }
 
+    // Load images
+    for (i = 0; i < nicons; i++) {
+        if (loadIconData(&icons[i], mode))
+            return 1;
+    }
+
+    parallelFor(jobs, nupdates, updateWorker, NULL);
+    for (i = 0; i < nupdates; i++) {
+        if (updates[i].failed)
+            return 1;
+    }
     return 0;
 }
@@ -9,8 +9,179 @@
 #include <time.h>
 
 #include "images.h"
+#include "probes.h"
 #include "util.h"
 
+const u8 G3A_MAGIC[G3A_MAGIC_SIZE] = {0xAA, 0xAC, 0xBD, 0xAF, 0x90,
+                                      0x88, 0x9A, 0x8D, 0xD3, 0xFF,
+                                      0xFE, 0xFF, 0xFE, 0xFF};
+
+/*
+ * Allocates a header with the magic numbers and default version, and
+ * everything else zero.
+ */
+static struct g3a_header *newHeader(void) {
+    struct g3a_header *h = callocs(1, sizeof(struct g3a_header));
+
+    memcpy(h->magic, G3A_MAGIC, sizeof(G3A_MAGIC));
+    h->_pad3[0] = 0x01;
+    h->_pad3[1] = 0x01; // Doesn't seem necessary, but we'll use it
+    strncpy(h->version, "01.00.0000", sizeof(h->version) - 1);
+    return h;
+}
+
+// Appends size bytes at data (NULL for zeros) to parts, joining runs
+static void addPart(struct out_part *parts, int *nparts, const u8 *data,
+                    size_t size) {
+    struct out_part *last = &parts[*nparts - 1];
+    int join;
+
+    if (size == 0)
+        return;
+    if (data == NULL)
+        join = last->data == NULL;
+    else
+        join = last->data != NULL && (const u8 *)last->data + last->size == data;
+    // parts[0] is kept for the header
+    if (join && *nparts > 1) {
+        last->size += size;
+        return;
+    }
+    parts[*nparts].data = data;
+    parts[(*nparts)++].size = size;
+}
+
+/*
+ * Splits the size bytes of code, mapped from path, into parts for
+ * writeSummedReplacement: holes in the input, found with findDataRegions,
+ * become holes and the rest is data.  Holes are never read and add nothing
+ * to the checksum.  Nothing is read here either, so that reading the data
+ * overlaps with summing and writing it; writeSummedReplacement leaves
+ * blocks of zeros in the data as holes too.  Returns the parts, leaving
+ * parts[0] free for the header and room for extra more after them, with
+ * their number (header included) in nparts.
+ */
+static struct out_part *splitCode(const char *path, const u8 *code,
+                                  size_t size, int extra, int *nparts) {
+    struct out_part *parts;
+    size_t *regions, pos = 0;
+    int i, n, nregions;
+
+    regions = findDataRegions(path, size, &nregions);
+    parts = mallocs((2 * nregions + 3 + extra) * sizeof(*parts));
+    parts[0].data = NULL;
+    parts[0].size = 0;
+    n = 1;
+    for (i = 0; i < nregions; i++) {
+        addPart(parts, &n, NULL, regions[2 * i] - pos);
+        addPart(parts, &n, code + regions[2 * i],
+                regions[2 * i + 1] - regions[2 * i]);
+        pos = regions[2 * i + 1];
+    }
+    addPart(parts, &n, NULL, size - pos);
+    free(regions);
+    *nparts = n;
+    return parts;
+}
+
+/*
+ * Builds the table for the nres resources in res, with contents of the
+ * given sizes, for a section starting at body offset base.  Stores where
+ * each resource goes, from base, in offsets and the size of the table and
+ * whole section in tableSize and size.  Only the names and alignments in
+ * res are used.
+ */
+u8 *g3a_mkResourceTable(const struct g3a_resource *res, int nres,
+                        const size_t *sizes, size_t base, u32 *offsets,
+                        size_t *tableSize, size_t *size) {
+    struct g3a_resource_table *t;
+    struct g3a_resource_entry *e;
+    size_t pos, names;
+    u8 *table;
+    int i;
+
+    names = sizeof(*t) + nres * sizeof(*e);
+    for (i = 0, pos = names; i < nres; i++)
+        pos += strlen(res[i].name) + 1;
+    *tableSize = pos;
+    table = callocs(1, pos);
+    t = (struct g3a_resource_table *)table;
+    e = (struct g3a_resource_entry *)(t + 1);
+    dumpb_u32(G3A_RESOURCE_MAGIC, &t->magic);
+    dumpb_u32(nres, &t->count);
+
+    // Alignment is of the address on the calculator, where the body starts
+    // at the beginning of a page
+    for (i = 0, pos += base; i < nres; i++) {
+        pos = (pos + res[i].align - 1) / res[i].align * res[i].align;
+        offsets[i] = pos - base;
+        pos += sizes[i];
+        dumpb_u32(names, &e[i].name);
+        dumpb_u32(offsets[i], &e[i].offset);
+        dumpb_u32(sizes[i], &e[i].size);
+        dumpb_u32(res[i].align, &e[i].align);
+        strcpy((char *)table + names, res[i].name);
+        names += strlen(res[i].name) + 1;
+    }
+    *size = pos - base;
+    dumpb_u32(*size, &t->size);
+    return table;
+}
+
+/*
+ * Finds the resource section packed by mkg3a -R in the size bytes of body:
+ * a table at a G3A_RESOURCE_ALIGN boundary whose recorded size reaches
+ * exactly to the end of the body and whose entries lie within it.  body
+ * must be aligned as in the file.  Returns the offset of the section, or
+ * size if there is none.
+ */
+size_t g3a_findResources(const u8 *body, size_t size) {
+    const struct g3a_resource_table *t;
+    const struct g3a_resource_entry *e;
+    size_t ofs, section, count, i, name, pos;
+
+    for (ofs = 0; ofs + sizeof(*t) <= size; ofs += G3A_RESOURCE_ALIGN) {
+        t = (const struct g3a_resource_table *)(body + ofs);
+        section = u32_beton(t->size);
+        count = u32_beton(t->count);
+        if (u32_beton(t->magic) != G3A_RESOURCE_MAGIC ||
+            section != size - ofs ||
+            (section - sizeof(*t)) / sizeof(*e) < count)
+            continue;
+        e = (const struct g3a_resource_entry *)(t + 1);
+        for (i = 0; i < count; i++) {
+            name = u32_beton(e[i].name);
+            pos = u32_beton(e[i].offset);
+            if (name >= section ||
+                memchr((const u8 *)t + name, 0, section - name) == NULL ||
+                pos > section || u32_beton(e[i].size) > section - pos ||
+                u32_beton(e[i].align) == 0)
+                break;
+        }
+        if (i == count)
+            return ofs;
+    }
+    return size;
+}
+
+/*
+ * A header waiting for the checksum of the body, for fillChecksum.
+ */
+struct pending_header {
+    struct g3a_header *header;
+    u32 fixedSum;
+    size_t bodySize;
+};
+
+// Completes the header once the body is known to sum to sum
+static void fillChecksum(void *ctx, u32 sum) {
+    struct pending_header *p = ctx;
+
+    PROBE2(raw_return, p->bodySize, sum);
+    dumpb_u32(sum + p->fixedSum + g3a_variableSum(p->header),
+              &p->header->cksum);
+}
+
 /*
  * Makes a g3a file with name outFile from inFile.
  * names is an array of strings giving names to insert:
@@ -21,45 +192,666 @@
  */
 int g3a_mkG3A(const char *inFile, const char *outFile, struct lc_names *names,
               struct icons *icons, const char *version) {
-    u32 inSize, cksum;
+    int ret;
+    struct g3a_header *tmpl = g3a_mkTemplate(names, icons, version);
+    if (tmpl == NULL)
+        return 1;
+
+    ret = g3a_mkG3AFromTemplate(inFile, outFile, tmpl, g3a_fixedSum(tmpl),
+                                NULL, 0, 0);
+    free(tmpl);
+    return ret;
+}
+
+/*
+ * Makes a g3a file with name outFile from inFile, taking everything but the
+ * per-build fields from tmpl.  fixedSum is the checksum contribution of tmpl
+ * (see g3a_fixedSum), so the header itself never needs to be summed.  A
+ * timestamp or file name already in tmpl is kept rather than filled in, so
+ * that a file can be rebuilt exactly from its metadata (see g3a_readMeta).
+ * The nres resources in res, if any, are packed after the code.  With
+ * G3A_UPDATE_IN_PLACE in flags an existing outFile is patched where it
+ * differs instead of replaced, which is not atomic.
+ *
+ * Returns 0 on success, nonzero otherwise.
+ */
+int g3a_mkG3AFromTemplate(const char *inFile, const char *outFile,
+                          const struct g3a_header *tmpl, u32 fixedSum,
+                          const struct g3a_resource *res, int nres,
+                          int flags) {
+    struct pending_header pending;
+    u32 *offsets = NULL;
+    size_t codeSize, bodySize, base, pos, tableSize, sectionSize;
+    size_t *sizes = NULL;
+    const u8 *code, **data = NULL;
+    u8 *table = NULL;
     struct g3a_header *header;
+    struct out_part *parts, *split;
     const char *baseName;
+    int i, failed = 1, nparts, nsplit;
 
-    FILE *outFP = fopen(outFile, "wb");
-    if (outFP == NULL) {
-        printf("Unable to open output file: %s\n", strerror(errno));
+    PROBE1(raw_entry, inFile);
+    code = mapFile(inFile, &codeSize);
+    if (code == NULL) {
+        printf("Failed to read input file: %s\n", strerror(errno));
         return 1;
     }
+    bodySize = codeSize;
+    if (nres > 0) {
+        data = callocs(nres, sizeof(*data));
+        sizes = callocs(nres, sizeof(*sizes));
+        offsets = callocs(nres, sizeof(*offsets));
+        for (i = 0; i < nres; i++) {
+            data[i] = mapFile(res[i].path, &sizes[i]);
+            if (data[i] == NULL) {
+                printf("Failed to read resource %s: %s\n", res[i].path,
+                       strerror(errno));
+                goto out;
+            }
+        }
+        base = (codeSize + G3A_RESOURCE_ALIGN - 1) & ~(G3A_RESOURCE_ALIGN - 1);
+        table = g3a_mkResourceTable(res, nres, sizes, base, offsets,
+                                    &tableSize, &sectionSize);
+        bodySize = base + sectionSize;
+    }
+    if (bodySize > 0x01000000) {
+        printf(
+            "Cowardly refusing to operating on input file larger than 16MB.\n");
+        goto out;
+    }
+    parts = splitCode(inFile, code, codeSize, 2 + 2 * nres, &nparts);
+    if (nres > 0) {
+        addPart(parts, &nparts, NULL, base - codeSize);
+        addPart(parts, &nparts, table, tableSize);
+        for (i = 0, pos = tableSize; i < nres; i++) {
+            addPart(parts, &nparts, NULL, offsets[i] - pos);
+            addPart(parts, &nparts, data[i], sizes[i]);
+            pos = offsets[i] + sizes[i];
+        }
+    }
+
+    header = mallocs(sizeof(*header));
+    memcpy(header, tmpl, sizeof(*header));
+    g3a_fillSize(header, bodySize);
+    g3a_fillCProt(header);
+    if (header->timestamp[0] == 0)
+        g3a_fillTimestamp(header);
+    if (header->filename[0] == 0) {
+        baseName = basename(outFile);
+        strncpy(header->filename, baseName, sizeof(header->filename) - 1);
+    }
+
+    // Header, code, resources, then the trailing copy of the checksum.  The
+    // body is summed as it is written and the header goes out last.
+    parts[0].data = header;
+    parts[0].size = sizeof(*header);
+    parts[nparts].data = &header->cksum;
+    parts[nparts++].size = sizeof(header->cksum);
+    pending.header = header;
+    pending.fixedSum = fixedSum;
+    pending.bodySize = bodySize;
+    PROBE(header_write_entry);
+    if (flags & G3A_UPDATE_IN_PLACE) {
+        fillChecksum(&pending, sumParts(parts + 1, nparts - 2));
+        split = splitZeroBlocks(parts, nparts, &nsplit);
+        failed = updateFile(outFile, split, nsplit, NULL);
+        free(split);
+    } else {
+        failed = writeSummedReplacement(outFile, parts, nparts, fillChecksum,
+                                        &pending);
+    }
+    PROBE(header_write_return);
+    if (failed)
+        printf("Failed to write output file: %s\n", strerror(errno));
 
-    fseek(outFP, sizeof(struct g3a_header), SEEK_SET);
-    if (g3a_processRaw(inFile, outFP, &inSize, &cksum))
+    free(parts);
+    free(header);
+out:
+    for (i = 0; i < nres && data != NULL; i++)
+        unmapFile(data[i], sizes[i]);
+    free(data);
+    free(sizes);
+    free(offsets);
+    free(table);
+    unmapFile(code, codeSize);
+    return failed;
+}
+
+/*
+ * Writes a C header for an add-in to find the nres resources in res at run
+ * time, as RES_<name> indices for g3a_resource().  It depends only on the
+ * names, so the file is left alone if it already says the same and anything
+ * including it is not rebuilt when only the contents of resources change.
+ * Returns 0 on success, nonzero otherwise.
+ */
+int g3a_writeResourceHeader(const char *path, const struct g3a_resource *res,
+                            int nres) {
+    static const char *const body =
+        "\n"
+        "struct g3a_resource_entry {\n"
+        "    unsigned int name, offset, size, align;\n"
+        "};\n"
+        "struct g3a_resource_table {\n"
+        "    unsigned int magic, count, size, _pad;\n"
+        "    struct g3a_resource_entry entries[];\n"
+        "};\n"
+        "\n"
+        "/*\n"
+        " * Where the program ends on the calculator, which is where its image\n"
+        " * ends: with libfxcg's prizm.ld the initial values of .data follow\n"
+        " * everything else.  Define this first for other linker scripts.\n"
+        " */\n"
+        "#ifndef G3A_PROGRAM_END\n"
+        "extern const char romdata[], bdata[], edata[];\n"
+        "#define G3A_PROGRAM_END ((unsigned long)romdata + (edata - bdata))\n"
+        "#endif\n"
+        "\n"
+        "static inline const struct g3a_resource_table *g3a_resources(void) {\n"
+        "    return (const struct g3a_resource_table *)((G3A_PROGRAM_END + %d) &\n"
+        "                                               ~%dUL);\n"
+        "}\n"
+        "\n"
+        "/*\n"
+        " * Resource id, storing its size in size unless that is NULL.  Returns\n"
+        " * NULL if there is no such resource, or no table at all (as when the\n"
+        " * add-in was packed without -R).\n"
+        " */\n"
+        "static inline const void *g3a_resource(int id, unsigned int *size) {\n"
+        "    const struct g3a_resource_table *t = g3a_resources();\n"
+        "    if (t->magic != 0x%08XU || id < 0 || (unsigned int)id >= t->count) {\n"
+        "        if (size != NULL)\n"
+        "            *size = 0;\n"
+        "        return NULL;\n"
+        "    }\n"
+        "    if (size != NULL)\n"
+        "        *size = t->entries[id].size;\n"
+        "    return (const char *)t + t->entries[id].offset;\n"
+        "}\n"
+        "\n"
+        "#endif /* G3A_RESOURCES_H */\n";
+    char *text, *p;
+    const u8 *old;
+    size_t len, oldSize;
+    FILE *fp;
+    int i, j, failed;
+
+    len = strlen(body) + 512;
+    for (i = 0; i < nres; i++)
+        len += 2 * strlen(res[i].name) + 64;
+    text = p = mallocs(len);
+    p += sprintf(p, "/* Resources packed by mkg3a -R.  Generated; do not edit. "
+                    "*/\n"
+                    "#ifndef G3A_RESOURCES_H\n"
+                    "#define G3A_RESOURCES_H\n"
+                    "\n"
+                    "#include <stddef.h>\n"
+                    "\n");
+    for (i = 0; i < nres; i++) {
+        p += sprintf(p, "#define RES_");
+        for (j = 0; res[i].name[j]; j++)
+            *p++ = toupper((u8)res[i].name[j]);
+        p += sprintf(p, " %d /* %s */\n", i, res[i].name);
+    }
+    p += sprintf(p, "#define RES_COUNT %d\n", nres);
+    p += sprintf(p, body, G3A_RESOURCE_ALIGN - 1, G3A_RESOURCE_ALIGN - 1,
+                 G3A_RESOURCE_MAGIC);
+    len = p - text;
+
+    // Unchanged, so leave it be for make
+    old = mapFile(path, &oldSize);
+    if (old != NULL) {
+        failed = oldSize != len || memcmp(old, text, len) != 0;
+        unmapFile(old, oldSize);
+        if (!failed) {
+            free(text);
+            return 0;
+        }
+    }
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Unable to open resource header: %s\n", strerror(errno));
+        free(text);
         return 1;
+    }
+    failed = fwrite(text, 1, len, fp) != len;
+    if (fclose(fp) != 0 || failed) {
+        printf("Failed to write resource header: %s\n", strerror(errno));
+        failed = 1;
+    }
+    free(text);
+    return failed;
+}
 
-    header = g3a_mkHeader(1);
-    if (header == NULL)
+/*
+ * Allocates a header with every field that stays the same from one build to
+ * the next filled in.  The per-build fields (see g3a_variableSum) and cksum
+ * are left zero.
+ */
+struct g3a_header *g3a_mkTemplate(struct lc_names *names, struct icons *icons,
+                                  const char *version) {
+    struct g3a_header *h = newHeader();
+    g3a_fillIcons(h, icons);
+    g3a_fillVersion(h, version);
+    g3a_fillNames(h, names);
+    return h;
+}
+
+/*
+ * Writes tmpl and its fixed checksum contribution to a header template
+ * (.g3h) file at path.  Returns 0 on success, nonzero otherwise.
+ */
+int g3a_writeTemplate(const char *path, const struct g3a_header *tmpl) {
+    struct g3a_template_header th;
+    FILE *fp;
+
+    memcpy(th.magic, G3A_TEMPLATE_MAGIC, sizeof(th.magic));
+    dumpb_u32(g3a_fixedSum(tmpl), &th.fixedSum);
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        printf("Unable to open template file: %s\n", strerror(errno));
         return 1;
-    g3a_fillSize(header, inSize);
-    g3a_fillCProt(header);
-    g3a_fillIcons(header, icons);
-    g3a_fillVersion(header, version);
+    }
+    if (fwrite(&th, sizeof(th), 1, fp) != 1 ||
+        fwrite(tmpl, sizeof(*tmpl), 1, fp) != 1 || fclose(fp) != 0) {
+        printf("Failed to write template file: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
 
-    baseName = basename(outFile);
-    strncpy(header->filename, baseName, sizeof(header->filename) - 1);
-    g3a_fillNames(header, names);
+/*
+ * Reads a header template written by g3a_writeTemplate, storing its fixed
+ * checksum contribution in fixedSum.  Returns NULL on failure.
+ */
+struct g3a_header *g3a_readTemplate(const char *path, u32 *fixedSum) {
+    struct g3a_template_header th;
+    struct g3a_header *h;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        printf("Unable to open template file: %s\n", strerror(errno));
+        return NULL;
+    }
 
-    cksum += checksum(header, sizeof(struct g3a_header));
-    dumpb_u32(cksum, &header->cksum);
-    fwrite(&header->cksum, sizeof(header->cksum), 1, outFP);
+    h = mallocs(sizeof(*h));
+    if (fread(&th, sizeof(th), 1, fp) != 1 || fread(h, sizeof(*h), 1, fp) != 1 ||
+        memcmp(th.magic, G3A_TEMPLATE_MAGIC, sizeof(th.magic)) != 0) {
+        printf("%s is not a valid header template\n", path);
+        fclose(fp);
+        free(h);
+        return NULL;
+    }
+    fclose(fp);
+    *fixedSum = u32_beton(th.fixedSum);
+    return h;
+}
 
-    // Write header
-    fseek(outFP, 0, SEEK_SET);
-    fwrite(header, sizeof(struct g3a_header), 1, outFP);
+/*
+ * Metadata files are JSON, so that they can be read and edited by hand or
+ * by other tools:
+ *
+ *     {
+ *         "filename": "CONV.g3a",
+ *         "version": "01.00.0000",
+ *         "timestamp": "2012.0314.1530",
+ *         "names": {"basic": "Conv", "internal": "CONV", "en": ...},
+ *         "files": {"code": "code.bin", "uns": "uns.png", ...},
+ *         "size": 40172,
+ *         "checksum": 3237417,
+ *         "exact": true
+ *     }
+ *
+ * Header strings are arbitrary bytes, so those outside printable ASCII are
+ * written as \u00XX escapes and read back as single bytes.
+ */
+static const char *const metaNames[] = {"en", "es", "de", "fr", "pt",
+                                        "zh", "un1", "un2"};
+static const char *const metaIcons[META_ICONS] = {"uns", "sel", "mono"};
 
-    free(header);
-    fclose(outFP);
+// Copies a header string, which fills its field if it has no terminator
+static char *fieldString(const char *field, size_t size) {
+    const char *end = memchr(field, 0, size);
+    size_t len = end == NULL ? size : (size_t)(end - field);
+    char *s = mallocs(len + 1);
+
+    memcpy(s, field, len);
+    s[len] = 0;
+    return s;
+}
+
+/*
+ * Fills in meta from the fields of h, leaving the file names and reference
+ * fields unset.
+ */
+void g3a_getMeta(const struct g3a_header *h, struct g3a_meta *meta) {
+    const char *internal = h->name_internal;
+    size_t i, internalSize = sizeof(h->name_internal);
+
+    memset(meta, 0, sizeof(*meta));
+    meta->names.basic = fieldString(h->name_basic, sizeof(h->name_basic));
+    // g3a_fillNames adds the @ back
+    if (internal[0] == '@') {
+        internal++;
+        internalSize--;
+    }
+    meta->names.internal = fieldString(internal, internalSize);
+    for (i = 0; i < sizeof(h->lc_names) / sizeof(h->lc_names[0]); i++)
+        meta->names.localized[i] =
+            fieldString(h->lc_names[i], sizeof(h->lc_names[i]));
+    meta->version = fieldString(h->version, sizeof(h->version));
+    meta->timestamp = fieldString(h->timestamp, sizeof(h->timestamp));
+    meta->filename = fieldString(h->filename, sizeof(h->filename));
+}
+
+static void jsonString(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        u8 c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7F)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+/*
+ * Writes "key": value for each of the n string values that is set, as
+ * members of an object in which *first says whether any came before.
+ */
+static void jsonMembers(FILE *fp, const char *const *keys,
+                        char *const *values, int n, const char *indent,
+                        int *first) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (values[i] == NULL)
+            continue;
+        fprintf(fp, "%s\n%s", *first ? "" : ",", indent);
+        jsonString(fp, keys[i]);
+        fputs(": ", fp);
+        jsonString(fp, values[i]);
+        *first = 0;
+    }
+}
+
+/*
+ * Writes meta to a metadata file at path.  Returns 0 on success, nonzero
+ * otherwise.
+ */
+int g3a_writeMeta(const char *path, const struct g3a_meta *meta) {
+    static const char *const topKeys[] = {"filename", "version", "timestamp"};
+    static const char *const nameKeys[] = {"basic", "internal"};
+    static const char *const fileKeys[] = {"code", "uns", "sel", "mono"};
+    char *const top[] = {meta->filename, meta->version, meta->timestamp};
+    char *const names[] = {meta->names.basic, meta->names.internal};
+    char *const files[] = {meta->code, meta->icons[META_ICON_UNS],
+                           meta->icons[META_ICON_SEL],
+                           meta->icons[META_ICON_MONO]};
+    int first = 1;
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Unable to open metadata file: %s\n", strerror(errno));
+        return 1;
+    }
+
+    fputc('{', fp);
+    jsonMembers(fp, topKeys, top, 3, "    ", &first);
+    fprintf(fp, "%s\n    \"names\": {", first ? "" : ",");
+    first = 1;
+    jsonMembers(fp, nameKeys, names, 2, "        ", &first);
+    jsonMembers(fp, metaNames, meta->names.localized, 8, "        ", &first);
+    fputs("\n    },\n    \"files\": {", fp);
+    first = 1;
+    jsonMembers(fp, fileKeys, files, 4, "        ", &first);
+    fprintf(fp, "\n    },\n    \"size\": %lu,\n    \"checksum\": %lu,\n"
+                "    \"exact\": %s\n}\n",
+            (unsigned long)meta->size, (unsigned long)meta->cksum,
+            meta->exact ? "true" : "false");
+    if (fclose(fp) != 0) {
+        printf("Failed to write metadata file: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Where a string at key path (such as "names.en") goes in meta, or NULL if
+ * it is not one meta keeps.
+ */
+static char **metaString(struct g3a_meta *meta, const char *path) {
+    int i;
+
+    if (!strcmp(path, "filename"))
+        return &meta->filename;
+    if (!strcmp(path, "version"))
+        return &meta->version;
+    if (!strcmp(path, "timestamp"))
+        return &meta->timestamp;
+    if (!strcmp(path, "names.basic"))
+        return &meta->names.basic;
+    if (!strcmp(path, "names.internal"))
+        return &meta->names.internal;
+    for (i = 0; i < 8; i++) {
+        if (!strncmp(path, "names.", 6) && !strcmp(path + 6, metaNames[i]))
+            return &meta->names.localized[i];
+    }
+    if (!strcmp(path, "files.code"))
+        return &meta->code;
+    for (i = 0; i < META_ICONS; i++) {
+        if (!strncmp(path, "files.", 6) && !strcmp(path + 6, metaIcons[i]))
+            return &meta->icons[i];
+    }
+    return NULL;
+}
+
+static void jsonSpace(const char **p) {
+    while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r')
+        (*p)++;
+}
+
+/*
+ * Reads the JSON string at *p, which must start with its opening quote,
+ * advancing *p past it.  Returns NULL if it is malformed or holds characters
+ * that are not single bytes.
+ */
+static char *jsonReadString(const char **p) {
+    const char *s = *p + 1;
+    char *out, *o;
+    unsigned int c;
+    int i;
+
+    // Escapes never make a string longer
+    out = o = mallocs(strlen(s) + 1);
+    for (; *s != '"'; s++) {
+        if (*s == 0 || (u8)*s < 0x20)
+            goto fail;
+        if (*s != '\\') {
+            *o++ = *s;
+            continue;
+        }
+        switch (*++s) {
+        case 'b':
+            *o++ = '\b';
+            break;
+        case 'f':
+            *o++ = '\f';
+            break;
+        case 'n':
+            *o++ = '\n';
+            break;
+        case 'r':
+            *o++ = '\r';
+            break;
+        case 't':
+            *o++ = '\t';
+            break;
+        case 'u':
+            for (c = 0, i = 1; i <= 4; i++) {
+                if (!isxdigit((u8)s[i]))
+                    goto fail;
+                c = c << 4 | (isdigit((u8)s[i]) ? s[i] - '0'
+                                                 : (s[i] | 0x20) - 'a' + 10);
+            }
+            if (c == 0 || c > 0xFF)
+                goto fail;
+            *o++ = c;
+            s += 4;
+            break;
+        case '"':
+        case '\\':
+        case '/':
+            *o++ = *s;
+            break;
+        default:
+            goto fail;
+        }
+    }
+    *o = 0;
+    *p = s + 1;
+    return out;
+
+fail:
+    free(out);
+    return NULL;
+}
+
+/*
+ * Reads the JSON value at *p, which is at key path within the document,
+ * storing what meta keeps.  Returns nonzero if it is malformed.
+ */
+static int jsonReadValue(const char **p, const char *path,
+                         struct g3a_meta *meta, int depth) {
+    char *s, **dst, *sub;
+    const char *start;
+    int failed;
+
+    jsonSpace(p);
+    if (**p == '"') {
+        s = jsonReadString(p);
+        if (s == NULL)
+            return 1;
+        dst = metaString(meta, path);
+        if (dst == NULL) {
+            free(s);
+        } else {
+            free(*dst);
+            *dst = s;
+        }
+        return 0;
+    }
+    if (**p == '{' || **p == '[') {
+        char close = **p == '{' ? '}' : ']';
+        if (depth > 16)
+            return 1;
+        (*p)++;
+        jsonSpace(p);
+        if (**p == close) {
+            (*p)++;
+            return 0;
+        }
+        for (;;) {
+            sub = NULL;
+            if (close == '}') {
+                jsonSpace(p);
+                if (**p != '"' || (s = jsonReadString(p)) == NULL)
+                    return 1;
+                jsonSpace(p);
+                if (*(*p)++ != ':') {
+                    free(s);
+                    return 1;
+                }
+                sub = mallocs(strlen(path) + strlen(s) + 2);
+                sprintf(sub, "%s%s%s", path, *path ? "." : "", s);
+                free(s);
+            }
+            // Array members are read but never kept
+            failed = jsonReadValue(p, sub != NULL ? sub : "[]", meta,
+                                   depth + 1);
+            free(sub);
+            if (failed)
+                return 1;
+            jsonSpace(p);
+            if (**p == close) {
+                (*p)++;
+                return 0;
+            }
+            if (*(*p)++ != ',')
+                return 1;
+        }
+    }
+
+    // A number or literal, of which only the reference fields are kept
+    start = *p;
+    while (**p != 0 && strchr(",}] \t\r\n", **p) == NULL)
+        (*p)++;
+    if (*p == start)
+        return 1;
+    if (!strcmp(path, "exact")) {
+        meta->exact = *p - start == 4 && !strncmp(start, "true", 4);
+    } else if (!strcmp(path, "size") || !strcmp(path, "checksum")) {
+        u32 v = strtoul(start, NULL, 10);
+        *(path[0] == 's' ? &meta->size : &meta->cksum) = v;
+    }
     return 0;
 }
 
+/*
+ * Reads a metadata file as written by g3a_writeMeta into meta.  Unknown
+ * keys are ignored and missing ones left NULL.  Returns 0 on success,
+ * nonzero otherwise.
+ */
+int g3a_readMeta(const char *path, struct g3a_meta *meta) {
+    const char *p;
+    char *text;
+    size_t size;
+    int failed;
+    const void *file = mapFile(path, &size);
+    if (file == NULL) {
+        printf("Unable to open metadata file: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // Parsing is simpler with a terminator
+    text = mallocs(size + 1);
+    memcpy(text, file, size);
+    text[size] = 0;
+    unmapFile(file, size);
+
+    memset(meta, 0, sizeof(*meta));
+    p = text;
+    jsonSpace(&p);
+    failed = *p != '{' || jsonReadValue(&p, "", meta, 0);
+    if (!failed) {
+        jsonSpace(&p);
+        failed = *p != 0;
+    }
+    if (failed) {
+        printf("%s is not a valid metadata file (at byte %ld)\n", path,
+               (long)(p - text));
+        g3a_freeMeta(meta);
+    }
+    free(text);
+    return failed;
+}
+
+void g3a_freeMeta(struct g3a_meta *meta) {
+    int i;
+
+    for (i = 0; i < 10; i++)
+        free(meta->names.raw[i]);
+    free(meta->version);
+    free(meta->timestamp);
+    free(meta->filename);
+    free(meta->code);
+    for (i = 0; i < META_ICONS; i++)
+        free(meta->icons[i]);
+    memset(meta, 0, sizeof(*meta));
+}
+
 /*
  * Fills in copy protection field, depends on size
  */
@@ -78,6 +870,7 @@ void g3a_fillCProt(struct g3a_header *h) {
 void g3a_fillIcons(struct g3a_header *h, struct icons *icons) {
     memcpy(h->icon_unsel, icons->unselected, sizeof(h->icon_unsel));
     memcpy(h->icon_sel, icons->selected, sizeof(h->icon_sel));
+    memcpy(h->icon_mono, icons->mono, sizeof(h->icon_mono));
 }
 
 /*
@@ -112,13 +905,54 @@ void g3a_fillNames(struct g3a_header *h, struct lc_names *names) {
     }
 }
 
+/* 9999-12-31 23:59:59 UTC, the last time with a four-digit year */
+#define MAX_SOURCE_DATE_EPOCH 253402300799LL
+
 /*
- * Fills in timestamp with current time
+ * Reads a fixed build time from SOURCE_DATE_EPOCH (seconds since 1970, see
+ * reproducible-builds.org).  Returns nonzero if it is unset or invalid,
+ * including times past the last the timestamp field can hold.
+ */
+static int sourceDateEpoch(time_t *t) {
+    static int warned;
+    const char *s = getenv("SOURCE_DATE_EPOCH");
+    char *end;
+    long long v;
+
+    if (s == NULL || *s == 0)
+        return 1;
+    errno = 0;
+    v = strtoll(s, &end, 10);
+    if (*end != 0 || errno != 0 || v < 0 || v > MAX_SOURCE_DATE_EPOCH ||
+        (long long)(time_t)v != v) {
+        if (!warned++)
+            printf("Ignoring invalid SOURCE_DATE_EPOCH: %s\n", s);
+        return 1;
+    }
+    *t = (time_t)v;
+    return 0;
+}
+
+/*
+ * Fills in timestamp with current time, or with SOURCE_DATE_EPOCH in UTC if
+ * that is set so that the same inputs always build the same file.
  */
 void g3a_fillTimestamp(struct g3a_header *h) {
-    time_t now_t = time(NULL);
-    struct tm *now = localtime(&now_t);
-    strftime(h->timestamp, sizeof(h->timestamp), "%Y.%m%d.%H%M", now);
+    time_t now_t;
+    struct tm *now;
+
+    if (sourceDateEpoch(&now_t) == 0) {
+        now = gmtime(&now_t);
+    } else {
+        now_t = time(NULL);
+        now = localtime(&now_t);
+    }
+    // Left blank if the time cannot be represented
+    if (now == NULL ||
+        !strftime(h->timestamp, sizeof(h->timestamp), "%Y.%m%d.%H%M", now)) {
+        printf("Unable to convert the build time; leaving it blank\n");
+        memset(h->timestamp, 0, sizeof(h->timestamp));
+    }
 }
 
 /* Allocates a new header and fills in the normally untouched fields.
@@ -129,15 +963,7 @@ void g3a_fillTimestamp(struct g3a_header *h) {
  *  - version (01.00.0000)
  *  - timestamp (current time) */
 struct g3a_header *g3a_mkHeader(int type) {
-    u8 MAGIC[] = {0xAA, 0xAC, 0xBD, 0xAF, 0x90, 0x88, 0x9A,
-                  0x8D, 0xD3, 0xFF, 0xFE, 0xFF, 0xFE, 0xFF};
-
-    struct g3a_header *h = callocs(1, sizeof(struct g3a_header));
-
-    memcpy(h->magic, MAGIC, sizeof(MAGIC));
-    h->_pad3[0] = 0x01;
-    h->_pad3[1] = 0x01; // Doesn't seem necessary, but we'll use it
-    strncpy(h->version, "01.00.0000", sizeof(h->version) - 1);
+    struct g3a_header *h = newHeader();
     g3a_fillTimestamp(h);
     return h;
 }
@@ -150,42 +976,34 @@ void g3a_fillSize(struct g3a_header *h, u32 codeSize) {
     dumpb_u32(outSize, &h->size);
 }
 
-void g3a_fillVersion(struct g3a_header *h, const char *version) {
-    strncpy(h->version, version, sizeof(h->version) - 1);
+/*
+ * Checksum contribution of the fields that change on every build: size,
+ * cksum2_ofs, cprot, timestamp and filename.
+ */
+u32 g3a_variableSum(const struct g3a_header *h) {
+    return checksum(&h->size, sizeof(h->size)) +
+           checksum(&h->cksum2_ofs, sizeof(h->cksum2_ofs)) +
+           checksum(h->cprot, sizeof(h->cprot)) +
+           checksum(h->timestamp, sizeof(h->timestamp)) +
+           checksum(h->filename, sizeof(h->filename));
 }
 
 /*
- * Read inFile, checksum it, and write the contents into outFile.
+ * Contribution of the fields of h that stay the same from one build to the
+ * next to the file checksum; that is, g3a_headerSum less g3a_variableSum.
  */
-int g3a_processRaw(const char *inFile, FILE *outFile, u32 *size, u32 *cksum) {
-    u32 sum = 0;
-    u8 buf[FREAD_CHUNK];
-    size_t rsize;
-    FILE *inFP;
-
-    inFP = fopen(inFile, "rb");
-    if (inFP == NULL) {
-        printf("Failed to open input file for reading!\n");
-        return 1;
-    }
-    fseek(inFP, 0, SEEK_END);
-    if (ftell(inFP) > 0x01000000) {
-        printf(
-            "Cowardly refusing to operating on input file larger than 16MB.\n");
-        return 1;
-    }
-    rewind(inFP);
+u32 g3a_fixedSum(const struct g3a_header *h) {
+    return g3a_headerSum(h) - g3a_variableSum(h);
+}
 
-    *size = 0;
-    do {
-        // Read a chunk, update checksum, write
-        rsize = fread(buf, 1, FREAD_CHUNK, inFP);
-        sum += checksum(buf, rsize);
-        fwrite(buf, rsize, 1, outFile);
-        *size += rsize;
-    } while (rsize == FREAD_CHUNK);
+/*
+ * Contribution of the header to the file checksum: every byte except the
+ * checksum field itself.
+ */
+u32 g3a_headerSum(const struct g3a_header *h) {
+    return checksum(h, sizeof(*h)) - checksum(&h->cksum, sizeof(h->cksum));
+}
 
-    fclose(inFP);
-    *cksum = sum;
-    return 0;
+void g3a_fillVersion(struct g3a_header *h, const char *version) {
+    strncpy(h->version, version, sizeof(h->version) - 1);
 }
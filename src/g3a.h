@@ -9,10 +9,15 @@
 #define G3A_ICON_MONO_HEIGHT (24)
 #define G3A_ICON_MONO_WIDTH (64)
 
+/* Leading bytes of every g3a file */
+#define G3A_MAGIC_SIZE (14)
+extern const u8 G3A_MAGIC[G3A_MAGIC_SIZE];
+
 struct icons {
     u16 unselected[G3A_ICON_HEIGHT * G3A_ICON_WIDTH];
     u16 selected[G3A_ICON_HEIGHT * G3A_ICON_WIDTH];
-    u16 mono[G3A_ICON_HEIGHT * G3A_ICON_WIDTH];
+    /* Packed for the header: 2 pixels per byte, 0 (dark) or 7 (light) */
+    u8 mono[G3A_ICON_MONO_HEIGHT * G3A_ICON_MONO_WIDTH / 2];
 };
 
 /* Shortcuts to create localized name members */
@@ -78,7 +83,7 @@ struct g3a_header {
         };
     };
     /* 0x0290 Monochrome icon- 64x24, 1 nibble per pixel, 0 or 7 */
-    u8 icon_mono[64 * 24 / 2];
+    u8 icon_mono[G3A_ICON_MONO_WIDTH * G3A_ICON_MONO_HEIGHT / 2];
     u8 _pad7[0x92C];
     /* 0x0EBC File name (including .g3a extension) */
     char filename[0x144];
@@ -90,6 +95,14 @@ struct g3a_header {
     u8 _pad9[0x200];
     /* 0x7000 Executable code */
 };
+
+/* Header template (.g3h) files: this, then a struct g3a_header */
+#define G3A_TEMPLATE_MAGIC "G3H\x01"
+struct g3a_template_header {
+    u8 magic[4];
+    /* Checksum contribution of the header, big-endian */
+    u32 fixedSum;
+};
 #pragma pack()
 
 struct lc_names {
@@ -115,11 +128,84 @@ struct lc_names {
     };
 };
 
+/*
+ * Resources packed into the body after the program (mkg3a -R), so they can
+ * change without relinking.  The section starts at the first
+ * G3A_RESOURCE_ALIGN boundary after the program with a table: a
+ * g3a_resource_table, count g3a_resource_entry, then their NUL-terminated
+ * names.  Offsets are from the start of the table and everything is
+ * big-endian, as on the calculator.  g3a_writeResourceHeader writes a C
+ * header for finding them at run time.
+ */
+#define G3A_RESOURCE_MAGIC (0x47335253) /* "G3RS" */
+#define G3A_RESOURCE_ALIGN (16)
+struct g3a_resource_table {
+    u32 magic;
+    u32 count;
+    /* Of the whole section, table included */
+    u32 size;
+    u32 _pad;
+};
+struct g3a_resource_entry {
+    u32 name;
+    u32 offset;
+    u32 size;
+    u32 align;
+};
+
+/* A resource to pack: name, the file it comes from and its alignment */
+struct g3a_resource {
+    const char *name;
+    const char *path;
+    u32 align;
+};
+
+/*
+ * Header fields as kept in a metadata file (see g3a_writeMeta), with the
+ * names of the files holding the code and icons relative to it.  Strings
+ * are allocated; release them with g3a_freeMeta.
+ */
+enum meta_icon { META_ICON_UNS, META_ICON_SEL, META_ICON_MONO, META_ICONS };
+struct g3a_meta {
+    /* As for g3a_fillNames, so internal has no leading @ */
+    struct lc_names names;
+    char *version;
+    /* Pinned in headers made from this, rather than filled in per build */
+    char *timestamp;
+    char *filename;
+    char *code;
+    char *icons[META_ICONS];
+    /* For reference only: the file's size and checksum, and whether
+     * rebuilding it from this gives exactly the same bytes */
+    u32 size;
+    u32 cksum;
+    int exact;
+};
+
+/* Flags for g3a_mkG3AFromTemplate */
+#define G3A_UPDATE_IN_PLACE (1) /* Rewrite only blocks that changed */
+
 /* Creating bits of the file */
 int g3a_mkG3A(const char *inFile, const char *outFile, struct lc_names *names,
               struct icons *icons, const char *version);
+int g3a_mkG3AFromTemplate(const char *inFile, const char *outFile,
+                          const struct g3a_header *tmpl, u32 fixedSum,
+                          const struct g3a_resource *res, int nres, int flags);
+int g3a_writeResourceHeader(const char *path, const struct g3a_resource *res,
+                            int nres);
+u8 *g3a_mkResourceTable(const struct g3a_resource *res, int nres,
+                        const size_t *sizes, size_t base, u32 *offsets,
+                        size_t *tableSize, size_t *size);
+size_t g3a_findResources(const u8 *body, size_t size);
 struct g3a_header *g3a_mkHeader(int type);
-int g3a_processRaw(const char *inFile, FILE *outFile, u32 *size, u32 *cksum);
+struct g3a_header *g3a_mkTemplate(struct lc_names *names, struct icons *icons,
+                                  const char *version);
+int g3a_writeTemplate(const char *path, const struct g3a_header *tmpl);
+struct g3a_header *g3a_readTemplate(const char *path, u32 *fixedSum);
+void g3a_getMeta(const struct g3a_header *h, struct g3a_meta *meta);
+int g3a_writeMeta(const char *path, const struct g3a_meta *meta);
+int g3a_readMeta(const char *path, struct g3a_meta *meta);
+void g3a_freeMeta(struct g3a_meta *meta);
 
 /* Processing bits of the file */
 void g3a_fillCProt(struct g3a_header *h);
@@ -128,5 +214,8 @@ void g3a_fillNames(struct g3a_header *h, struct lc_names *names);
 void g3a_fillSize(struct g3a_header *h, u32 codeSize);
 void g3a_fillTimestamp(struct g3a_header *h);
 void g3a_fillVersion(struct g3a_header *h, const char *version);
+u32 g3a_fixedSum(const struct g3a_header *h);
+u32 g3a_headerSum(const struct g3a_header *h);
+u32 g3a_variableSum(const struct g3a_header *h);
 
 #endif /* _G3A_H */
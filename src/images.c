@@ -1,11 +1,15 @@
 #include "images.h"
 
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "config.h"
+#include "fxi.h"
+#include "image.h"
+#include "probes.h"
 #include "util.h"
 
 #if USE_PNG
@@ -29,6 +33,7 @@ u8 *readImageData_PNG(png_structp png_ptr, png_infop info_ptr,
     unsigned int y;
     size_t w, h;
 
+    PROBE(png_read_entry);
     png_read_info(png_ptr, info_ptr);
     *width_out = w = png_get_image_width(png_ptr, info_ptr);
     *height_out = h = png_get_image_height(png_ptr, info_ptr);
@@ -37,6 +42,7 @@ u8 *readImageData_PNG(png_structp png_ptr, png_infop info_ptr,
     if (bit_depth != 8 || color_type != PNG_COLOR_TYPE_RGB) {
         fprintf(stderr,
                 "Unsupported PNG bit depth or color type, must be RGB-8\n");
+        PROBE2(png_read_return, 0, 0);
         return NULL;
     }
 
@@ -51,7 +57,9 @@ u8 *readImageData_PNG(png_structp png_ptr, png_infop info_ptr,
         row_pointers[y] = imageData + (w * 3 * y);
     }
     png_read_image(png_ptr, row_pointers);
+    free(row_pointers);
 
+    PROBE2(png_read_return, w, h);
     return imageData;
 }
 
@@ -96,99 +104,200 @@ cleanup_png_ptr:
 }
 #endif /* USE_PNG */
 
-u8 *loadBitmap_BMP(FILE *fp, int32_t *width, int32_t *height) {
-    struct bmp_header *bh;
-    struct dib_header *dh;
-    int32_t w, h;
-    int err = 0;
-    u8 *data;
+// Little-endian field accessors for headers read straight from the file
+static u16 bmp_u16(const u8 *p) { return p[0] | p[1] << 8; }
+static u32 bmp_u32(const u8 *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (u32)p[3] << 24;
+}
 
-    bh = mallocs(sizeof(*bh));
-    dh = mallocs(sizeof(*dh));
-    if ((err = readBMPHeader(bh, dh, fp))) {
-        goto out;
-    }
-    *width = w = dh->width;
-    *height = h = dh->height;
+static int bmpConvert(const struct bmp_header *bh, const struct dib_header *dh,
+                      const u8 *file, size_t size, u8 *out, int rgb);
+
+/*
+ * Reads a BMP mapped at file as big-endian 5-6-5 pixels, or as 24 bpp BGR
+ * if rgb is nonzero.
+ */
+static void *loadBitmap_BMP(const u8 *file, size_t size, int32_t *width,
+                            int32_t *height, int rgb) {
+    struct bmp_header bh;
+    struct dib_header dh;
+    u8 *data;
 
-    data = mallocs(w * 3 * h);
-    err = readBMPData(dh, data, fp);
+    if (readBMPHeader(&bh, &dh, file, size))
+        goto fail;
+    *width = dh.width;
+    *height = dh.height < 0 ? -dh.height : dh.height;
 
-out:
-    free(bh);
-    free(dh);
-    if (err) {
+    data = mallocs((size_t)(rgb ? 3 : 2) * *width * *height);
+    if (bmpConvert(&bh, &dh, file, size, data, rgb)) {
         free(data);
-        printf("Error reading image: %s\n", bmperror);
-        return NULL;
+        goto fail;
     }
     return data;
+
+fail:
+    printf("Error reading image: %s\n", bmperror);
+    return NULL;
 }
 
-#if IS_BIG_ENDIAN
-/*
- * Inverts endianness of the given DIB header.
- * Only used for big-endian systems.
- */
-static void dibHeader_convert(struct dib_header *h) {
-    h->header_size = u32_ntole(h->header_size);
-    h->width = u32_ntole(h->width);
-    h->height = u32_ntole(h->height);
-    h->nplanes = u16_ntole(h->nplanes);
-    h->bpp = u16_ntole(h->bpp);
-    // h->compress_type = u32_flip(h->compress_type);    // != 0 fails
-    // h->bmp_byte_size = u32_flip(h->bmp_byte_size);    // ignored
-    // h->hres = u32_flip(h->bmp_byte_size);
-    // h->vres = u32_flip(h->vres);
-    // h->ncolors = u32_flip(h->ncolors);                // != 0 fails
-    // h->nimpcolors = u32_flip(h->nimpcolors);            // ignored
-}
-#endif /* IS_BIG_ENDIAN */
-
-int readBMPHeader(struct bmp_header *bh, struct dib_header *h, FILE *fp) {
-    size_t sz;
+int readBMPHeader(struct bmp_header *bh, struct dib_header *h, const u8 *file,
+                  size_t size) {
+    size_t stride, rows;
 
     // BMP header
-    sz = fread(bh, 1, sizeof(*bh), fp);
-    if (sz != sizeof(*bh))
+    if (size < sizeof(*bh) + sizeof(*h))
         BMPFAIL("Strange BMP header");
-    if (bh->signature[0] != 0x42 || bh->signature[1] != 0x4D) // "BM"
+    if (file[0] != 0x42 || file[1] != 0x4D) // "BM"
         BMPFAIL("Not a BMP file");
+    memcpy(bh->signature, file, 2);
+    bh->file_size = bmp_u32(file + 2);
+    bh->px_offset = bmp_u32(file + 10);
 
     // DIB header
-    sz = fread(h, 1, sizeof(*h), fp);
-#if IS_BIG_ENDIAN
-    dibHeader_convert(h);
-#endif
-
-    if (sz < sizeof(*h))
+    file += sizeof(*bh);
+    h->header_size = bmp_u32(file);
+    h->width = bmp_u32(file + 4);
+    h->height = bmp_u32(file + 8);
+    h->nplanes = bmp_u16(file + 12);
+    h->bpp = bmp_u16(file + 14);
+    h->compress_type = bmp_u32(file + 16);
+    h->bmp_byte_size = bmp_u32(file + 20);
+    h->ncolors = bmp_u32(file + 32);
+
+    if (h->header_size < sizeof(*h))
         BMPFAIL("Strange DIB header");
+    if (h->width <= 0 || h->height == 0 || h->height == INT32_MIN)
+        BMPFAIL("Invalid dimensions");
     if (h->nplanes != 1)
         BMPFAIL("nplanes not 1");
-    if (h->bpp != 24)
-        BMPFAIL("Unsupported color depth (must be 24 bpp)");
-    if (h->compress_type != 0)
+    if (h->compress_type == BMP_BI_RGB) {
+        if (h->bpp != 24 && h->bpp != 32)
+            BMPFAIL("Unsupported color depth (must be 24 or 32 bpp)");
+    } else if (h->compress_type == BMP_BI_BITFIELDS) {
+        if (h->bpp != 16 && h->bpp != 32)
+            BMPFAIL("Unsupported color depth (must be 16 or 32 bpp)");
+    } else {
         BMPFAIL("Unsupported compression");
+    }
     if (h->ncolors != 0)
         BMPFAIL("Palette not supported");
 
-    // Seek to image data
-    if (fseek(fp, h->header_size - sz, SEEK_CUR) != 0)
-        BMPFAIL("fseek returned abnormally");
+    // All of the (4-byte aligned) rows must be in the file, which also keeps
+    // the size of the decoded image within reason
+    rows = h->height < 0 ? -(size_t)h->height : (size_t)h->height;
+    stride = ((size_t)h->width * h->bpp + 31) / 32 * 4;
+    if (bh->px_offset > size || (size - bh->px_offset) / stride < rows)
+        BMPFAIL("Unexpected EOF");
     return 0;
 }
 
-int readBMPData(struct dib_header *dh, u8 *d, FILE *fp) {
-    int row;
-    size_t sz;
+/*
+ * Channel extraction for one component of a pixel: shift the pixel right by
+ * shift, mask it and look up the output depth in lut.
+ */
+struct bmp_channel {
+    unsigned shift;
+    u32 mask;
+    u8 lut[256];
+};
+
+static void bmpChannel_init(struct bmp_channel *c, u32 mask, u8 depth) {
+    unsigned bits = 0, i;
+
+    c->shift = 0;
+    while (mask && !(mask & 1)) {
+        mask >>= 1;
+        c->shift++;
+    }
+    while (mask & 1) {
+        mask >>= 1;
+        bits++;
+    }
+    // Only the top 8 bits of wide channels are significant at 5 or 6 bits
+    if (bits > 8) {
+        c->shift += bits - 8;
+        bits = 8;
+    }
+    c->mask = (1u << bits) - 1;
+    for (i = 0; i <= c->mask; i++) {
+        if (bits == depth)
+            c->lut[i] = i;
+        else
+            c->lut[i] = bits ? convertChannelDepth(i, bits, depth) : 0;
+    }
+}
+
+/*
+ * Converts the pixel array of a BMP file mapped at file straight into
+ * big-endian 5-6-5 pixels at out, honouring the pixel offset, row padding
+ * and row order given by the headers, which must have been accepted by
+ * readBMPHeader.
+ */
+int readBMPData(const struct bmp_header *bh, const struct dib_header *dh,
+                const u8 *file, size_t size, u16 *out) {
+    return bmpConvert(bh, dh, file, size, (u8 *)out, 0);
+}
+
+/*
+ * As readBMPData, but writes 24 bpp BGR pixels (the input of convertBPP).
+ */
+int readBMPDataRGB(const struct bmp_header *bh, const struct dib_header *dh,
+                   const u8 *file, size_t size, u8 *out) {
+    return bmpConvert(bh, dh, file, size, out, 1);
+}
 
-    // XXX hardcoded dimensions are begging to explode
-    for (row = dh->height - 1; row >= 0; row--) {
-        // Rows are 2208 bytes wide, so no alignment to worry about
-        // (rows are supposed to be aligned to 4 bytes)
-        sz = fread(d + row * dh->width * 3, 3, dh->width, fp);
-        if (sz != (unsigned)dh->width)
+static int bmpConvert(const struct bmp_header *bh, const struct dib_header *dh,
+                      const u8 *file, size_t size, u8 *d, int rgb) {
+    struct bmp_channel r, g, b;
+    u32 w = dh->width, h, y, x;
+    size_t stride, bypp = dh->bpp / 8;
+    const u8 *row;
+
+    if (dh->compress_type == BMP_BI_BITFIELDS) {
+        // Masks follow a 40-byte DIB header, or are its next members
+        size_t mofs = sizeof(*bh) + sizeof(*dh);
+        if (size < mofs + 12)
             BMPFAIL("Unexpected EOF");
+        bmpChannel_init(&r, bmp_u32(file + mofs), rgb ? 8 : 5);
+        bmpChannel_init(&g, bmp_u32(file + mofs + 4), rgb ? 8 : 6);
+        bmpChannel_init(&b, bmp_u32(file + mofs + 8), rgb ? 8 : 5);
+    } else {
+        bmpChannel_init(&r, 0xFF0000, rgb ? 8 : 5);
+        bmpChannel_init(&g, 0x00FF00, rgb ? 8 : 6);
+        bmpChannel_init(&b, 0x0000FF, rgb ? 8 : 5);
+    }
+
+    // Rows are padded to a multiple of 4 bytes
+    h = dh->height < 0 ? -dh->height : dh->height;
+    stride = ((size_t)w * dh->bpp + 31) / 32 * 4;
+
+    for (y = 0; y < h; y++) {
+        // Bottom-up unless height is negative
+        u32 srcRow = dh->height < 0 ? y : h - 1 - y;
+        row = file + bh->px_offset + srcRow * stride;
+        for (x = 0; x < w; x++, row += bypp) {
+            u32 px;
+            u16 px565;
+
+            if (bypp == 2)
+                px = bmp_u16(row);
+            else if (bypp == 3)
+                px = row[0] | row[1] << 8 | row[2] << 16;
+            else
+                px = bmp_u32(row);
+            if (rgb) {
+                *d++ = b.lut[px >> b.shift & b.mask];
+                *d++ = g.lut[px >> g.shift & g.mask];
+                *d++ = r.lut[px >> r.shift & r.mask];
+                continue;
+            }
+            px565 = r.lut[px >> r.shift & r.mask] << 11 |
+                    g.lut[px >> g.shift & g.mask] << 5 |
+                    b.lut[px >> b.shift & b.mask];
+            // Write as big-endian
+            *d++ = px565 >> 8;
+            *d++ = px565 & 0xFF;
+        }
     }
     return 0;
 }
@@ -212,6 +321,7 @@ u16 *convertBPP(int32_t w, int32_t h, u8 *d) {
     u16 px;
     char r, g, b;
 
+    PROBE2(convert_bpp_entry, w, h);
     for (pxi = 0; pxi < w * h; pxi++) {
         b = convertChannelDepth(d[pxi * 3], 8, 5);
         g = convertChannelDepth(d[pxi * 3 + 1], 8, 6);
@@ -222,13 +332,101 @@ u16 *convertBPP(int32_t w, int32_t h, u8 *d) {
         d[2 * pxi] = px >> 8;
         d[2 * pxi + 1] = px & 0xFF;
     }
+    PROBE2(convert_bpp_return, w, h);
     return realloc(d, 2 * w * h);
 }
 
-void writeBitmap(const char *path, u16 *data, int w, int h) {
+/*
+ * Overlap of output sample i and source sample j when scaling n samples to m
+ * with an area (box) filter.  On a common axis, output i covers
+ * [i*n, (i+1)*n) and source j covers [j*m, (j+1)*m), so the weights for one
+ * output sum to n.
+ */
+static u32 areaWeight(u32 i, u32 j, u32 n, u32 m) {
+    u32 lo = i * n > j * m ? i * n : j * m;
+    u32 hi = (i + 1) * n < (j + 1) * m ? (i + 1) * n : (j + 1) * m;
+    return hi > lo ? hi - lo : 0;
+}
+
+/*
+ * Downscales the big-endian 5-6-5 image at src (w x h pixels) with an area
+ * filter to a dw x dh monochrome image at dst, packed two pixels per byte
+ * (high nibble first) as 0 for dark or 7 for light pixels.
+ *
+ * Work is done a row at a time: each source row is converted to luminance
+ * and accumulated into the current output row with a single weight, then
+ * output columns are gathered from the few source columns they cover.
+ * The inner loops are plain arrays of integers so compilers can vectorize
+ * them.
+ */
+void convertMono(const u16 *src, int32_t w, int32_t h, u8 *dst, int32_t dw,
+                 int32_t dh) {
+    u32 *luma = mallocs(w * sizeof(*luma));
+    u32 *acc = mallocs(w * sizeof(*acc));
+    const u8 *px = (const u8 *)src;
+    int32_t x, y, oy, ox;
+
+    memset(dst, 0, dw * dh / 2);
+    for (oy = 0; oy < dh; oy++) {
+        memset(acc, 0, w * sizeof(*acc));
+        for (y = oy * h / dh; y < h && y * dh < (oy + 1) * h; y++) {
+            u32 wy = areaWeight(oy, y, h, dh);
+            const u8 *row = px + 2 * w * y;
+            for (x = 0; x < w; x++) {
+                u32 p = row[2 * x] << 8 | row[2 * x + 1];
+                u32 r = (p >> 11) * 255 / 31;
+                u32 g = (p >> 5 & 0x3F) * 255 / 63;
+                u32 b = (p & 0x1F) * 255 / 31;
+                // BT.601 luma, 0-255
+                luma[x] = (77 * r + 150 * g + 29 * b) >> 8;
+            }
+            for (x = 0; x < w; x++)
+                acc[x] += wy * luma[x];
+        }
+
+        for (ox = 0; ox < dw; ox++) {
+            u64 sum = 0;
+            for (x = ox * w / dw; x < w && x * dw < (ox + 1) * w; x++)
+                sum += areaWeight(ox, x, w, dw) * acc[x];
+            // Total weight is w * h; threshold at half brightness
+            if (sum >= (u64)128 * w * h)
+                dst[(oy * dw + ox) / 2] |= ox & 1 ? 0x07 : 0x70;
+        }
+    }
+    free(luma);
+    free(acc);
+}
+
+/*
+ * Expands the w x h big-endian 5-6-5 pixels at data to 24 bpp BGR rows,
+ * bottom row first if flip is set.  Channels are rounded up, so convertBPP
+ * turns the result back into exactly the same pixels.
+ */
+static u8 *expandRows(const u16 *data, int w, int h, int flip) {
+    const u8 *px = (const u8 *)data;
+    u8 *out = mallocs(3 * (size_t)w * h);
+    int x, y;
+
+    for (y = 0; y < h; y++) {
+        u8 *row = out + 3 * (size_t)w * (flip ? h - 1 - y : y);
+        for (x = 0; x < w; x++, px += 2) {
+            u16 p = px[0] << 8 | px[1];
+            row[3 * x] = ((p & 0x1F) * 255 + 30) / 31;
+            row[3 * x + 1] = ((p >> 5 & 0x3F) * 255 + 62) / 63;
+            row[3 * x + 2] = ((p >> 11) * 255 + 30) / 31;
+        }
+    }
+    return out;
+}
+
+/*
+ * Writes the big-endian 5-6-5 image at data to path as a 24 bpp BMP.
+ * Returns nonzero on failure.
+ */
+int writeBitmap(const char *path, const u16 *data, int w, int h) {
     // TODO: don't write broken files on big-endian systems
     u8 *cdata;
-    int x, y;
+    int failed;
     u32 imgSize = w * h * 3;
     struct bmp_header bh = {
         {0x42, 0x4D},                                     // Signature
@@ -250,60 +448,533 @@ void writeBitmap(const char *path, u16 *data, int w, int h) {
     FILE *fp = fopen(path, "wb");
     if (fp == NULL) {
         printf("Failed to open file for writing: %s\n", strerror(errno));
-        return;
+        return 1;
     }
     // Headers, sigh
     fwrite(&bh, sizeof(bh), 1, fp);
     fwrite(&dh, sizeof(dh), 1, fp);
 
-    // Convert image data to 24bpp BGR and invert scan
-    cdata = mallocs(3 * w * h);
-    for (y = 0; y < h; y++) {
-        u8 *destRow = cdata + w * 3 * (h - 1 - y);
-        for (x = 0; x < w; x++) {
-            u8 r, g, b;
-            u16 px = data[w * y + x];
-            px = (px << 8 & 0xFF00) | px >> 8;
-            r = convertChannelDepth((px >> 11) & 0x1F, 5, 8);
-            g = convertChannelDepth((px >> 5) & 0x3F, 6, 8);
-            b = convertChannelDepth(px & 0x1F, 5, 8);
-            destRow[3 * x] = b;
-            destRow[3 * x + 1] = g;
-            destRow[3 * x + 2] = r;
-        }
-    }
-    fwrite(cdata, 3, w * h, fp);
+    // BMP rows are stored bottom to top; with width * 3 a multiple of 4
+    // there is no row padding, which holds for every icon size
+    cdata = expandRows(data, w, h, 1);
+    failed = fwrite(cdata, 3, w * h, fp) != (size_t)(w * h);
     free(cdata);
-    fclose(fp);
+    if (fclose(fp) != 0 || failed) {
+        printf("Failed to write %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    return 0;
 }
 
-u16 *loadBitmap(const char *path, int32_t *width, int32_t *height) {
-    u8 *imgData = NULL;
-    u8 pngHeader[8];
-    FILE *fp = fopen(path, "rb");
+#if USE_PNG
+/*
+ * Writes the big-endian 5-6-5 image at data to path as an 8-bit RGB PNG.
+ * Returns nonzero on failure.
+ */
+int writePNG(const char *path, const u16 *data, int w, int h) {
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_bytep *volatile rows = NULL;
+    u8 *volatile rgb = NULL;
+    volatile int failed = 1;
+    int y;
+    FILE *fp = fopen(path, "wb");
     if (fp == NULL) {
+        printf("Failed to open file for writing: %s\n", strerror(errno));
+        return 1;
+    }
+
+    png_ptr =
+        png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info_ptr = png_ptr == NULL ? NULL : png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) {
+        printf("Failed to allocate memory for image info struct.\n");
+        goto cleanup;
+    }
+    if (setjmp(png_jmpbuf(png_ptr)))
+        goto cleanup;
+
+    rgb = expandRows(data, w, h, 0);
+    rows = mallocs(h * sizeof(*rows));
+    for (y = 0; y < h; y++)
+        rows[y] = rgb + 3 * (size_t)w * y;
+    png_init_io(png_ptr, fp);
+    png_set_IHDR(png_ptr, info_ptr, w, h, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+    // Pixels are expanded as BGR, like everything else here
+    png_set_bgr(png_ptr);
+    png_write_image(png_ptr, rows);
+    png_write_end(png_ptr, NULL);
+    failed = 0;
+
+cleanup:
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    free(rows);
+    free(rgb);
+    if (fclose(fp) != 0 && !failed) {
+        printf("Failed to write %s: %s\n", path, strerror(errno));
+        failed = 1;
+    }
+    return failed;
+}
+#endif /* USE_PNG */
+
+/*
+ * Writes an image as PNG if path ends in .png and PNG support is enabled,
+ * otherwise as BMP.  Returns nonzero on failure.
+ */
+int writeImage(const char *path, const u16 *data, int w, int h) {
+#if USE_PNG
+    size_t len = strlen(path);
+    if (len > 4 && !strcmp(path + len - 4, ".png"))
+        return writePNG(path, data, w, h);
+#endif
+    return writeBitmap(path, data, w, h);
+}
+
+// Whether path names an fxi image, by its extension
+static int isFxi(const char *path) {
+    size_t len = strlen(path);
+    return len > 4 && !strcmp(path + len - 4, ".fxi");
+}
+
+// Whether path names raw 5-6-5 pixels, as convert565 writes them
+static int isRaw565(const char *path) {
+    size_t len = strlen(path);
+    return len > 4 && (!strcmp(path + len - 4, ".bin") ||
+                       !strcmp(path + len - 4, ".565"));
+}
+
+/*
+ * Decodes an fxi image file of size bytes to its width times height pixels
+ * at dst.  Direct color images decode straight into dst.  Returns nonzero
+ * if the file is not a valid fxi.
+ */
+static int decodeFxi(const u8 *file, size_t size, u16 *dst) {
+    u16 palette[256] = {0};
+    const Image *img;
+    unsigned y;
+
+    if (fxi_check(file, size)) {
+        printf("Invalid fxi image\n");
+        return 1;
+    }
+    if (!(file[3] & IMAGE_PALETTED))
+        return image_decode(file[3] & IMAGE_CODEC_MASK, dst,
+                            file + IMAGE_HEADER_SIZE,
+                            (size_t)(file[0] << 8 | file[1]) * file[2]);
+
+    img = image_load(file);
+    if (img == NULL) {
+        printf("Failed to allocate memory; aborting.\n");
+        exit(2);
+    }
+    // Indices aren't checked, so never look past the palette in the file
+    memcpy(palette, img->palette, 2 * (file[5] + 1));
+    for (y = 0; y < img->height; y++) {
+        palette_expand(dst + (size_t)img->width * y,
+                       img->indices + (size_t)img->stride * y, palette,
+                       img->bpp, img->width);
+    }
+    free((void *)img);
+    return 0;
+}
+
+/*
+ * In-place conversion of 5-6-5 pixels to 24 bpp, the reverse of
+ * convertBPP.  Grows the block at d to the right size.
+ */
+static u8 *expand565(int32_t w, int32_t h, u16 *d) {
+    u8 *out = realloc(d, 3 * (size_t)w * h + 1);
+    size_t pxi;
+
+    if (out == NULL) {
+        printf("Failed to allocate memory; aborting.\n");
+        exit(2);
+    }
+    // Backwards, so pixels are read before being overwritten
+    for (pxi = (size_t)w * h; pxi-- > 0;) {
+        u16 px = out[2 * pxi] << 8 | out[2 * pxi + 1];
+        out[3 * pxi] = (px & 0x1F) * 255 / 31;
+        out[3 * pxi + 1] = ((px >> 5) & 0x3F) * 255 / 63;
+        out[3 * pxi + 2] = (px >> 11) * 255 / 31;
+    }
+    return out;
+}
+
+/*
+ * Loads an image as big-endian 5-6-5 pixels, or as 24 bpp BGR if rgb is
+ * nonzero.
+ */
+static void *loadImage(const char *path, int32_t *width, int32_t *height,
+                       int rgb) {
+    void *imgData;
+    size_t size;
+    const u8 *file = mapFile(path, &size);
+    if (file == NULL) {
         printf("Unable to open image file: %s\n", strerror(errno));
         return NULL;
     }
 
 #if USE_PNG
     // Is this a PNG file?
-    fread(pngHeader, 1, 8, fp);
-    rewind(fp);
-    if (0 == png_sig_cmp(pngHeader, 0, 8)) {
+    if (size >= 8 && 0 == png_sig_cmp((png_bytep)file, 0, 8)) {
         // Yes, load it up
-        imgData = loadBitmap_PNG(fp, width, height);
-    } else {
-#endif /* USE_PNG */
-        if (!imgData) {
-            imgData = loadBitmap_BMP(fp, width, height);
+        u8 *pngData = NULL;
+        FILE *fp = fopen(path, "rb");
+        unmapFile(file, size);
+        if (fp == NULL) {
+            printf("Unable to open image file: %s\n", strerror(errno));
+            return NULL;
         }
-#if USE_PNG
+        pngData = loadBitmap_PNG(fp, width, height);
+        fclose(fp);
+        if (!pngData || rgb)
+            return pngData;
+        return convertBPP(*width, *height, pngData);
     }
 #endif /* USE_PNG */
 
-    fclose(fp);
-    if (!imgData)
+    if (isFxi(path) && size >= IMAGE_HEADER_SIZE) {
+        *width = file[0] << 8 | file[1];
+        *height = file[2];
+        imgData = mallocs(2 * (size_t)*width * *height + 1);
+        if (decodeFxi(file, size, imgData)) {
+            free(imgData);
+            imgData = NULL;
+        } else if (rgb) {
+            imgData = expand565(*width, *height, imgData);
+        }
+        unmapFile(file, size);
+        return imgData;
+    }
+
+    imgData = loadBitmap_BMP(file, size, width, height, rgb);
+    unmapFile(file, size);
+    return imgData;
+}
+
+u16 *loadBitmap(const char *path, int32_t *width, int32_t *height) {
+    u16 *imgData;
+
+    PROBE1(load_bitmap_entry, path);
+    imgData = loadImage(path, width, height, 0);
+    PROBE2(load_bitmap_return, path, imgData != NULL);
+    return imgData;
+}
+
+/*
+ * Loads an image as 24 bpp BGR, for processing before convertBPP.
+ */
+u8 *loadBitmapRGB(const char *path, int32_t *width, int32_t *height) {
+    return loadImage(path, width, height, 1);
+}
+
+/*
+ * Loads an image into dst, fitting it to exactly w x h pixels as described
+ * by mode.  Raw big-endian 5-6-5 pixels (as written by convert565), named
+ * .bin or .565 or else recognised by their size, are copied as they are,
+ * and BMP and fxi images of the right size are decoded straight into dst.  Anything else is converted, and
+ * resized if needed.  Returns nonzero on failure.
+ */
+int loadIconInto(const char *path, u16 *dst, int32_t w, int32_t h,
+                 enum resize_mode mode) {
+    struct bmp_header bh;
+    struct dib_header dh;
+    int32_t sw, sh;
+    u8 *src, *resized;
+    u16 *pixels;
+    size_t size;
+    const u8 *file = mapFile(path, &size);
+    if (file == NULL) {
+        printf("Unable to open image file: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (isFxi(path) && size >= IMAGE_HEADER_SIZE &&
+        (file[0] << 8 | file[1]) == w && file[2] == h) {
+        int failed = decodeFxi(file, size, dst);
+        unmapFile(file, size);
+        return failed;
+    }
+    // Anything else of exactly the right size that is not a BMP or PNG is
+    // taken to be raw pixels too
+    if (isRaw565(path) ||
+        (size == 2 * (size_t)w * h && size >= 4 && !isFxi(path) &&
+         memcmp(file, "BM", 2) != 0 && memcmp(file, "\x89PNG", 4) != 0)) {
+        if (size != 2 * (size_t)w * h) {
+            printf("Raw icon is %lu bytes, not %dx%d 5-6-5 pixels\n",
+                   (unsigned long)size, (int)w, (int)h);
+            unmapFile(file, size);
+            return 1;
+        }
+        memcpy(dst, file, size);
+        unmapFile(file, size);
+        return 0;
+    }
+    if (size >= 2 && !memcmp(file, "BM", 2)) {
+        // Already the right size: straight from the mapping into dst
+        if (!readBMPHeader(&bh, &dh, file, size) && dh.width == w &&
+            (dh.height == h || dh.height == -h)) {
+            int failed = readBMPData(&bh, &dh, file, size, dst);
+            if (failed)
+                printf("Error reading image: %s\n", bmperror);
+            unmapFile(file, size);
+            return failed;
+        }
+        src = loadBitmap_BMP(file, size, &sw, &sh, 1);
+        unmapFile(file, size);
+    } else {
+        unmapFile(file, size);
+        src = loadBitmapRGB(path, &sw, &sh);
+    }
+    if (src == NULL)
+        return 1;
+    if (sw != w || sh != h) {
+        resized = mallocs(3 * (size_t)w * h);
+        resizeRGB(src, sw, sh, resized, w, h, mode);
+        free(src);
+        src = resized;
+    }
+    pixels = convertBPP(w, h, src);
+    memcpy(dst, pixels, 2 * (size_t)w * h);
+    free(pixels);
+    return 0;
+}
+
+/*
+ * Like loadIconInto, but returns a newly allocated block of pixels.
+ */
+u16 *loadIcon(const char *path, int32_t w, int32_t h, enum resize_mode mode) {
+    u16 *pixels = mallocs(2 * (size_t)w * h);
+    if (loadIconInto(path, pixels, w, h, mode)) {
+        free(pixels);
         return NULL;
-    return convertBPP(*width, *height, imgData);
+    }
+    return pixels;
+}
+
+/*
+ * Resampling
+ *
+ * Scaling is separable: rows are filtered horizontally into an intermediate
+ * image, then output rows are accumulated from whole intermediate rows with
+ * one weight each so the inner loops run over contiguous integers.  Weights
+ * are Lanczos-3 (widened when downscaling, so it also acts as an area
+ * filter) in RESAMPLE_BITS fixed point.
+ */
+#define RESAMPLE_BITS 14
+#define RESAMPLE_ONE (1 << RESAMPLE_BITS)
+// Fraction bits kept in the intermediate image
+#define RESAMPLE_MID_BITS 7
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct resample_axis {
+    int32_t *first; // First source sample for each output sample
+    int32_t *count; // Number of taps for each output sample
+    int32_t *weights; // taps weights per output sample
+    int32_t taps;
+};
+
+static double lanczos3(double x) {
+    if (x < 0)
+        x = -x;
+    if (x < 1e-8)
+        return 1;
+    if (x >= 3)
+        return 0;
+    return 3 * sin(M_PI * x) * sin(M_PI * x / 3) / (M_PI * M_PI * x * x);
+}
+
+/*
+ * Computes weights for mapping the source span [start, start + len) of an
+ * axis n samples long onto out samples.  Taps past either edge are folded
+ * onto the edge sample.
+ */
+static void resampleAxis_init(struct resample_axis *a, int32_t n,
+                              double start, double len, int32_t out) {
+    double scale = len / out;
+    double support = 3 * (scale > 1 ? scale : 1);
+    double inv = scale > 1 ? 1 / scale : 1;
+    int32_t i, j;
+    double *fw;
+
+    a->taps = (int32_t)ceil(2 * support) + 2;
+    a->first = mallocs(out * sizeof(*a->first));
+    a->count = mallocs(out * sizeof(*a->count));
+    a->weights = callocs(out * a->taps, sizeof(*a->weights));
+    fw = mallocs(a->taps * sizeof(*fw));
+
+    for (i = 0; i < out; i++) {
+        double center = start + (i + 0.5) * scale;
+        int32_t lo = (int32_t)floor(center - support);
+        int32_t hi = (int32_t)ceil(center + support);
+        int32_t first = lo < 0 ? 0 : lo;
+        int32_t last = hi > n - 1 ? n - 1 : hi;
+        int32_t *w = a->weights + i * a->taps;
+        double total = 0;
+        int32_t sum = 0, biggest = 0;
+
+        if (last < first)
+            first = last = (center < 0 ? 0 : n - 1);
+        if (last - first + 1 > a->taps)
+            last = first + a->taps - 1;
+        for (j = 0; j <= last - first; j++)
+            fw[j] = 0;
+        for (j = lo; j <= hi; j++) {
+            double v = lanczos3((j + 0.5 - center) * inv);
+            int32_t k = j < first ? first : j > last ? last : j;
+            fw[k - first] += v;
+            total += v;
+        }
+        if (total == 0)
+            total = 1;
+        for (j = 0; j <= last - first; j++) {
+            w[j] = (int32_t)floor(fw[j] / total * RESAMPLE_ONE + 0.5);
+            sum += w[j];
+            if (w[j] > w[biggest])
+                biggest = j;
+        }
+        // Make the weights sum to exactly one
+        w[biggest] += RESAMPLE_ONE - sum;
+        a->first[i] = first;
+        a->count[i] = last - first + 1;
+    }
+    free(fw);
+}
+
+static void resampleAxis_free(struct resample_axis *a) {
+    free(a->first);
+    free(a->count);
+    free(a->weights);
+}
+
+static u8 clampChannel(int32_t v) { return v < 0 ? 0 : v > 255 ? 255 : v; }
+
+/*
+ * Scales the source rectangle at (x0, y0), rw x rh pixels, of the sw x sh
+ * 24 bpp image src into tw x th pixels at dst, whose rows are dstride
+ * bytes apart.
+ */
+static void resampleRGB(const u8 *src, int32_t sw, int32_t sh, double x0,
+                        double y0, double rw, double rh, u8 *dst,
+                        size_t dstride, int32_t tw, int32_t th) {
+    struct resample_axis ax, ay;
+    int32_t *mid, *acc;
+    int32_t x, y, i, t, c;
+    size_t mw = 3 * (size_t)tw;
+
+    resampleAxis_init(&ax, sw, x0, rw, tw);
+    resampleAxis_init(&ay, sh, y0, rh, th);
+    mid = mallocs(mw * sh * sizeof(*mid));
+    acc = mallocs(mw * sizeof(*acc));
+
+    // Horizontal pass, keeping RESAMPLE_MID_BITS of fraction
+    for (y = 0; y < sh; y++) {
+        const u8 *row = src + 3 * (size_t)sw * y;
+        int32_t *out = mid + mw * y;
+        for (i = 0; i < tw; i++) {
+            const int32_t *w = ax.weights + i * ax.taps;
+            const u8 *p = row + 3 * ax.first[i];
+            int32_t sum[3] = {0, 0, 0};
+            for (t = 0; t < ax.count[i]; t++, p += 3) {
+                sum[0] += w[t] * p[0];
+                sum[1] += w[t] * p[1];
+                sum[2] += w[t] * p[2];
+            }
+            for (c = 0; c < 3; c++)
+                out[3 * i + c] = sum[c] >>
+                                 (RESAMPLE_BITS - RESAMPLE_MID_BITS);
+        }
+    }
+
+    // Vertical pass over whole rows
+    for (y = 0; y < th; y++) {
+        const int32_t *w = ay.weights + y * ay.taps;
+        u8 *out = dst + dstride * y;
+        memset(acc, 0, mw * sizeof(*acc));
+        for (t = 0; t < ay.count[y]; t++) {
+            const int32_t *row = mid + mw * (ay.first[y] + t);
+            int32_t wt = w[t];
+            for (x = 0; x < (int32_t)mw; x++)
+                acc[x] += wt * row[x];
+        }
+        for (x = 0; x < (int32_t)mw; x++) {
+            int32_t v = acc[x] + (1 << (RESAMPLE_BITS + RESAMPLE_MID_BITS - 1));
+            out[x] = clampChannel(v >> (RESAMPLE_BITS + RESAMPLE_MID_BITS));
+        }
+    }
+
+    free(mid);
+    free(acc);
+    resampleAxis_free(&ax);
+    resampleAxis_free(&ay);
+}
+
+/*
+ * Fits the sw x sh 24 bpp image src to the dw x dh image dst:
+ *  - RESIZE_FIT scales the whole image to fit, centered, filling the border
+ *    with the color of src's top left pixel
+ *  - RESIZE_FILL scales the image to cover dst, cropping the overflow evenly
+ *  - RESIZE_CROP takes the middle of the image at its original scale,
+ *    bordered as for RESIZE_FIT if it is smaller
+ */
+void resizeRGB(const u8 *src, int32_t sw, int32_t sh, u8 *dst, int32_t dw,
+               int32_t dh, enum resize_mode mode) {
+    double sx = (double)dw / sw, sy = (double)dh / sh;
+    int32_t tw, th, x, y;
+
+    if (mode == RESIZE_FILL) {
+        double scale = sx > sy ? sx : sy;
+        double rw = dw / scale, rh = dh / scale;
+        resampleRGB(src, sw, sh, (sw - rw) / 2, (sh - rh) / 2, rw, rh, dst,
+                    3 * (size_t)dw, dw, dh);
+        return;
+    }
+
+    for (y = 0; y < dh; y++) {
+        for (x = 0; x < dw; x++)
+            memcpy(dst + 3 * ((size_t)dw * y + x), src, 3);
+    }
+    if (mode == RESIZE_FIT) {
+        double scale = sx < sy ? sx : sy;
+        tw = (int32_t)floor(sw * scale + 0.5);
+        th = (int32_t)floor(sh * scale + 0.5);
+        tw = tw < 1 ? 1 : tw > dw ? dw : tw;
+        th = th < 1 ? 1 : th > dh ? dh : th;
+        resampleRGB(src, sw, sh, 0, 0, sw, sh,
+                    dst + 3 * ((size_t)dw * ((dh - th) / 2) + (dw - tw) / 2),
+                    3 * (size_t)dw, tw, th);
+    } else {
+        int32_t ox = (sw - dw) / 2, oy = (sh - dh) / 2;
+        for (y = 0; y < dh; y++) {
+            if (y + oy < 0 || y + oy >= sh)
+                continue;
+            for (x = 0; x < dw; x++) {
+                if (x + ox < 0 || x + ox >= sw)
+                    continue;
+                memcpy(dst + 3 * ((size_t)dw * y + x),
+                       src + 3 * ((size_t)sw * (y + oy) + x + ox), 3);
+            }
+        }
+    }
+}
+
+/*
+ * Parses a resize mode name, returning nonzero if it is not recognized.
+ */
+int parseResizeMode(const char *name, enum resize_mode *mode) {
+    if (!strcmp(name, "fit"))
+        *mode = RESIZE_FIT;
+    else if (!strcmp(name, "fill"))
+        *mode = RESIZE_FILL;
+    else if (!strcmp(name, "crop"))
+        *mode = RESIZE_CROP;
+    else
+        return 1;
+    return 0;
 }
@@ -27,11 +27,35 @@ struct dib_header {
 };
 #pragma pack()
 
+/* dib_header compress_type values understood by readBMPData */
+#define BMP_BI_RGB 0
+#define BMP_BI_BITFIELDS 3
+
+/* How loadIcon and resizeRGB fit an image to a different size */
+enum resize_mode { RESIZE_FIT, RESIZE_FILL, RESIZE_CROP };
+
 u16 *loadBitmap(const char *path, int32_t *width, int32_t *height);
-int readBMPHeader(struct bmp_header *bh, struct dib_header *dh, FILE *fp);
-int readBMPData(struct dib_header *bh, u8 *d, FILE *fp);
+u8 *loadBitmapRGB(const char *path, int32_t *width, int32_t *height);
+u16 *loadIcon(const char *path, int32_t w, int32_t h, enum resize_mode mode);
+int loadIconInto(const char *path, u16 *dst, int32_t w, int32_t h,
+                 enum resize_mode mode);
+void resizeRGB(const u8 *src, int32_t sw, int32_t sh, u8 *dst, int32_t dw,
+               int32_t dh, enum resize_mode mode);
+int parseResizeMode(const char *name, enum resize_mode *mode);
+int readBMPHeader(struct bmp_header *bh, struct dib_header *dh, const u8 *file,
+                  size_t size);
+int readBMPData(const struct bmp_header *bh, const struct dib_header *dh,
+                const u8 *file, size_t size, u16 *out);
+int readBMPDataRGB(const struct bmp_header *bh, const struct dib_header *dh,
+                   const u8 *file, size_t size, u8 *out);
 u8 convertChannelDepth(u8 c, u8 cd, u8 dd);
 u16 *convertBPP(int32_t w, int32_t h, u8 *d);
-void writeBitmap(const char *path, u16 *data, int w, int h);
+void convertMono(const u16 *src, int32_t w, int32_t h, u8 *dst, int32_t dw,
+                 int32_t dh);
+int writeBitmap(const char *path, const u16 *data, int w, int h);
+#if USE_PNG
+int writePNG(const char *path, const u16 *data, int w, int h);
+#endif
+int writeImage(const char *path, const u16 *data, int w, int h);
 
 #endif // _IMAGES_H
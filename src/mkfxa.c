@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#else
+#include "getopt.h"
+#endif /* HAVE_UNISTD_H */
+
+#include "fxi.h"
+#include "images.h"
+#include "util.h"
+
+static void usage(void) {
+    printf("Usage: mkfxa [-k interval] [-c auto|raw|rle|lzf] [-s weight] "
+           "[-d weight]\n"
+           "             <frame>... <output.fxa>\n");
+    printf("\nCombines same-sized images into an fx-imglib fxa animation.\n"
+           "Frames are stored as the rectangles that changed from the one\n"
+           "before, with a full keyframe at least every interval frames\n"
+           "(30 by default) so seeking stays fast.  Codecs are chosen as by\n"
+           "mkfxi.\n");
+}
+
+int main(int argc, char **argv) {
+    struct fxi_weights weights = {1.0, 1.0};
+    int c, codec = FXI_CODEC_AUTO, keyInterval = 30, keyframes;
+    int nframes, f;
+    int32_t width = 0, height = 0;
+    u16 **frames;
+    size_t size;
+    u8 *fxa;
+    FILE *fp;
+
+    while ((c = getopt(argc, argv, "k:c:s:d:h")) != -1) {
+        switch (c) {
+        case 'k':
+            keyInterval = atoi(optarg);
+            break;
+        case 'c':
+            if (fxi_parseCodec(optarg, &codec)) {
+                printf("Unknown codec: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            weights.size = atof(optarg);
+            break;
+        case 'd':
+            weights.cost = atof(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    nframes = argc - optind - 1;
+    if (nframes < 1 || keyInterval < 1) {
+        usage();
+        return 1;
+    }
+    if (nframes > FXI_MAX_FRAMES) {
+        printf("Too many frames: at most %d are allowed\n", FXI_MAX_FRAMES);
+        return 1;
+    }
+
+    frames = mallocs(nframes * sizeof(*frames));
+    for (f = 0; f < nframes; f++) {
+        const char *path = argv[optind + f];
+        int32_t w, h;
+        frames[f] = loadBitmap(path, &w, &h);
+        if (frames[f] == NULL) {
+            printf("Failed to load image %s\n", path);
+            return 1;
+        }
+        if (f == 0) {
+            width = w;
+            height = h;
+        } else if (w != width || h != height) {
+            printf("%s is %ix%i, but the first frame is %ix%i\n", path, w, h,
+                   width, height);
+            return 1;
+        }
+    }
+    if (width > FXI_MAX_WIDTH || height > FXI_MAX_HEIGHT) {
+        printf("Frames are too large: fxa animations are at most %dx%d\n",
+               FXI_MAX_WIDTH, FXI_MAX_HEIGHT);
+        return 1;
+    }
+
+    fxa = fxi_encodeAnimation((const u16 *const *)frames, nframes, width,
+                              height, codec, keyInterval, &weights, &size,
+                              &keyframes);
+    fp = fopen(argv[argc - 1], "wb");
+    if (fp == NULL || fwrite(fxa, 1, size, fp) != size || fclose(fp)) {
+        perror("Failed to write output file");
+        return 1;
+    }
+    printf("%s: %ix%i, %i frames (%i keyframes), %zu bytes\n",
+           argv[argc - 1], width, height, nframes, keyframes, size);
+    free(fxa);
+    for (f = 0; f < nframes; f++)
+        free(frames[f]);
+    free(frames);
+    return 0;
+}
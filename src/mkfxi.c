@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#else
+#include "getopt.h"
+#endif /* HAVE_UNISTD_H */
+
+#include "fxi.h"
+#include "image.h"
+#include "images.h"
+
+static void usage(void) {
+    printf("Usage: mkfxi [-P] [-c auto|raw|rle|lzf] [-s weight] [-d weight] "
+           "<image>\n"
+           "             <output.fxi>\n");
+    printf("\nConverts image to an fx-imglib fxi image.  Unless a codec is\n"
+           "given with -c, each is tried and the one with the lowest\n"
+           "size^s * decode cycles^d is kept; -s and -d default to 1.\n"
+           "Images of up to 256 colors are stored as palette indices unless\n"
+           "-P is given.\n");
+}
+
+int main(int argc, char **argv) {
+    struct fxi_weights weights = {1.0, 1.0};
+    int c, codec = FXI_CODEC_AUTO, allowPalette = 1;
+    int32_t width, height;
+    size_t size;
+    u16 *pixels;
+    u8 *fxi;
+    FILE *fp;
+
+    while ((c = getopt(argc, argv, "Pc:s:d:h")) != -1) {
+        switch (c) {
+        case 'P':
+            allowPalette = 0;
+            break;
+        case 'c':
+            if (fxi_parseCodec(optarg, &codec)) {
+                printf("Unknown codec: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            weights.size = atof(optarg);
+            break;
+        case 'd':
+            weights.cost = atof(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        usage();
+        return 1;
+    }
+
+    pixels = loadBitmap(argv[optind], &width, &height);
+    if (pixels == NULL) {
+        printf("Failed to load image %s\n", argv[optind]);
+        return 1;
+    }
+    if (width > FXI_MAX_WIDTH || height > FXI_MAX_HEIGHT) {
+        printf("%s is too large: fxi images are at most %dx%d\n",
+               argv[optind], FXI_MAX_WIDTH, FXI_MAX_HEIGHT);
+        return 1;
+    }
+
+    fxi = fxi_encode(pixels, width, height, codec, allowPalette, &weights,
+                     &size);
+    fp = fopen(argv[optind + 1], "wb");
+    if (fp == NULL || fwrite(fxi, 1, size, fp) != size || fclose(fp)) {
+        perror("Failed to write output file");
+        return 1;
+    }
+    printf("%s: %ix%i, %s, ", argv[optind + 1], width, height,
+           fxi_codecName(fxi[3] & IMAGE_CODEC_MASK));
+    if (fxi[3] & IMAGE_PALETTED)
+        printf("%i colors at %i bpp, ", fxi[5] + 1, fxi[4]);
+    printf("%zu bytes\n", size);
+    free(fxi);
+    free(pixels);
+    return 0;
+}
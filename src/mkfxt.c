@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#else
+#include "getopt.h"
+#endif /* HAVE_UNISTD_H */
+
+#include "fxi.h"
+#include "image.h"
+#include "images.h"
+
+static void usage(void) {
+    printf("Usage: mkfxt [-P] [-c auto|raw|rle|lzf] [-s weight] [-d weight] "
+           "<output.fxt>\n"
+           "             <image>...\n");
+    printf("\nPacks images into a single fx-imglib atlas, an fxi image with\n"
+           "an index of where each one is.  Images are named by their file\n"
+           "name without directory or extension.  The codec is chosen as\n"
+           "by mkfxi, and -P likewise disables palettes.\n");
+}
+
+// File name without directory or extension
+static char *spriteName(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *name = strdup(slash != NULL ? slash + 1 : path);
+    char *dot = strrchr(name, '.');
+
+    if (dot != NULL && dot != name)
+        *dot = 0;
+    return name;
+}
+
+int main(int argc, char **argv) {
+    struct fxi_weights weights = {1.0, 1.0};
+    int c, i, j, codec = FXI_CODEC_AUTO, allowPalette = 1, nsprites;
+    struct fxi_sprite *sprites;
+    size_t size, area = 0;
+    u8 *fxt, *image;
+    FILE *fp;
+
+    while ((c = getopt(argc, argv, "Pc:s:d:h")) != -1) {
+        switch (c) {
+        case 'P':
+            allowPalette = 0;
+            break;
+        case 'c':
+            if (fxi_parseCodec(optarg, &codec)) {
+                printf("Unknown codec: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            weights.size = atof(optarg);
+            break;
+        case 'd':
+            weights.cost = atof(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage();
+        return 1;
+    }
+
+    nsprites = argc - optind - 1;
+    sprites = calloc(nsprites, sizeof(*sprites));
+    if (sprites == NULL) {
+        printf("Failed to allocate memory; aborting.\n");
+        return 2;
+    }
+    for (i = 0; i < nsprites; i++) {
+        const char *path = argv[optind + 1 + i];
+        struct fxi_sprite *s = &sprites[i];
+
+        s->pixels = loadBitmap(path, &s->width, &s->height);
+        if (s->pixels == NULL) {
+            printf("Failed to load image %s\n", path);
+            return 1;
+        }
+        if (s->height > FXI_MAX_HEIGHT) {
+            printf("%s is too tall: fxi images are at most %d rows\n", path,
+                   FXI_MAX_HEIGHT);
+            return 1;
+        }
+        s->name = spriteName(path);
+        for (j = 0; j < i; j++) {
+            if (!strcmp(sprites[j].name, s->name)) {
+                printf("More than one image is named %s\n", s->name);
+                return 1;
+            }
+        }
+        area += (size_t)s->width * s->height;
+    }
+
+    fxt = fxi_encodeAtlas(sprites, nsprites, codec, allowPalette, &weights,
+                          &size);
+    if (fxt == NULL) {
+        printf("These images do not fit in one atlas\n");
+        return 1;
+    }
+    fp = fopen(argv[optind], "wb");
+    if (fp == NULL || fwrite(fxt, 1, size, fp) != size || fclose(fp)) {
+        perror("Failed to write output file");
+        return 1;
+    }
+
+    for (i = 0, j = 0; i < nsprites; i++)
+        j += strlen(sprites[i].name) + 1;
+    image = fxt + ATLAS_HEADER_SIZE + ATLAS_ENTRY_SIZE * nsprites + j;
+    printf("%s: %d images in %ix%i (%.0f%% used), %s, ", argv[optind],
+           nsprites, image[0] << 8 | image[1], image[2],
+           100.0 * area / ((image[0] << 8 | image[1]) * image[2]),
+           fxi_codecName(image[3] & IMAGE_CODEC_MASK));
+    if (image[3] & IMAGE_PALETTED)
+        printf("%i colors at %i bpp, ", image[5] + 1, image[4]);
+    printf("%zu bytes\n", size);
+
+    free(fxt);
+    for (i = 0; i < nsprites; i++) {
+        free((void *)sprites[i].pixels);
+        free((void *)sprites[i].name);
+    }
+    free(sprites);
+    return 0;
+}
@@ -1,33 +1,67 @@
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+#include "config.h"
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #else
 #include "getopt.h"
 #endif /* HAS_UNISTD_H */
+#ifdef HAVE_SYS_INOTIFY_H
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 
-#include "config.h"
 #include "g3a.h"
 #include "images.h"
+#include "util.h"
 
 char *USAGE =
-    "\nUsage: mkg3a [OPTION] input-file [output-file]\n\n"
-    "  -i (uns|sel):file\n"
-    "     Load unselected/selected icon from file\n"
+    "\nUsage: mkg3a [OPTION] input-file [output-file]\n"
+    "       mkg3a -H header [-R name:file]...\n\n"
+    "  -i (uns|sel|mono):file\n"
+    "     Load unselected/selected/monochrome icon from file\n"
     "  -n lc:name\n"
     "     Set localized name for language code\n"
+    "  -r (fit|fill|crop)\n"
+    "     Fit icons of other sizes by scaling them whole, scaling and\n"
+    "     cropping, or only cropping.  Applies to later -i options.\n"
     "  -V ver\n"
     "     Set version string\n"
+    "  -t file\n"
+    "     Also save the finished header as a template for -T\n"
+    "  -T file\n"
+    "     Take names, icons and version from a header template\n"
+    "  -J file\n"
+    "     Take names, icons, version, timestamp and file name from metadata\n"
+    "     written by g3a-extract, to rebuild exactly the file it came from\n"
+    "  -R name:file\n"
+    "     Pack file after the program as resource name\n"
+    "  -a align\n"
+    "     Align later -R resources to align bytes (default 4)\n"
+    "  -H file\n"
+    "     Write a C header for finding the resources at run time.  With no\n"
+    "     input file, only write the header.\n"
+    "  -M file\n"
+    "     Write a make-compatible list of the input files to file\n"
+    "  -u\n"
+    "     Update an existing output file in place, writing only the blocks\n"
+    "     that changed, instead of replacing it\n"
+    "  -w\n"
+    "     Keep running, rebuilding whenever the input, icons, template or\n"
+    "     resources change\n"
     "  -v\n"
     "     Show version and license information then exit\n"
     "\nValid values for lc are basic, internal, en, es, de, fr, pt and zh.\n"
     "Empty lc is an alias for basic.  Unset names will be derived from\n"
     "basic, which defaults to output file name.\n"
     "\nMultiple -n or -i options will all be applied, with the last\n"
-    "specified option overriding previous ones with the same key.";
+    "specified option overriding previous ones with the same key.\n"
+    "The monochrome icon is derived from the unselected icon unless given.";
 char *VERSION =
     "mkg3a " mkg3a_VERSION_TAG " (" __DATE__ " " __TIME__ ")\n"
     "Copyright (c) 2011 Peter Marheine <peter@taricorp.net>\n"
@@ -36,6 +70,59 @@ char *VERSION =
     "damages arising from the use of this software.\n"
     "\nSee http://www.taricorp.net/projects/mkg3a/ for updates.";
 
+/*
+ * Input files read while building, for the dependency file (-M).
+ */
+static char **deps;
+static int ndeps;
+
+static void addDependency(char *path) {
+    deps = realloc(deps, (ndeps + 1) * sizeof(*deps));
+    if (deps == NULL) {
+        printf("Failed to allocate memory; aborting.\n");
+        exit(2);
+    }
+    deps[ndeps++] = path;
+}
+
+// Escapes characters make would otherwise interpret in a file name
+static void writeDepName(FILE *fp, const char *name) {
+    for (; *name; name++) {
+        if (*name == ' ' || *name == '#')
+            fputc('\\', fp);
+        else if (*name == '$')
+            fputc('$', fp);
+        fputc(*name, fp);
+    }
+}
+
+/*
+ * Writes a make rule listing input and then every other file read as
+ * prerequisites of target.  Returns nonzero on failure.
+ */
+int writeDepFile(const char *path, const char *target, const char *input) {
+    int i;
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Unable to open dependency file: %s\n", strerror(errno));
+        return 1;
+    }
+
+    writeDepName(fp, target);
+    fputs(": ", fp);
+    writeDepName(fp, input);
+    for (i = 0; i < ndeps; i++) {
+        fputs(" \\\n  ", fp);
+        writeDepName(fp, deps[i]);
+    }
+    fputc('\n', fp);
+    if (fclose(fp) != 0) {
+        printf("Failed to write dependency file: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
 /*
  * Sets the name in names corresponding to opt, where opt is of the form
  * code:value.
@@ -68,35 +155,343 @@ int storeNameSpec(char *k, char *v, void *dest) {
     return 0;
 }
 
+/*
+ * Icon files given with -i, kept so watch mode can load them again.  The
+ * monochrome icon is derived from the unselected one if it has no file.
+ */
+enum icon_slot { ICON_UNS, ICON_SEL, ICON_MONO, ICON_SLOTS };
+static struct icon_source {
+    char *path;
+    enum resize_mode mode;
+} iconSources[ICON_SLOTS];
+static enum resize_mode resizeMode = RESIZE_FIT;
+
+/*
+ * Loads the icon in slot from its file into icons, leaving icons unchanged
+ * on failure.  Returns nonzero on failure.
+ */
+static int loadIconSlot(struct icons *icons, enum icon_slot slot) {
+    static u16 idat[G3A_ICON_WIDTH * G3A_ICON_HEIGHT];
+    const struct icon_source *src = &iconSources[slot];
+    int32_t width, height;
+    u16 *mdat;
+
+    if (slot == ICON_MONO) {
+        // Any size will do, it gets scaled down
+        mdat = loadBitmap(src->path, &width, &height);
+        if (mdat == NULL)
+            return 1;
+        convertMono(mdat, width, height, icons->mono, G3A_ICON_MONO_WIDTH,
+                    G3A_ICON_MONO_HEIGHT);
+        free(mdat);
+        return 0;
+    }
+    if (loadIconInto(src->path, idat, G3A_ICON_WIDTH, G3A_ICON_HEIGHT,
+                     src->mode))
+        return 1;
+    memcpy(slot == ICON_UNS ? icons->unselected : icons->selected, idat,
+           sizeof(idat));
+    return 0;
+}
+
+// Derives the monochrome icon from the unselected one
+static void deriveMonoIcon(struct icons *icons) {
+    convertMono(icons->unselected, G3A_ICON_WIDTH, G3A_ICON_HEIGHT,
+                icons->mono, G3A_ICON_MONO_WIDTH, G3A_ICON_MONO_HEIGHT);
+}
+
 int storeIconSpec(char *k, char *v, void *dest) {
     struct icons *icons = (struct icons *)dest;
-    int32_t width, height;
-    u16 *idat;
-    void *cd;
+    struct icon_source old;
+    enum icon_slot slot;
 
     if (!strcmp(k, "uns")) {
-        cd = icons->unselected;
+        slot = ICON_UNS;
     } else if (!strcmp(k, "sel")) {
-        cd = icons->selected;
+        slot = ICON_SEL;
+    } else if (!strcmp(k, "mono")) {
+        slot = ICON_MONO;
     } else {
         return 1;
     }
 
-    idat = loadBitmap(v, &width, &height);
-    if (idat == NULL)
+    old = iconSources[slot];
+    iconSources[slot].path = v;
+    iconSources[slot].mode = resizeMode;
+    if (loadIconSlot(icons, slot)) {
+        iconSources[slot] = old;
+        return 1;
+    }
+    addDependency(v);
+    return 0;
+}
+
+/*
+ * Resolves file, named in the metadata file at meta, relative to the
+ * directory meta is in.
+ */
+static char *metaFilePath(const char *meta, const char *file) {
+    const char *slash = strrchr(meta, '/');
+    char *path;
+
+    if (file[0] == '/' || slash == NULL)
+        return strdup(file);
+    path = mallocs(slash - meta + strlen(file) + 2);
+    sprintf(path, "%.*s/%s", (int)(slash - meta), meta, file);
+    return path;
+}
+
+/*
+ * Takes names, version and icons from the metadata file at path into names,
+ * version and icons, as if given with -n, -V and -i.  The timestamp and file
+ * name are left in meta for the caller to pin.  Returns nonzero on failure.
+ */
+static int loadMeta(const char *path, struct g3a_meta *meta,
+                    struct lc_names *names, char **version,
+                    struct icons *icons) {
+    static const char *const slots[META_ICONS] = {"uns", "sel", "mono"};
+    int i;
+
+    if (g3a_readMeta(path, meta))
         return 1;
-    if (width != G3A_ICON_WIDTH || height != G3A_ICON_HEIGHT) {
-        fprintf(stderr, "Dimensions of %s are invalid,", v);
-        fprintf(stderr, " icons must be %ix%i pixels.\n", G3A_ICON_WIDTH,
-                G3A_ICON_HEIGHT);
+    addDependency((char *)path);
+    *names = meta->names;
+    memset(&meta->names, 0, sizeof(meta->names));
+    if (meta->version != NULL)
+        *version = meta->version;
+    for (i = 0; i < META_ICONS; i++) {
+        if (meta->icons[i] == NULL)
+            continue;
+        if (storeIconSpec((char *)slots[i], metaFilePath(path, meta->icons[i]),
+                          icons)) {
+            printf("Failed to load the %s icon named in %s\n", slots[i],
+                   path);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Resources given with -R, and the alignment for the next one.
+ */
+static struct g3a_resource *resources;
+static int nresources;
+static u32 resourceAlign = 4;
+static int buildFlags;
+
+int storeResourceSpec(char *k, char *v, void *dest) {
+    int i;
+    (void)dest;
+
+    // Names become macros in the resource header
+    if (!isalpha((u8)k[0]) && k[0] != '_') {
+        printf("Resource names must be C identifiers: %s\n", k);
+        return 1;
+    }
+    for (i = 0; k[i]; i++) {
+        if (!isalnum((u8)k[i]) && k[i] != '_') {
+            printf("Resource names must be C identifiers: %s\n", k);
+            return 1;
+        }
+    }
+    for (i = 0; i < nresources; i++) {
+        if (!strcmp(resources[i].name, k)) {
+            printf("More than one resource is named %s\n", k);
+            return 1;
+        }
+    }
+    resources = realloc(resources, (nresources + 1) * sizeof(*resources));
+    if (resources == NULL) {
+        printf("Failed to allocate memory; aborting.\n");
+        exit(2);
+    }
+    resources[nresources].name = strdup(k);
+    resources[nresources].path = v;
+    resources[nresources++].align = resourceAlign;
+    addDependency(v);
+    return 0;
+}
+
+/*
+ * What a failed build leaves in the output file.
+ */
+static const char *failedOutput(void) {
+    return buildFlags & G3A_UPDATE_IN_PLACE
+               ? "Output file may be partly updated."
+               : "Output file left unchanged.";
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Milliseconds without further changes before rebuilding */
+#define WATCH_DEBOUNCE_MS 100
+
+/*
+ * A file watched for changes.  Linkers and editors often replace files
+ * rather than writing them in place, so the directory holding each one is
+ * watched and events are matched by name.
+ */
+struct watched_file {
+    const char *path;
+    char *dir;
+    const char *name;
+    int wd;
+    int changed;
+};
+
+static int watchFile(int fd, struct watched_file *w, const char *path) {
+    char *slash;
+
+    w->path = path;
+    w->dir = strdup(path);
+    w->changed = 0;
+    slash = strrchr(w->dir, '/');
+    if (slash == NULL) {
+        w->name = path;
+        strcpy(w->dir, ".");
+    } else {
+        w->name = path + (slash - w->dir) + 1;
+        if (slash == w->dir)
+            slash[1] = 0;
+        else
+            *slash = 0;
+    }
+    w->wd = inotify_add_watch(fd, w->dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (w->wd < 0) {
+        printf("Unable to watch %s: %s\n", w->dir, strerror(errno));
         return 1;
     }
-    memcpy(cd, idat, sizeof(icons->unselected));
-    free(idat);
-    free(v);
     return 0;
 }
 
+/*
+ * Reads the pending events from fd, marking the files in watched that they
+ * concern.  Returns nonzero if any of them did.
+ */
+static int readEvents(int fd, struct watched_file *watched, int nwatched) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+    int i, hit = 0;
+
+    len = read(fd, buf, sizeof(buf));
+    for (p = buf; len > 0 && p < buf + len; p += sizeof(*ev) + ev->len) {
+        ev = (const struct inotify_event *)p;
+        if (ev->len == 0)
+            continue;
+        for (i = 0; i < nwatched; i++) {
+            if (watched[i].wd == ev->wd && !strcmp(watched[i].name, ev->name)) {
+                watched[i].changed = 1;
+                hit = 1;
+            }
+        }
+    }
+    return hit;
+}
+
+/*
+ * Rebuilds outFN from inFN whenever the input, an icon or the template
+ * changes, once changes have stopped for WATCH_DEBOUNCE_MS.  The header is
+ * kept between builds and only the icons that changed are loaded again, so
+ * a rebuild after relinking costs about one pass over the code.  Runs until
+ * interrupted and returns nonzero only on error.
+ */
+static int watchAndBuild(const char *inFN, const char *outFN,
+                         struct g3a_header *header, u32 fixedSum,
+                         struct icons *icons, const char *templateIn,
+                         const char *templateOut) {
+    struct watched_file *watched, *input, *tmpl = NULL;
+    struct watched_file *iconFiles[ICON_SLOTS] = {NULL};
+    struct pollfd pfd;
+    int i, nwatched = 0, pending = 0, ready, headerChanged;
+    struct g3a_header *newHeader;
+
+    pfd.fd = inotify_init1(IN_CLOEXEC);
+    pfd.events = POLLIN;
+    if (pfd.fd < 0) {
+        printf("Unable to watch for changes: %s\n", strerror(errno));
+        return 1;
+    }
+    watched = mallocs((2 + ICON_SLOTS + nresources) * sizeof(*watched));
+    input = &watched[nwatched++];
+    if (watchFile(pfd.fd, input, inFN))
+        return 1;
+    if (templateIn != NULL) {
+        tmpl = &watched[nwatched++];
+        if (watchFile(pfd.fd, tmpl, templateIn))
+            return 1;
+    }
+    for (i = 0; i < ICON_SLOTS; i++) {
+        if (iconSources[i].path == NULL)
+            continue;
+        iconFiles[i] = &watched[nwatched++];
+        if (watchFile(pfd.fd, iconFiles[i], iconSources[i].path))
+            return 1;
+    }
+    // Resources are read again on every build anyway
+    for (i = 0; i < nresources; i++) {
+        if (watchFile(pfd.fd, &watched[nwatched++], resources[i].path))
+            return 1;
+    }
+    printf("Watching %s for changes.\n", inFN);
+    fflush(stdout);
+
+    for (;;) {
+        // Wait for a change, then for a quiet period after the last one
+        ready = poll(&pfd, 1, pending ? WATCH_DEBOUNCE_MS : -1);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("Failed to wait for changes: %s\n", strerror(errno));
+            return 1;
+        }
+        if (ready > 0) {
+            pending |= readEvents(pfd.fd, watched, nwatched);
+            continue;
+        }
+        pending = 0;
+
+        headerChanged = 0;
+        if (tmpl != NULL && tmpl->changed) {
+            newHeader = g3a_readTemplate(templateIn, &fixedSum);
+            if (newHeader != NULL) {
+                free(header);
+                header = newHeader;
+                headerChanged = 1;
+            }
+        }
+        for (i = 0; i < ICON_SLOTS; i++) {
+            if (iconFiles[i] == NULL || !iconFiles[i]->changed)
+                continue;
+            if (loadIconSlot(icons, i)) {
+                printf("Keeping the previous icon from %s.\n",
+                       iconSources[i].path);
+                continue;
+            }
+            if (i == ICON_UNS && iconSources[ICON_MONO].path == NULL)
+                deriveMonoIcon(icons);
+            headerChanged = 1;
+        }
+        if (headerChanged && tmpl == NULL) {
+            g3a_fillIcons(header, icons);
+            fixedSum = g3a_fixedSum(header);
+        }
+        if (headerChanged && templateOut != NULL)
+            g3a_writeTemplate(templateOut, header);
+        for (i = 0; i < nwatched; i++)
+            watched[i].changed = 0;
+
+        if (g3a_mkG3AFromTemplate(inFN, outFN, header, fixedSum, resources,
+                                  nresources, buildFlags))
+            printf("Rebuild failed.  %s\n", failedOutput());
+        else
+            printf("Rebuilt %s.\n", outFN);
+        fflush(stdout);
+    }
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
 /*
  * Splits opt into a key value pair like 'key:value'.  Makes a copy of value
  * and puts it in v, and points k at the key, which is in opt.  Returns
@@ -142,9 +537,15 @@ int main(int argc, char **argv) {
     char *inFN, *outFN;
     struct lc_names names = {{{NULL}}};
     struct icons icons = {{0}, {0}, {0}};
+    struct g3a_header *header;
+    u32 fixedSum;
     char *version = "01.00.0000";
+    char *templateOut = NULL, *templateIn = NULL, *depFile = NULL;
+    char *metaIn = NULL, *resourceHeader = NULL;
+    struct g3a_meta meta;
+    int headerOpts = 0, watch = 0;
 
-    while ((c = getopt(argc, argv, ":n:i:V:hv")) != -1) {
+    while ((c = getopt(argc, argv, ":n:i:r:V:t:T:J:R:a:H:M:uwhv")) != -1) {
         switch (c) {
         case 'h':
             errors++; // Force help
@@ -153,6 +554,7 @@ int main(int argc, char **argv) {
             puts(VERSION);
             return 0;
         case 'n':
+            headerOpts++;
             status = splitAndStore(optarg, &storeNameSpec, &names);
             // 0 is straight up success (no additional processing)
             if (status == 1) {
@@ -163,12 +565,54 @@ int main(int argc, char **argv) {
             }
             break;
         case 'i':
+            headerOpts++;
             if (splitAndStore(optarg, &storeIconSpec, &icons))
                 errors++;
             break;
+        case 'r':
+            if (parseResizeMode(optarg, &resizeMode)) {
+                printf("Unknown resize mode: %s\n", optarg);
+                errors++;
+            }
+            break;
         case 'V':
+            headerOpts++;
             version = optarg;
             break;
+        case 't':
+            templateOut = optarg;
+            break;
+        case 'T':
+            templateIn = optarg;
+            break;
+        case 'J':
+            metaIn = optarg;
+            break;
+        case 'R':
+            if (splitAndStore(optarg, &storeResourceSpec, NULL))
+                errors++;
+            break;
+        case 'a':
+            resourceAlign = atoi(optarg);
+            if (resourceAlign == 0 || resourceAlign > 4096 ||
+                (resourceAlign & (resourceAlign - 1)) != 0) {
+                printf("Alignment must be a power of two up to 4096: %s\n",
+                       optarg);
+                errors++;
+            }
+            break;
+        case 'H':
+            resourceHeader = optarg;
+            break;
+        case 'M':
+            depFile = optarg;
+            break;
+        case 'u':
+            buildFlags |= G3A_UPDATE_IN_PLACE;
+            break;
+        case 'w':
+            watch = 1;
+            break;
         case ':':
             printf("Option -%c requires operand", optopt);
             errors++;
@@ -181,11 +625,32 @@ int main(int argc, char **argv) {
             assert(0); // BUG
         }
     }
+#ifndef HAVE_SYS_INOTIFY_H
+    if (watch) {
+        printf("Watching for changes is not supported on this system.\n");
+        errors++;
+    }
+#endif
     args = argc - optind;
+    if (args == 0 && resourceHeader != NULL && !errors)
+        return g3a_writeResourceHeader(resourceHeader, resources, nresources)
+                   ? 2
+                   : 0;
     if (errors || (args != 1 && args != 2)) {
         puts(USAGE);
         return 1;
     }
+    if (templateIn != NULL && headerOpts) {
+        printf("-n, -i and -V cannot be used with a header template (-T).\n");
+        return 1;
+    }
+    memset(&meta, 0, sizeof(meta));
+    if (metaIn != NULL && (headerOpts || templateIn != NULL)) {
+        printf("-n, -i, -V and -T cannot be used with metadata (-J).\n");
+        return 1;
+    }
+    if (metaIn != NULL && loadMeta(metaIn, &meta, &names, &version, &icons))
+        return 2;
 
     inFN = argv[optind];
     if (args < 2) {
@@ -206,12 +671,49 @@ int main(int argc, char **argv) {
         outFN = argv[optind + 1];
     }
 
-    if (names.basic == NULL)
-        names.basic = strdup(outFN);
-    if (g3a_mkG3A(inFN, outFN, &names, &icons, version)) {
-        printf("Operation failed.  Output file is probably broken.\n");
+    if (templateIn != NULL) {
+        addDependency(templateIn);
+        header = g3a_readTemplate(templateIn, &fixedSum);
+        if (header == NULL)
+            return 2;
+    } else {
+        if (names.basic == NULL)
+            names.basic = strdup(outFN);
+        if (iconSources[ICON_MONO].path == NULL)
+            deriveMonoIcon(&icons);
+        header = g3a_mkTemplate(&names, &icons, version);
+        if (header == NULL)
+            return 2;
+        fixedSum = g3a_fixedSum(header);
+        // Pinned, so the build does not fill them in
+        if (meta.timestamp != NULL)
+            strncpy(header->timestamp, meta.timestamp,
+                    sizeof(header->timestamp) - 1);
+        if (meta.filename != NULL)
+            strncpy(header->filename, meta.filename,
+                    sizeof(header->filename) - 1);
+    }
+    if (templateOut != NULL && g3a_writeTemplate(templateOut, header))
+        return 2;
+
+    if (g3a_mkG3AFromTemplate(inFN, outFN, header, fixedSum, resources,
+                              nresources, buildFlags)) {
+        printf("Operation failed.  %s\n", failedOutput());
         return 2;
     }
+    if (resourceHeader != NULL &&
+        g3a_writeResourceHeader(resourceHeader, resources, nresources))
+        return 2;
+    if (depFile != NULL && writeDepFile(depFile, outFN, inFN))
+        return 2;
+#ifdef HAVE_SYS_INOTIFY_H
+    if (watch)
+        return watchAndBuild(inFN, outFN, header, fixedSum, &icons, templateIn,
+                             templateOut)
+                   ? 2
+                   : 0;
+#endif
+    free(header);
 
     return 0;
 }
@@ -0,0 +1,30 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+#include "config.h"
+
+/*
+ * Static tracepoints for timing the packaging and image paths with
+ * bpftrace, perf or SystemTap, e.g.
+ *     bpftrace -e 'usdt:./mkg3a:mkg3a:raw_chunk { @bytes = hist(arg0); }'
+ * They compile to nothing unless USE_USDT is enabled in CMake.
+ *
+ * raw_entry (input path) and raw_return (body bytes, sum) bracket mapping
+ * and summing the body, with raw_chunk (chunk bytes, bytes so far) for each
+ * chunk summed.  header_write_entry and header_write_return bracket writing
+ * the output, the header included; the others bracket the function they
+ * are named after.
+ */
+#if USE_USDT
+#include <sys/sdt.h>
+#define PROBE(name) DTRACE_PROBE(mkg3a, name)
+#define PROBE1(name, a) DTRACE_PROBE1(mkg3a, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(mkg3a, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(mkg3a, name, a, b, c)
+#else
+#define PROBE(name) ((void)0)
+#define PROBE1(name, a) ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#endif /* USE_USDT */
+
+#endif /* _PROBES_H */
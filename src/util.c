@@ -1,9 +1,44 @@
+/* For O_TMPFILE */
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "config.h"
+#include "probes.h"
+#include "util.h"
+
+#ifdef HAVE_UNISTD_H
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_O_TMPFILE
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#if defined(HAVE_SEEK_DATA) || defined(HAVE_COPY_FILE_RANGE)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 static __inline u32 u32_flip(u32 v);
 static __inline u16 u16_flip(u16 v);
@@ -12,13 +47,13 @@ static __inline u16 u16_flip(u16 v);
  * Get file part of path, returning the beginning of basename or NULL if
  * path is a directory.
  */
-const char *basename(const char *path) {
+char *basename(const char *path) {
     const char *n = strrchr(path, '/');
     if (n == NULL)
-        return path;
+        return (char *)path;
     else if (strlen(n) == 0)
         return NULL;
-    return n;
+    return (char *)n;
 }
 
 /*
@@ -29,11 +64,27 @@ u32 checksum(const void *ptr, size_t bytes) {
     u8 *p = (u8 *)ptr;
     u32 sum = 0;
 
+    PROBE1(checksum_entry, bytes);
     for (i = 0; i < bytes; i++)
         sum += *p++;
+    PROBE2(checksum_return, bytes, sum);
     return sum;
 }
 
+/*
+ * 64-bit FNV-1a hash of bytes bytes at ptr, for telling contents apart
+ */
+u64 hash64(const void *ptr, size_t bytes) {
+    const u8 *p = ptr;
+    u64 h = 0xCBF29CE484222325ULL;
+
+    while (bytes--) {
+        h ^= *p++;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
 // Flip endianness of v
 static __inline u32 u32_flip(u32 v) {
     return (v >> 24 & 0xFF) | (v >> 8 & 0xFF00) | (v << 8 & 0xFF0000) |
@@ -97,3 +148,1104 @@ void *callocs(size_t count, size_t size) {
     }
     return r;
 }
+
+// Stand-in for zero-length files, which cannot be mapped
+static const u8 emptyFile[1];
+
+/*
+ * Maps the whole of the file at path read-only into memory, storing its
+ * length in size.  Where mmap() is unavailable the file is read into a heap
+ * buffer instead.  Returns NULL with errno set on failure; release the
+ * mapping with unmapFile.
+ */
+const void *mapFile(const char *path, size_t *size) {
+#ifdef HAVE_SYS_MMAN_H
+    struct stat st;
+    void *p;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return emptyFile;
+    }
+    p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    return p;
+#else
+    long len;
+    u8 *p;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    rewind(fp);
+    *size = len;
+    if (*size == 0) {
+        fclose(fp);
+        return emptyFile;
+    }
+    p = mallocs(*size);
+    if (fread(p, 1, *size, fp) != *size) {
+        free(p);
+        fclose(fp);
+        errno = EIO;
+        return NULL;
+    }
+    fclose(fp);
+    return p;
+#endif
+}
+
+void unmapFile(const void *p, size_t size) {
+    if (p == NULL || p == emptyFile)
+        return;
+#ifdef HAVE_SYS_MMAN_H
+    munmap((void *)p, size);
+#else
+    (void)size;
+    free((void *)p);
+#endif
+}
+
+/*
+ * Opens a temporary file beside path to hold its replacement, storing the
+ * temporary file's name in tmpPath.  Finish with commitReplacement.
+ * Returns NULL with errno set on failure.
+ */
+FILE *openReplacement(const char *path, char **tmpPath) {
+    FILE *fp;
+    *tmpPath = mallocs(strlen(path) + sizeof(".XXXXXX"));
+    strcpy(*tmpPath, path);
+#ifdef HAVE_UNISTD_H
+    struct stat st;
+    int fd;
+
+    strcat(*tmpPath, ".XXXXXX");
+    fd = mkstemp(*tmpPath);
+    if (fd < 0)
+        goto fail;
+    // mkstemp creates the file private; keep the permissions of the original
+    // or use the usual ones for a new file
+    if (stat(path, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+    fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        close(fd);
+        unlink(*tmpPath);
+        goto fail;
+    }
+#else
+    strcat(*tmpPath, ".tmp");
+    fp = fopen(*tmpPath, "wb");
+    if (fp == NULL)
+        goto fail;
+#endif
+    return fp;
+
+fail:
+    free(*tmpPath);
+    *tmpPath = NULL;
+    return NULL;
+}
+
+/*
+ * Closes fp from openReplacement and moves it over path, or discards it if
+ * failed is nonzero.  Frees tmpPath.  Returns nonzero with errno set if the
+ * replacement could not be completed.
+ */
+int commitReplacement(FILE *fp, char *tmpPath, const char *path, int failed) {
+    int err;
+    if (fclose(fp) != 0)
+        failed = 1;
+#ifndef HAVE_UNISTD_H
+    // rename() will not replace an existing file here
+    if (!failed)
+        remove(path);
+#endif
+    if (!failed && rename(tmpPath, path) != 0)
+        failed = 1;
+    if (failed) {
+        err = errno;
+        remove(tmpPath);
+        errno = err;
+    }
+    free(tmpPath);
+    return failed;
+}
+
+/*
+ * Adds size zero bytes to fp, by seeking over them where that leaves a hole.
+ * last is set if nothing more will be written after them.
+ */
+static int writeZeros(FILE *fp, size_t size, int last) {
+#ifdef HAVE_UNISTD_H
+    if (fseek(fp, size, SEEK_CUR) != 0)
+        return 1;
+    // Nothing after the hole to extend the file over it
+    return last && (fflush(fp) != 0 || ftruncate(fileno(fp), ftell(fp)) != 0);
+#else
+    static const u8 zeros[4096];
+    size_t len;
+    (void)last;
+
+    for (; size > 0; size -= len) {
+        len = size < sizeof(zeros) ? size : sizeof(zeros);
+        if (fwrite(zeros, 1, len, fp) != len)
+            return 1;
+    }
+    return 0;
+#endif
+}
+
+#ifdef HAVE_O_TMPFILE
+// Writes all n buffers in iov to fd, however many writev() calls it takes
+static int writeAll(int fd, struct iovec *iov, int n) {
+    ssize_t w;
+    int i;
+
+    for (i = 0; i < n;) {
+        w = writev(fd, iov + i, n - i);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        // Skip whatever was written, which may end partway through a part
+        for (; i < n && (size_t)w >= iov[i].iov_len; i++)
+            w -= iov[i].iov_len;
+        if (i < n) {
+            iov[i].iov_base = (u8 *)iov[i].iov_base + w;
+            iov[i].iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes parts to fd, each run of data parts with as few writev() calls as
+ * the kernel allows and holes by seeking over them.
+ */
+static int writeParts(int fd, const struct out_part *parts, int nparts) {
+    struct iovec *iov = mallocs(nparts * sizeof(*iov));
+    u64 total = 0;
+    int i, n = 0, failed = 0;
+
+    for (i = 0; i < nparts && !failed; i++) {
+        total += parts[i].size;
+        if (parts[i].data != NULL) {
+            if (parts[i].size == 0)
+                continue;
+            iov[n].iov_base = (void *)parts[i].data;
+            iov[n++].iov_len = parts[i].size;
+            continue;
+        }
+        failed = writeAll(fd, iov, n) ||
+                 lseek(fd, parts[i].size, SEEK_CUR) == (off_t)-1;
+        n = 0;
+    }
+    if (!failed)
+        failed = writeAll(fd, iov, n);
+    // A hole at the end only exists once the file is extended over it
+    if (!failed && nparts > 0 && parts[nparts - 1].data == NULL)
+        failed = ftruncate(fd, total) != 0;
+    free(iov);
+    return failed;
+}
+
+/*
+ * Gives the unnamed file fd from O_TMPFILE the name path, replacing any file
+ * already there.  linkat() never replaces, so in that case the file is
+ * linked under a temporary name which is renamed over path.
+ */
+static int linkTmpFile(int fd, const char *path) {
+    char proc[32], *tmpPath;
+    unsigned i;
+    int err;
+
+    sprintf(proc, "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, proc, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0)
+        return 0;
+    if (errno != EEXIST)
+        return 1;
+
+    tmpPath = mallocs(strlen(path) + 32);
+    for (i = 0;; i++) {
+        sprintf(tmpPath, "%s.%ld.%u", path, (long)getpid(), i);
+        if (linkat(AT_FDCWD, proc, AT_FDCWD, tmpPath, AT_SYMLINK_FOLLOW) == 0)
+            break;
+        if (errno != EEXIST || i == 100) {
+            free(tmpPath);
+            return 1;
+        }
+    }
+    if (rename(tmpPath, path) != 0) {
+        err = errno;
+        unlink(tmpPath);
+        free(tmpPath);
+        errno = err;
+        return 1;
+    }
+    free(tmpPath);
+    return 0;
+}
+
+/*
+ * Opens an unnamed file for writing in path's directory, with the mode of
+ * any file already at path.  Returns -1 if the filesystem does not support
+ * that.
+ */
+static int openTmpFile(const char *path) {
+    char *dir = mallocs(strlen(path) + 2);
+    char *slash;
+    struct stat st;
+    int fd;
+
+    strcpy(dir, path);
+    slash = strrchr(dir, '/');
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (slash == dir)
+        slash[1] = 0;
+    else
+        *slash = 0;
+    fd = open(dir, O_TMPFILE | O_WRONLY, 0666);
+    free(dir);
+    if (fd >= 0 && stat(path, &st) == 0)
+        fchmod(fd, st.st_mode & 07777);
+    return fd;
+}
+
+/*
+ * Links fd from openTmpFile into place as path, unless failed is set, and
+ * closes it.  Returns -1 if there is no /proc to link through, in which case
+ * path is untouched and the caller should fall back to openReplacement.
+ */
+static int closeTmpFile(int fd, const char *path, int failed) {
+    int err;
+
+    if (!failed)
+        failed = linkTmpFile(fd, path);
+    err = errno;
+    close(fd);
+    errno = err;
+    // No /proc: the unnamed file goes away with fd and path is untouched
+    if (failed && errno == ENOENT)
+        return -1;
+    return failed;
+}
+
+/*
+ * Writes parts to an unnamed file in path's directory and links it into
+ * place.  Returns -1 if that cannot be done here (no O_TMPFILE support in the
+ * filesystem, or no /proc to link through) and nothing was changed, so the
+ * caller should fall back to openReplacement.
+ */
+static int writeTmpFile(const char *path, const struct out_part *parts,
+                        int nparts) {
+    int fd = openTmpFile(path);
+    if (fd < 0)
+        return -1;
+    return closeTmpFile(fd, path, writeParts(fd, parts, nparts));
+}
+#endif
+
+/*
+ * Writes the nparts buffers in parts, in order, as the file path, replacing
+ * any existing file such that readers see either its old contents or all of
+ * the new ones.  Where O_TMPFILE is available this is one writev() to an
+ * unnamed file which is then linked into place.  Parts with NULL data are
+ * runs of zeros, left as holes where the filesystem allows.  Returns nonzero
+ * with errno set on failure, in which case path is left as it was.
+ */
+int writeReplacement(const char *path, const struct out_part *parts,
+                     int nparts) {
+    FILE *fp;
+    char *tmpPath;
+    int i, failed = 0;
+
+#ifdef HAVE_O_TMPFILE
+    failed = writeTmpFile(path, parts, nparts);
+    if (failed >= 0)
+        return failed;
+    failed = 0;
+#endif
+    fp = openReplacement(path, &tmpPath);
+    if (fp == NULL)
+        return 1;
+    for (i = 0; i < nparts; i++) {
+        if (parts[i].data != NULL)
+            failed |=
+                fwrite(parts[i].data, 1, parts[i].size, fp) != parts[i].size;
+        else
+            failed |= writeZeros(fp, parts[i].size, i == nparts - 1);
+    }
+    return commitReplacement(fp, tmpPath, path, failed);
+}
+
+/*
+ * Granularity at which zeros become holes in the output.  Blocks are
+ * counted from the start of the file, so they are also filesystem blocks.
+ */
+#define SPARSE_BLOCK 4096
+
+static int isZero(const u8 *p, size_t n) {
+    return p[0] == 0 && !memcmp(p, p + 1, n - 1);
+}
+
+/*
+ * Returns a copy of the nparts parts at parts in which each whole
+ * SPARSE_BLOCK of zeros in the data is a hole (NULL data), for writing with
+ * writeReplacement or updateFile.  Adjacent data and holes are joined, and
+ * the number of parts returned is stored in n.
+ */
+struct out_part *splitZeroBlocks(const struct out_part *parts, int nparts,
+                                 int *n) {
+    struct out_part *out, *last;
+    const u8 *p, *data;
+    size_t len, i;
+    u64 pos = 0, count = 0;
+    int k;
+
+    for (k = 0; k < nparts; k++)
+        count += parts[k].data == NULL ? 1 : parts[k].size / SPARSE_BLOCK + 2;
+    out = mallocs(count * sizeof(*out));
+    *n = 0;
+    for (k = 0; k < nparts; k++) {
+        p = parts[k].data;
+        for (i = 0; i < parts[k].size; i += len, pos += len) {
+            len = SPARSE_BLOCK - pos % SPARSE_BLOCK;
+            if (len > parts[k].size - i)
+                len = parts[k].size - i;
+            data = p == NULL || (len == SPARSE_BLOCK && isZero(p + i, len))
+                       ? NULL
+                       : p + i;
+            last = *n > 0 ? &out[*n - 1] : NULL;
+            if (last != NULL &&
+                (data == NULL ? last->data == NULL
+                              : last->data != NULL &&
+                                    (const u8 *)last->data + last->size ==
+                                        data)) {
+                last->size += len;
+                continue;
+            }
+            out[*n].data = data;
+            out[(*n)++].size = len;
+        }
+    }
+    return out;
+}
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H)
+/* Granularity at which updateFile compares and writes */
+#define UPDATE_BLOCK 4096
+/* Most blocks written by one pwrite() */
+#define UPDATE_RUN 64
+
+/*
+ * Position in a sequence of out_parts.
+ */
+struct part_cursor {
+    const struct out_part *parts;
+    int nparts;
+    int i;
+    size_t off;
+};
+
+/*
+ * Compares the next len bytes of the parts at c with old (of which oldLen
+ * bytes exist), advancing c past them.  Returns nonzero if they differ.
+ */
+static int partsDiffer(struct part_cursor *c, const u8 *old, size_t oldLen,
+                       size_t len) {
+    const struct out_part *p;
+    size_t n, k;
+    int differ = len > oldLen;
+
+    for (; len > 0; c->off = 0, c->i++) {
+        p = &c->parts[c->i];
+        n = p->size - c->off < len ? p->size - c->off : len;
+        k = n < oldLen ? n : oldLen;
+        if (!differ && p->data != NULL)
+            differ = memcmp((const u8 *)p->data + c->off, old, k) != 0;
+        else if (!differ)
+            differ = k > 0 && (old[0] != 0 || memcmp(old, old + 1, k - 1));
+        old += k;
+        oldLen -= k;
+        len -= n;
+        if (c->off + n < p->size) {
+            c->off += n;
+            break;
+        }
+    }
+    return differ;
+}
+
+// Copies the next len bytes of the parts at c to buf, advancing c
+static void copyParts(struct part_cursor *c, u8 *buf, size_t len) {
+    const struct out_part *p;
+    size_t n;
+
+    for (; len > 0; c->off = 0, c->i++) {
+        p = &c->parts[c->i];
+        n = p->size - c->off < len ? p->size - c->off : len;
+        if (p->data != NULL)
+            memcpy(buf, (const u8 *)p->data + c->off, n);
+        else
+            memset(buf, 0, n);
+        buf += n;
+        len -= n;
+        if (c->off + n < p->size) {
+            c->off += n;
+            break;
+        }
+    }
+}
+
+// Writes the len bytes at buf at offset off of fd
+static int writeRun(int fd, const u8 *buf, size_t len, u64 off) {
+    ssize_t w;
+
+    while (len > 0) {
+        w = pwrite(fd, buf, len, off);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return 1;
+        buf += w;
+        len -= w;
+        off += w;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Makes the file at path hold the nparts buffers in parts, like
+ * writeReplacement, but by changing an existing file in place: it is
+ * compared block by block with the new contents, only the blocks that
+ * differ are written, and then it is cut or extended to the new size.  A
+ * rebuild that changed little writes little, and blocks shared with other
+ * copies (reflinks) stay shared.  Readers may see a partly updated file
+ * meanwhile.  If path does not exist yet it is written with
+ * writeReplacement.  Stores the number of bytes written in written unless
+ * that is NULL.  Returns nonzero with errno set on failure.
+ */
+int updateFile(const char *path, const struct out_part *parts, int nparts,
+               u64 *written) {
+    u64 size = 0;
+    int i;
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H)
+    struct part_cursor cmp = {parts, nparts, 0, 0}, copy;
+    const u8 *old = NULL;
+    size_t oldSize, len, runLen = 0;
+    u64 off, runStart = 0, done = 0;
+    struct stat st;
+    int fd, failed = 0;
+    u8 *run;
+#endif
+
+    for (i = 0; i < nparts; i++)
+        size += parts[i].size;
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H)
+    fd = open(path, O_RDWR);
+    if (fd < 0 && errno == ENOENT)
+        goto replace;
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 1;
+    }
+    oldSize = st.st_size;
+    if (oldSize > 0) {
+        old = mmap(NULL, oldSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (old == MAP_FAILED) {
+            close(fd);
+            return 1;
+        }
+    }
+
+    // Runs of changed blocks are gathered into one write
+    run = mallocs(UPDATE_BLOCK * UPDATE_RUN);
+    copy = cmp;
+    for (off = 0; off < size && !failed; off += len) {
+        len = size - off < UPDATE_BLOCK ? size - off : UPDATE_BLOCK;
+        if (off < oldSize ? !partsDiffer(&cmp, old + off, oldSize - off, len)
+                          : !partsDiffer(&cmp, NULL, 0, len)) {
+            failed = writeRun(fd, run, runLen, runStart);
+            done += runLen;
+            runLen = 0;
+            copy = cmp;
+            continue;
+        }
+        if (runLen == 0)
+            runStart = off;
+        copyParts(&copy, run + runLen, len);
+        runLen += len;
+        if (runLen == UPDATE_BLOCK * UPDATE_RUN) {
+            failed = writeRun(fd, run, runLen, runStart);
+            done += runLen;
+            runLen = 0;
+        }
+    }
+    if (!failed) {
+        failed = writeRun(fd, run, runLen, runStart);
+        done += runLen;
+    }
+    if (!failed && oldSize != size)
+        failed = ftruncate(fd, size) != 0;
+    free(run);
+    if (old != NULL)
+        munmap((void *)old, oldSize);
+    if (close(fd) != 0)
+        failed = 1;
+    if (written != NULL)
+        *written = done;
+    return failed;
+
+replace:
+#endif
+    if (written != NULL)
+        *written = size;
+    return writeReplacement(path, parts, nparts);
+}
+
+// Asks for the len bytes at p, if mapped from a file, to be read in soon
+static void willNeed(const u8 *p, size_t len) {
+#ifdef HAVE_SYS_MMAN_H
+    static uintptr_t pageSize;
+    uintptr_t start;
+
+    if (pageSize == 0)
+        pageSize = sysconf(_SC_PAGESIZE);
+    start = (uintptr_t)p & ~(pageSize - 1);
+    madvise((void *)start, (uintptr_t)p + len - start, MADV_WILLNEED);
+#else
+    (void)p;
+    (void)len;
+#endif
+}
+
+/*
+ * Adds the data in the nparts parts at parts, which start at offset pos in
+ * the output, to sum IO_CHUNK bytes at a time.  The kernel is asked to read
+ * IO_BUFFERS chunks ahead of the one being summed, so on a slow filesystem
+ * the reads overlap the summing.  Each chunk summed is then passed to put,
+ * if not NULL, with its offset.  Returns nonzero as soon as put does.
+ */
+static int sumChunks(const struct out_part *parts, int nparts, u64 pos,
+                     u32 *sum,
+                     int (*put)(void *ctx, const u8 *data, size_t size,
+                                u64 off),
+                     void *ctx) {
+    const size_t window = (size_t)IO_CHUNK * IO_BUFFERS;
+    const u8 *p;
+    size_t size, off, len;
+    u64 summed = 0;
+    int i;
+
+    for (i = 0; i < nparts; pos += parts[i++].size) {
+        p = parts[i].data;
+        size = parts[i].size;
+        if (p == NULL || size == 0)
+            continue;
+        willNeed(p, size < window ? size : window);
+        for (off = 0; off < size; off += len) {
+            len = size - off < IO_CHUNK ? size - off : IO_CHUNK;
+            // Keep the window full as each chunk leaves it
+            if (off + window < size)
+                willNeed(p + off + window, size - off - window < IO_CHUNK
+                                               ? size - off - window
+                                               : IO_CHUNK);
+            *sum += checksum(p + off, len);
+            summed += len;
+            PROBE2(raw_chunk, len, summed);
+            if (put != NULL && put(ctx, p + off, len, pos + off))
+                return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Sums the data in the nparts parts at parts.  Holes add nothing.
+ */
+u32 sumParts(const struct out_part *parts, int nparts) {
+    u32 sum = 0;
+
+    sumChunks(parts, nparts, 0, &sum, NULL, NULL);
+    return sum;
+}
+
+#if defined(HAVE_O_TMPFILE) && defined(HAVE_PTHREAD) && \
+    defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H) && IO_BUFFERS > 1
+#define HAVE_WRITE_QUEUE
+/*
+ * Chunks summed by writeSummedTmpFile and waiting for its writer thread.
+ * A chunk stays in the queue until written, so at most IO_BUFFERS are in
+ * flight.
+ */
+struct write_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct {
+        const u8 *data;
+        size_t size;
+        u64 off;
+    } chunks[IO_BUFFERS];
+    // Chunks written and chunks added so far
+    unsigned head, tail;
+    int fd, done, failed, err;
+};
+
+/*
+ * Writes the len bytes at p at offset off of fd like writeRun, but leaves
+ * out whole SPARSE_BLOCKs of zeros, which become holes in a new file.
+ */
+static int writeSparse(int fd, const u8 *p, size_t len, u64 off) {
+    size_t run = 0, n;
+
+    while (len > 0) {
+        n = SPARSE_BLOCK - (off + run) % SPARSE_BLOCK;
+        if (n > len)
+            n = len;
+        if (n == SPARSE_BLOCK && isZero(p + run, n)) {
+            if (writeRun(fd, p, run, off))
+                return 1;
+            p += run + n;
+            off += run + n;
+            run = 0;
+        } else {
+            run += n;
+        }
+        len -= n;
+    }
+    return writeRun(fd, p, run, off);
+}
+
+static void *writeQueued(void *arg) {
+    struct write_queue *q = arg;
+    unsigned i;
+    int failed;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->head == q->tail && !q->done)
+            pthread_cond_wait(&q->changed, &q->lock);
+        if (q->head == q->tail)
+            break;
+        i = q->head % IO_BUFFERS;
+        pthread_mutex_unlock(&q->lock);
+        failed = writeSparse(q->fd, q->chunks[i].data, q->chunks[i].size,
+                             q->chunks[i].off);
+        pthread_mutex_lock(&q->lock);
+        if (failed && !q->failed) {
+            q->failed = 1;
+            q->err = errno;
+        }
+        q->head++;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static int queueChunk(void *ctx, const u8 *data, size_t size, u64 off) {
+    struct write_queue *q = ctx;
+    unsigned i;
+    int failed;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->tail - q->head == IO_BUFFERS && !q->failed)
+        pthread_cond_wait(&q->changed, &q->lock);
+    failed = q->failed;
+    if (!failed) {
+        i = q->tail++ % IO_BUFFERS;
+        q->chunks[i].data = data;
+        q->chunks[i].size = size;
+        q->chunks[i].off = off;
+        pthread_cond_broadcast(&q->changed);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return failed;
+}
+
+/*
+ * writeSummedReplacement through an unnamed file: the calling thread sums
+ * each chunk and a writer thread writes it, while the kernel reads ahead,
+ * so reading, summing and writing all overlap.  The first and last parts
+ * are written once finish has filled them in.  Returns -1 if this cannot be
+ * done here, having set finished if finish was already called.
+ */
+static int writeSummedTmpFile(const char *path, const struct out_part *parts,
+                              int nparts, void (*finish)(void *ctx, u32 sum),
+                              void *ctx, int *finished) {
+    const struct out_part *last = &parts[nparts - 1];
+    struct write_queue q;
+    pthread_t writer;
+    u64 lastOff = 0;
+    u32 sum = 0;
+    int i, failed;
+
+    q.fd = openTmpFile(path);
+    if (q.fd < 0)
+        return -1;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.changed, NULL);
+    q.head = q.tail = 0;
+    q.done = q.failed = 0;
+    if (pthread_create(&writer, NULL, writeQueued, &q) != 0) {
+        failed = -1;
+        close(q.fd);
+        goto out;
+    }
+    failed = sumChunks(parts + 1, nparts - 2, parts[0].size, &sum, queueChunk,
+                       &q);
+    pthread_mutex_lock(&q.lock);
+    q.done = 1;
+    pthread_cond_broadcast(&q.changed);
+    pthread_mutex_unlock(&q.lock);
+    pthread_join(writer, NULL);
+    if (q.failed) {
+        failed = 1;
+        errno = q.err;
+    }
+
+    if (!failed) {
+        finish(ctx, sum);
+        *finished = 1;
+        for (i = 0; i < nparts - 1; i++)
+            lastOff += parts[i].size;
+        if (parts[0].data != NULL)
+            failed = writeRun(q.fd, parts[0].data, parts[0].size, 0);
+        if (!failed && last->data != NULL)
+            failed = writeRun(q.fd, last->data, last->size, lastOff);
+        else if (!failed)
+            failed = ftruncate(q.fd, lastOff + last->size) != 0;
+    }
+    failed = closeTmpFile(q.fd, path, failed);
+out:
+    pthread_cond_destroy(&q.changed);
+    pthread_mutex_destroy(&q.lock);
+    return failed;
+}
+#endif
+
+/*
+ * Like writeReplacement, but for a file that holds a sum of its own
+ * contents: parts[1] to parts[nparts - 2] are summed as they are written,
+ * then finish(ctx, sum) fills in parts[0] and parts[nparts - 1], which are
+ * written last.  Whole SPARSE_BLOCKs of zeros become holes, like holes in
+ * parts.  Where threads and O_TMPFILE are available a file of more than one
+ * chunk is summed and written IO_CHUNK bytes at a time with up to
+ * IO_BUFFERS chunks in flight (see sumChunks), so that on slow or network
+ * filesystems the reads, the summing and the writes overlap rather than
+ * taking turns; the data is only read as it is summed.  Returns nonzero
+ * with errno set on failure.
+ */
+int writeSummedReplacement(const char *path, const struct out_part *parts,
+                           int nparts, void (*finish)(void *ctx, u32 sum),
+                           void *ctx) {
+    struct out_part *split;
+    int finished = 0, failed, n;
+#ifdef HAVE_WRITE_QUEUE
+    u64 size = 0;
+    int i;
+
+    for (i = 1; i < nparts - 1; i++)
+        size += parts[i].size;
+    // A single chunk has nothing to overlap with
+    if (size > IO_CHUNK) {
+        failed = writeSummedTmpFile(path, parts, nparts, finish, ctx,
+                                    &finished);
+        if (failed >= 0)
+            return failed;
+    }
+#endif
+    if (!finished)
+        finish(ctx, sumParts(parts + 1, nparts - 2));
+    split = splitZeroBlocks(parts, nparts, &n);
+    failed = writeReplacement(path, split, n);
+    free(split);
+    return failed;
+}
+
+/*
+ * Copies size bytes from offset in the file from to the file to, replacing
+ * anything there.  Where copy_file_range() is available the data never
+ * passes through user space, and filesystems that support it share the
+ * blocks (a reflink) rather than copying them.  Returns nonzero with errno
+ * set on failure.
+ */
+int copyFilePart(const char *from, u64 offset, u64 size, const char *to) {
+    const u8 *data;
+    size_t len;
+    FILE *fp;
+    int failed;
+#ifdef HAVE_COPY_FILE_RANGE
+    loff_t pos = offset;
+    u64 copied = 0;
+    ssize_t n;
+    int in, out;
+
+    in = open(from, O_RDONLY);
+    if (in < 0)
+        return 1;
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out < 0) {
+        close(in);
+        return 1;
+    }
+    for (failed = 0; copied < size;) {
+        n = copy_file_range(in, &pos, out, NULL, size - copied, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO; // from ends before offset + size
+            failed = 1;
+            break;
+        }
+        copied += n;
+    }
+    close(in);
+    if (close(out) != 0)
+        failed = 1;
+    // Copy by hand if nothing went through, as across filesystems on older
+    // kernels
+    if (!failed || copied > 0 ||
+        (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP &&
+         errno != EINVAL))
+        return failed;
+#endif
+
+    data = mapFile(from, &len);
+    if (data == NULL)
+        return 1;
+    if (offset > len || size > len - offset) {
+        unmapFile(data, len);
+        errno = EINVAL;
+        return 1;
+    }
+    fp = fopen(to, "wb");
+    if (fp == NULL) {
+        unmapFile(data, len);
+        return 1;
+    }
+    failed = fwrite(data + offset, 1, size, fp) != size;
+    failed |= fclose(fp) != 0;
+    unmapFile(data, len);
+    return failed;
+}
+
+/*
+ * Finds the parts of the first size bytes of the file at path which hold
+ * data, as pairs of start and end offsets, storing how many pairs there are
+ * in nregions.  Everything outside them is a hole and reads as zeros, so
+ * need not be looked at.  Where holes cannot be found, or on any error, the
+ * whole file is one region.  Free the result when done.
+ */
+size_t *findDataRegions(const char *path, size_t size, int *nregions) {
+    size_t *regions = mallocs(2 * sizeof(*regions));
+    int n = 0;
+#ifdef HAVE_SEEK_DATA
+    off_t start, end = 0;
+    int fd = open(path, O_RDONLY);
+
+    while (fd >= 0 && (size_t)end < size) {
+        start = lseek(fd, end, SEEK_DATA);
+        if (start == (off_t)-1) {
+            // ENXIO: only a hole remains
+            if (errno != ENXIO)
+                n = -1;
+            break;
+        }
+        if ((size_t)start >= size)
+            break;
+        end = lseek(fd, start, SEEK_HOLE);
+        if (end == (off_t)-1) {
+            n = -1;
+            break;
+        }
+        if ((size_t)end > size)
+            end = size;
+        regions = realloc(regions, 2 * (n + 1) * sizeof(*regions));
+        if (regions == NULL) {
+            printf("Failed to allocate memory; aborting.\n");
+            exit(2);
+        }
+        regions[2 * n] = start;
+        regions[2 * n++ + 1] = end;
+    }
+    if (fd < 0)
+        n = -1;
+    else
+        close(fd);
+    if (n >= 0) {
+        *nregions = n;
+        return regions;
+    }
+#else
+    (void)path;
+#endif
+    regions[0] = 0;
+    regions[1] = size;
+    *nregions = n = 1;
+    return regions;
+}
+
+/*
+ * Returns nonzero if path names a directory.
+ */
+int isDirectory(const char *path) {
+#ifdef HAVE_DIRENT_H
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#else
+    (void)path;
+    return 0;
+#endif
+}
+
+/*
+ * Calls found(path, ctx) for every file under the directory dir (recursing
+ * into subdirectories) whose name ends with suffix.  Returns nonzero with
+ * errno set if a directory could not be read.
+ */
+int findFiles(const char *dir, const char *suffix,
+              void (*found)(const char *path, void *ctx), void *ctx) {
+#ifdef HAVE_DIRENT_H
+    struct dirent *de;
+    int err = 0;
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return 1;
+
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        char *path;
+
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        path = mallocs(strlen(dir) + len + 2);
+        sprintf(path, "%s/%s", dir, de->d_name);
+        if (isDirectory(path)) {
+            err |= findFiles(path, suffix, found, ctx);
+        } else if (len >= strlen(suffix) &&
+                   !strcmp(de->d_name + len - strlen(suffix), suffix)) {
+            found(path, ctx);
+        }
+        free(path);
+    }
+    closedir(d);
+    return err;
+#else
+    (void)dir;
+    (void)suffix;
+    (void)found;
+    (void)ctx;
+    errno = ENOSYS;
+    return 1;
+#endif
+}
+
+/*
+ * Number of threads worth running by default: one per online CPU.
+ */
+int defaultJobs(void) {
+#if defined(HAVE_PTHREAD) && defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0)
+        return n;
+#endif
+    return 1;
+}
+
+struct parallel_state {
+    void (*fn)(void *ctx, size_t i);
+    void *ctx;
+    size_t count, next;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+};
+
+static void *parallelWorker(void *arg) {
+    struct parallel_state *st = arg;
+    size_t i;
+
+    for (;;) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&st->lock);
+#endif
+        i = st->next++;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&st->lock);
+#endif
+        if (i >= st->count)
+            return NULL;
+        st->fn(st->ctx, i);
+    }
+}
+
+/*
+ * Calls fn(ctx, i) for every i below count, spread over up to jobs threads.
+ * Runs everything on the calling thread if jobs < 2 or threads are not
+ * supported.
+ */
+void parallelFor(int jobs, size_t count, void (*fn)(void *ctx, size_t i),
+                 void *ctx) {
+    struct parallel_state st;
+#ifdef HAVE_PTHREAD
+    pthread_t *threads;
+    int i, started = 0;
+#endif
+
+    st.fn = fn;
+    st.ctx = ctx;
+    st.count = count;
+    st.next = 0;
+#ifdef HAVE_PTHREAD
+
+    pthread_mutex_init(&st.lock, NULL);
+    if ((size_t)jobs > count)
+        jobs = count;
+    if (jobs > 1) {
+        threads = mallocs(jobs * sizeof(*threads));
+        // Handles are kept densely so that only started threads are joined
+        for (i = 0; i < jobs; i++) {
+            if (pthread_create(&threads[started], NULL, parallelWorker,
+                               &st) == 0)
+                started++;
+        }
+        // Pick up the slack if any threads failed to start
+        if (started < jobs)
+            parallelWorker(&st);
+        for (i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+    } else {
+        parallelWorker(&st);
+    }
+    pthread_mutex_destroy(&st.lock);
+#else
+    (void)jobs;
+    parallelWorker(&st);
+#endif
+}
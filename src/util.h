@@ -1,11 +1,39 @@
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "config.h"
 
 char *basename(const char *path);
 u32 checksum(const void *ptr, size_t bytes);
+u64 hash64(const void *ptr, size_t bytes);
 void *mallocs(size_t size);
 void *callocs(size_t count, size_t size);
+const void *mapFile(const char *path, size_t *size);
+void unmapFile(const void *p, size_t size);
+FILE *openReplacement(const char *path, char **tmpPath);
+int commitReplacement(FILE *fp, char *tmpPath, const char *path, int failed);
+struct out_part {
+    const void *data;
+    size_t size;
+};
+int writeReplacement(const char *path, const struct out_part *parts,
+                     int nparts);
+struct out_part *splitZeroBlocks(const struct out_part *parts, int nparts,
+                                 int *n);
+u32 sumParts(const struct out_part *parts, int nparts);
+int writeSummedReplacement(const char *path, const struct out_part *parts,
+                           int nparts, void (*finish)(void *ctx, u32 sum),
+                           void *ctx);
+int updateFile(const char *path, const struct out_part *parts, int nparts,
+               u64 *written);
+int copyFilePart(const char *from, u64 offset, u64 size, const char *to);
+size_t *findDataRegions(const char *path, size_t size, int *nregions);
+int isDirectory(const char *path);
+int findFiles(const char *dir, const char *suffix,
+              void (*found)(const char *path, void *ctx), void *ctx);
+int defaultJobs(void);
+void parallelFor(int jobs, size_t count, void (*fn)(void *ctx, size_t i),
+                 void *ctx);
 
 void dumpb_u16(u16 v, u16 *loc);
 void dumpb_u32(u32 v, u32 *loc);
@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Runs one golden-corpus case for ctest: a tool that must write exactly the
+ * file checked in as the golden copy, within a time and peak memory budget.
+ * With GOLDEN_UPDATE set in the environment the output replaces the golden
+ * copy instead, for changes that are meant to alter the output.
+ */
+
+static void usage(void) {
+    printf("Usage: golden-run [-t ms] [-m KiB] <output> <golden> <command> "
+           "[arg]...\n");
+    printf("\nRuns command, which should write output, and fails unless it\n"
+           "succeeds within the budgets and output matches golden byte for\n"
+           "byte.\n");
+}
+
+static unsigned char *readFile(const char *path, size_t *size) {
+    unsigned char *data;
+    long len;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 ||
+        fseek(fp, 0, SEEK_SET) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    data = malloc(len + 1);
+    if (data == NULL || fread(data, 1, len, fp) != (size_t)len) {
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    *size = len;
+    return data;
+}
+
+static int writeFile(const char *path, const unsigned char *data,
+                     size_t size) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+        return 1;
+    if (fwrite(data, 1, size, fp) != size) {
+        fclose(fp);
+        return 1;
+    }
+    return fclose(fp) != 0;
+}
+
+static double elapsedMs(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 +
+           (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main(int argc, char **argv) {
+    long timeBudget = 0, memoryBudget = 0, peak;
+    const char *output, *golden;
+    unsigned char *out, *ref;
+    size_t outSize, refSize, i;
+    struct timespec start;
+    struct rusage ru;
+    double ms;
+    int c, status;
+    pid_t pid;
+
+    while ((c = getopt(argc, argv, "+t:m:h")) != -1) {
+        switch (c) {
+        case 't':
+            timeBudget = atol(optarg);
+            break;
+        case 'm':
+            memoryBudget = atol(optarg);
+            break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (argc - optind < 3) {
+        usage();
+        return 1;
+    }
+    output = argv[optind];
+    golden = argv[optind + 1];
+
+    // A file left over from an earlier run must not pass for new output
+    remove(output);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        execvp(argv[optind + 2], argv + optind + 2);
+        perror(argv[optind + 2]);
+        _exit(127);
+    }
+    if (wait4(pid, &status, 0, &ru) != pid) {
+        perror("wait4");
+        return 1;
+    }
+    ms = elapsedMs(&start);
+#ifdef __APPLE__
+    peak = ru.ru_maxrss / 1024;
+#else
+    peak = ru.ru_maxrss;
+#endif
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%s failed with status %d\n", argv[optind + 2],
+               WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return 1;
+    }
+    printf("%s: %.1f ms, peak %ld KiB\n", output, ms, peak);
+
+    out = readFile(output, &outSize);
+    if (out == NULL) {
+        printf("Unable to read %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+    if (getenv("GOLDEN_UPDATE") != NULL) {
+        if (writeFile(golden, out, outSize)) {
+            printf("Unable to write %s: %s\n", golden, strerror(errno));
+            return 1;
+        }
+        printf("Updated %s\n", golden);
+        free(out);
+        return 0;
+    }
+    ref = readFile(golden, &refSize);
+    if (ref == NULL) {
+        printf("Unable to read %s: %s\n", golden, strerror(errno));
+        return 1;
+    }
+
+    status = 0;
+    for (i = 0; i < outSize && i < refSize && out[i] == ref[i]; i++)
+        ;
+    if (i < outSize || i < refSize) {
+        printf("%s differs from %s at byte 0x%lX (%lu and %lu bytes)\n",
+               output, golden, (unsigned long)i, (unsigned long)outSize,
+               (unsigned long)refSize);
+        status = 1;
+    }
+    if (timeBudget > 0 && ms > timeBudget) {
+        printf("Took %.1f ms, over the budget of %ld ms\n", ms, timeBudget);
+        status = 1;
+    }
+    if (memoryBudget > 0 && peak > memoryBudget) {
+        printf("Peak memory %ld KiB is over the budget of %ld KiB\n", peak,
+               memoryBudget);
+        status = 1;
+    }
+    free(out);
+    free(ref);
+    return status;
+}
@@ -0,0 +1,92 @@
+#!/bin/sh
+## Times mkg3a writing a g3a with a large body under different IO_CHUNK and
+## IO_BUFFERS settings (see src/CMakeLists.txt), to show what the overlapped
+## writer gains on a given filesystem and to tune it there.  Each setting is
+## built separately, then each run starts with a cold page cache and ends
+## once the output has been synced.
+##
+##     io-bench.sh [-s MiB] [-n runs] [-t major:minor:bytes/s] dir
+##                 [chunk:buffers]...
+##
+## dir is where the body and output go, such as a network or FUSE mount.
+## -t throttles reads and writes on a block device with the cgroup v1 blkio
+## controller, for example on a loop device holding a scratch filesystem:
+##
+##     truncate -s 1G slow.img && mkfs.ext4 -q slow.img
+##     mount -o loop slow.img /mnt/slow
+##     tests/io-bench.sh -t 7:0:8388608 /mnt/slow
+##
+## The body (12 MiB by default) must stay under mkg3a's 16 MiB limit.
+## Dropping the page cache and -t need root.
+
+set -e
+
+size=12
+runs=3
+throttle=
+while getopts s:n:t: opt; do
+    case $opt in
+    s) size=$OPTARG ;;
+    n) runs=$OPTARG ;;
+    t) throttle=$OPTARG ;;
+    *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 [-s MiB] [-n runs] [-t major:minor:bytes/s] dir" \
+         "[chunk:buffers]..." >&2
+    exit 1
+fi
+dir=$1
+shift
+[ $# -gt 0 ] || set -- 262144:1 262144:2 262144:4 1048576:4 65536:16
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+build=${IO_BENCH_BUILD:-${TMPDIR:-/tmp}/mkg3a-io-bench}
+
+for setting; do
+    cmake -S "$src" -B "$build/$setting" -DUSE_PNG=OFF \
+          -DIO_CHUNK="${setting%:*}" -DIO_BUFFERS="${setting#*:}" >/dev/null
+    cmake --build "$build/$setting" --target mkg3a >/dev/null
+done
+
+# Random data, so that no block is left as a hole
+body=$dir/io-bench.bin
+out=$dir/io-bench.g3a
+dd if=/dev/urandom of="$body" bs=1048576 count="$size" 2>/dev/null
+
+if [ -n "$throttle" ]; then
+    cg=/sys/fs/cgroup/blkio/mkg3a-io-bench
+    mkdir -p $cg
+    echo "${throttle%:*} ${throttle##*:}" >$cg/blkio.throttle.read_bps_device
+    echo "${throttle%:*} ${throttle##*:}" >$cg/blkio.throttle.write_bps_device
+    echo $$ >$cg/cgroup.procs
+fi
+
+coldCache() {
+    sync
+    echo 3 2>/dev/null >/proc/sys/vm/drop_caches ||
+        echo "Unable to drop the page cache; times are for a warm cache" >&2
+}
+
+echo "$size MiB body in $dir, best of $runs"
+for setting; do
+    best=
+    i=0
+    while [ $i -lt "$runs" ]; do
+        rm -f "$out"
+        coldCache
+        start=$(date +%s%N)
+        "$build/$setting/src/mkg3a" "$body" "$out"
+        sync "$out"
+        ms=$((($(date +%s%N) - start) / 1000000))
+        if [ -z "$best" ] || [ $ms -lt "$best" ]; then
+            best=$ms
+        fi
+        i=$((i + 1))
+    done
+    printf "IO_CHUNK %8s  IO_BUFFERS %3s  %6s ms\n" \
+           "${setting%:*}" "${setting#*:}" "$best"
+done
+rm -f "$body" "$out"